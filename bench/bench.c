@@ -0,0 +1,509 @@
+// generates a synthetic source tree and times every phase of pp on it, plus the build through the generated compile.c
+// gcc -O2 -pthread bench/bench.c -o bench -lm && ./bench [options] > result.json
+//   -d depth       directory depth (default 3)
+//   -f fan_out     subdirectories per directory (default 8)
+//   -n files       number of files, spread over the leaf directories (default 5000)
+//   -s bytes       median file size, sizes are log-normal around it (default 4096)
+//   -S sigma       spread of the size distribution (default 1.0)
+//   -H percent     share of the files that are headers (default 20)
+//   -i includes    headers included by every source, half as many by every header (default 4)
+//   -r runs        runs per variant, the fastest is reported (default 3)
+//   -t threads     threads of the directory walk (default: number of online cpus)
+//   -p             walk and copy at the same time (--pipeline) with the -t threads copying
+//   -u depth       copy through io_uring with depth files in flight (default 0, off)
+//   -b             also build the package with compile.c (slow for large trees), then rebuild it after touching one source
+//   -w workers     with -b, start that many pp --serve workers of one slot on unix sockets and build once more through them
+//   -o dir         where to generate the tree (default /tmp/pp_bench)
+// Every run starts from an empty package. The cold variant evicts the tree from the page cache with posix_fadvise before each
+// phase, and also drops the dentry and inode caches when /proc/sys/vm/drop_caches is writable.
+#define main pp_main
+#include "../main.c"
+#undef main
+
+#include <ftw.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+typedef struct tree_options_t tree_options_t;
+struct tree_options_t {
+    uint64_t depth;
+    uint64_t fan_out;
+    uint64_t files;
+    uint64_t size;
+    double sigma;
+    uint64_t header_percent;
+    uint64_t includes;
+};
+
+typedef struct tree_t tree_t;
+struct tree_t {
+    char** dirs; // leaf directories
+    uint64_t n_dirs;
+    uint64_t n_all_dirs;
+    char** headers;
+    uint64_t n_headers;
+    uint64_t n_sources;
+    uint64_t bytes;
+};
+
+uint64_t rng_state = 0x853c49e6748fea9bull;
+
+uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+double rng_normal(void)
+{
+    double u = (rng() >> 11) * (1.0 / 9007199254740992.0) + 1e-12;
+    double v = (rng() >> 11) * (1.0 / 9007199254740992.0);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+void make_dirs(tree_t* t, char* dir, uint64_t depth, uint64_t fan_out)
+{
+    panic_if(mkdir(dir, 0755) < 0 && errno != EEXIST, "could not create %s: %s", dir, strerror(errno));
+    t->n_all_dirs++;
+    if (depth == 0) {
+        t->dirs = realloc(t->dirs, (t->n_dirs + 1) * sizeof(*t->dirs));
+        t->dirs[t->n_dirs++] = strdup(dir);
+        return;
+    }
+    uint64_t i;
+    for (i = 0; i < fan_out; i++) {
+        char* sub;
+        panic_if(asprintf(&sub, "%s/dir_%02lu", dir, i) < 0, "could not allocate path");
+        make_dirs(t, sub, depth - 1, fan_out);
+        free(sub);
+    }
+}
+
+// pads the file with arithmetic until it reaches size bytes, so that the compiler has real work proportional to the size
+void write_body(FILE* f, char* fn_name, uint64_t size)
+{
+    fprintf(f, "int %s(int x)\n{\n", fn_name);
+    uint64_t i;
+    for (i = 0; (uint64_t)ftell(f) < size; i++) {
+        fprintf(f, "    x = x * %lu + %lu;\n", 2 * i + 3, i);
+    }
+    fprintf(f, "    return x;\n}\n");
+}
+
+void generate_tree(tree_t* t, tree_options_t* o)
+{
+    make_dirs(t, "src", o->depth, o->fan_out);
+    uint64_t n_headers = o->files * o->header_percent / 100;
+    t->headers = calloc(n_headers + 1, sizeof(*t->headers));
+    uint64_t i;
+    for (i = 0; i < o->files; i++) {
+        bool header = i < n_headers;
+        char* dir = t->dirs[rng() % t->n_dirs];
+        char* name;
+        panic_if(asprintf(&name, "%s/%s_%05lu.%c", dir, header ? "h" : "c", i, header ? 'h' : 'c') < 0, "could not allocate path");
+        FILE* f = fopen(name, "w");
+        panic_if(f == NULL, "could not create %s: %s", name, strerror(errno));
+        uint64_t size = o->size * exp(o->sigma * rng_normal());
+        uint64_t n_includes = header ? o->includes / 2 : o->includes;
+        uint64_t available = header ? i : n_headers;
+        if (header) {
+            fprintf(f, "#ifndef H_%05lu\n#define H_%05lu\n", i, i);
+        }
+        uint64_t j;
+        for (j = 0; j < n_includes && available > 0; j++) {
+            fprintf(f, "#include \"%s\"\n", t->headers[rng() % available] + strlen("src/"));
+        }
+        char fn_name[32];
+        if (header) {
+            snprintf(fn_name, sizeof(fn_name), "h_%05lu", i);
+            fprintf(f, "int %s(int x);\n", fn_name);
+            for (j = 0; (uint64_t)ftell(f) < size; j++) {
+                fprintf(f, "#define H_%05lu_%lu %lu\n", i, j, j);
+            }
+            fprintf(f, "#endif\n");
+            t->headers[t->n_headers++] = name;
+        } else {
+            snprintf(fn_name, sizeof(fn_name), i == n_headers ? "main" : "c_%05lu", i);
+            write_body(f, fn_name, size);
+            t->n_sources++;
+            free(name);
+        }
+        t->bytes += ftell(f);
+        fclose(f);
+    }
+}
+
+int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+void remove_tree(char* path)
+{
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+int evict_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)ftw;
+    if (flag == FTW_F && S_ISREG(st->st_mode)) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+void evict(void)
+{
+    sync();
+    nftw(".", evict_entry, 64, FTW_PHYS);
+    FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (f != NULL) {
+        fputs("3\n", f);
+        fclose(f);
+    }
+}
+
+typedef struct bench_phase_t bench_phase_t;
+struct bench_phase_t {
+    char* name;
+    double wall_ms;
+    double cpu_ms;
+};
+
+typedef struct stopwatch_t stopwatch_t;
+struct stopwatch_t {
+    struct timespec wall;
+    struct rusage self;
+    struct rusage children;
+};
+
+double tv_ms(struct timeval tv)
+{
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+double cpu_ms(struct rusage* ru)
+{
+    return tv_ms(ru->ru_utime) + tv_ms(ru->ru_stime);
+}
+
+void stopwatch_start(stopwatch_t* c)
+{
+    clock_gettime(CLOCK_MONOTONIC, &c->wall);
+    getrusage(RUSAGE_SELF, &c->self);
+    getrusage(RUSAGE_CHILDREN, &c->children);
+}
+
+// keeps the fastest of the runs
+void stopwatch_stop(stopwatch_t* c, bench_phase_t* p, bool first)
+{
+    struct timespec wall;
+    struct rusage self;
+    struct rusage children;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    double wall_ms = (wall.tv_sec - c->wall.tv_sec) * 1e3 + (wall.tv_nsec - c->wall.tv_nsec) / 1e6;
+    double used_ms = cpu_ms(&self) - cpu_ms(&c->self) + cpu_ms(&children) - cpu_ms(&c->children);
+    if (first || wall_ms < p->wall_ms) {
+        p->wall_ms = wall_ms;
+        p->cpu_ms = used_ms;
+    }
+}
+
+bool run(char** args)
+{
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], NULL, NULL, args, environ);
+    panic_if(err != 0, "could not run %s: %s", args[0], strerror(err));
+    int status;
+    panic_if(waitpid(pid, &status, 0) < 0, "could not wait for %s: %s", args[0], strerror(errno));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+enum {
+    PHASE_WALK,
+    PHASE_STRUCTURE,
+    PHASE_FILES,
+    PHASE_PIPELINE,
+    PHASE_COMPILE_INSTRUCTIONS,
+    PHASE_BUILD,
+    PHASE_REBUILD,
+    PHASE_WORKER_BUILD,
+    N_PHASES
+};
+
+typedef struct bench_options_t bench_options_t;
+struct bench_options_t {
+    uint64_t n_threads;
+    uint64_t uring_depth;
+    bool pipeline;
+    bool build;
+    uint64_t workers;
+    char* worker_build; // the command building the package through the workers
+};
+
+void run_once(bench_phase_t* phases, bool cold, bool first, bench_options_t* b)
+{
+    stopwatch_t c;
+    remove_tree("package");
+
+    path_table_t* paths = pt_create(16);
+    name_buf_t* file_buf = nb_create(paths, 16);
+    name_buf_t* dir_buf = nb_create(paths, 16);
+    uint32_t root = pt_add(paths, PATH_NONE, "src");
+    compile_options_t opts = { 0 };
+    opts.program_name = "prog";
+    opts.flags = "-O1 -Isrc";
+    copy_engine_t engine = { 0 };
+    engine.uring_depth = b->uring_depth;
+
+    if (b->pipeline) {
+        if (cold) {
+            evict();
+        }
+        stopwatch_start(&c);
+        walk_and_package("package", file_buf, dir_buf, root, &engine, b->n_threads);
+        stopwatch_stop(&c, &phases[PHASE_PIPELINE], first);
+    } else {
+        if (cold) {
+            evict();
+        }
+        stopwatch_start(&c);
+        if (b->n_threads > 1) {
+            push_all_files_in_directory_parallel(file_buf, dir_buf, root, b->n_threads);
+        } else {
+            push_all_files_in_directory(file_buf, dir_buf, root, NULL);
+        }
+        stopwatch_stop(&c, &phases[PHASE_WALK], first);
+
+        if (cold) {
+            evict();
+        }
+        stopwatch_start(&c);
+        out_structure("package", dir_buf);
+        stopwatch_stop(&c, &phases[PHASE_STRUCTURE], first);
+
+        if (cold) {
+            evict();
+        }
+        stopwatch_start(&c);
+        out_files("package", file_buf, &engine);
+        stopwatch_stop(&c, &phases[PHASE_FILES], first);
+    }
+
+    if (cold) {
+        evict();
+    }
+    stopwatch_start(&c);
+    out_compile_instructions("package", &opts, file_buf);
+    stopwatch_stop(&c, &phases[PHASE_COMPILE_INSTRUCTIONS], first);
+
+    if (b->build) {
+        if (cold) {
+            evict();
+        }
+        char* args[] = { "sh", "-c", "cd package && cc compile.c -o comp && ./comp gcc > /dev/null", NULL };
+        stopwatch_start(&c);
+        panic_if(!run(args), "building the package failed");
+        stopwatch_stop(&c, &phases[PHASE_BUILD], first);
+
+        // one recompile and the relink, which dominates on large packages
+        char* touch[] = { "sh", "-c", "cd package && touch \"$(find . -name 'c_*.c' | head -n 1)\"", NULL };
+        panic_if(!run(touch), "could not touch a source");
+        char* rebuild[] = { "sh", "-c", "cd package && ./comp gcc > /dev/null", NULL };
+        stopwatch_start(&c);
+        panic_if(!run(rebuild), "rebuilding the package failed");
+        stopwatch_stop(&c, &phases[PHASE_REBUILD], first);
+    }
+
+    if (b->build && b->workers > 0) {
+        char* clean[] = { "sh", "-c", "cd package && find . -name '*.o' -delete", NULL };
+        panic_if(!run(clean), "could not remove the objects");
+        if (cold) {
+            evict();
+        }
+        char* args[] = { "sh", "-c", b->worker_build, NULL };
+        stopwatch_start(&c);
+        panic_if(!run(args), "building the package through the workers failed");
+        stopwatch_stop(&c, &phases[PHASE_WORKER_BUILD], first);
+    }
+
+    nb_free(file_buf);
+    nb_free(dir_buf);
+    pt_free(paths);
+}
+
+bool phase_ran(int phase, bench_options_t* b)
+{
+    if (phase == PHASE_BUILD || phase == PHASE_REBUILD) {
+        return b->build;
+    }
+    if (phase == PHASE_WORKER_BUILD) {
+        return b->build && b->workers > 0;
+    }
+    if (phase == PHASE_WALK || phase == PHASE_STRUCTURE || phase == PHASE_FILES) {
+        return !b->pipeline;
+    }
+    return phase != PHASE_PIPELINE || b->pipeline;
+}
+
+void print_phases(char* variant, bench_phase_t* phases, bench_options_t* b, bool last)
+{
+    printf("    \"%s\": {", variant);
+    bool first = 1;
+    int i;
+    for (i = 0; i < N_PHASES; i++) {
+        if (!phase_ran(i, b)) {
+            continue;
+        }
+        printf("%s\n      \"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f }", first ? "" : ",", phases[i].name,
+            phases[i].wall_ms, phases[i].cpu_ms);
+        first = 0;
+    }
+    printf("\n    }%s\n", last ? "" : ",");
+}
+
+// forks the -w workers, serving on dir/worker_<i>.sock, and returns their pids once they all listen
+pid_t* start_workers(bench_options_t* b, char* dir)
+{
+    if (!b->build) {
+        b->workers = 0;
+    }
+    pid_t* pids = calloc(b->workers + 1, sizeof(*pids));
+    b->worker_build = strdup("cd package && ./comp");
+    uint64_t i;
+    for (i = 0; i < b->workers; i++) {
+        char* address;
+        panic_if(asprintf(&address, "unix:%s/worker_%lu.sock", dir, i) < 0, "could not allocate address");
+        unlink(address + 5);
+        fflush(stdout);
+        pids[i] = fork();
+        panic_if(pids[i] < 0, "could not start worker: %s", strerror(errno));
+        if (pids[i] == 0) {
+            freopen("/dev/null", "w", stdout);
+            serve_compiles(address, NULL, 0, 1, 0);
+        }
+        while (access(address + 5, F_OK) != 0) {
+            usleep(1000);
+        }
+        usleep(10000); // from bind to listen
+        char* command;
+        panic_if(asprintf(&command, "%s -w %s", b->worker_build, address) < 0, "could not allocate command");
+        free(b->worker_build);
+        b->worker_build = command;
+        free(address);
+    }
+    char* command;
+    panic_if(asprintf(&command, "%s gcc > /dev/null", b->worker_build) < 0, "could not allocate command");
+    free(b->worker_build);
+    b->worker_build = command;
+    return pids;
+}
+
+int main(int argc, char** argv)
+{
+    tree_options_t o = { 3, 8, 5000, 4096, 1.0, 20, 4 };
+    uint64_t runs = 3;
+    bench_options_t b = { sysconf(_SC_NPROCESSORS_ONLN), 0, 0, 0, 0, NULL };
+    char* dir = "/tmp/pp_bench";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:n:s:S:H:i:r:t:u:pbw:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            o.depth = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            o.fan_out = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            o.files = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            o.size = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            o.sigma = strtod(optarg, NULL);
+            break;
+        case 'H':
+            o.header_percent = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            o.includes = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            runs = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            b.n_threads = strtoull(optarg, NULL, 10);
+            break;
+        case 'u':
+            b.uring_depth = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            b.pipeline = 1;
+            break;
+        case 'b':
+            b.build = 1;
+            break;
+        case 'w':
+            b.workers = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        default:
+            panic("see the top of bench/bench.c for the options");
+        }
+    }
+    panic_if(o.header_percent >= 100 || o.files == 0 || runs == 0, "need at least one source file and one run");
+
+    remove_tree(dir);
+    panic_if(mkdir(dir, 0755) < 0, "could not create %s: %s", dir, strerror(errno));
+    panic_if(chdir(dir) < 0, "could not enter %s: %s", dir, strerror(errno));
+    tree_t t = { 0 };
+    generate_tree(&t, &o);
+    pid_t* workers = start_workers(&b, dir);
+
+    bench_phase_t warm[N_PHASES] = { { "walk", 0, 0 }, { "out_structure", 0, 0 }, { "out_files", 0, 0 }, { "walk_and_package", 0, 0 },
+        { "out_compile_instructions", 0, 0 },
+        { "build", 0, 0 }, { "rebuild_one", 0, 0 }, { "build_workers", 0, 0 } };
+    bench_phase_t cold[N_PHASES];
+    memcpy(cold, warm, sizeof(warm));
+    uint64_t i;
+    for (i = 0; i < runs; i++) {
+        run_once(warm, 0, i == 0, &b);
+    }
+    for (i = 0; i < runs; i++) {
+        run_once(cold, 1, i == 0, &b);
+    }
+
+    printf("{\n  \"tree\": { \"depth\": %lu, \"fan_out\": %lu, \"dirs\": %lu, \"files\": %lu, \"sources\": %lu, \"headers\": %lu, "
+           "\"bytes\": %lu, \"median_size\": %lu, \"sigma\": %.2f, \"includes\": %lu },\n",
+        o.depth, o.fan_out, t.n_all_dirs, o.files, t.n_sources, t.n_headers, t.bytes, o.size, o.sigma, o.includes);
+    printf("  \"threads\": %lu,\n  \"uring_depth\": %lu,\n  \"pipeline\": %s,\n  \"workers\": %lu,\n  \"runs\": %lu,\n"
+           "  \"phases\": {\n",
+        b.n_threads, b.uring_depth, b.pipeline ? "true" : "false", b.workers, runs);
+    print_phases("warm", warm, &b, 0);
+    print_phases("cold", cold, &b, 1);
+    printf("  }\n}\n");
+    for (i = 0; i < b.workers; i++) {
+        kill(workers[i], SIGTERM);
+        waitpid(workers[i], NULL, 0);
+    }
+    return 0;
+}
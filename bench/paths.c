@@ -0,0 +1,88 @@
+// peak rss and allocation count of the file/dir name buffers for a synthetic tree, built the way the serial walk builds it
+// gcc -O2 -pthread bench/paths.c -o paths && ./paths [depth] [fan_out] [files_per_dir]
+// the defaults (4, 10, 100) give a million files in 10000 directories
+#define main pp_main
+#include "../main.c"
+#undef main
+
+#include <sys/resource.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void __libc_free(void* p);
+
+uint64_t n_allocs;
+
+void* malloc(size_t size)
+{
+    n_allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    n_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    n_allocs++;
+    return __libc_realloc(p, size);
+}
+
+void free(void* p)
+{
+    __libc_free(p);
+}
+
+void generate(name_buf_t* file_buf, name_buf_t* dir_buf, uint32_t dir, uint64_t depth, uint64_t fan_out, uint64_t files)
+{
+    char name[64];
+    uint64_t i;
+    if (depth == 0) {
+        nb_push(dir_buf, dir);
+        for (i = 0; i < files; i++) {
+            snprintf(name, sizeof(name), "source_file_%04lu.c", i);
+            nb_push(file_buf, pt_add(file_buf->table, dir, name));
+        }
+        return;
+    }
+    for (i = 0; i < fan_out; i++) {
+        snprintf(name, sizeof(name), "module_directory_%02lu", i);
+        generate(file_buf, dir_buf, pt_add(file_buf->table, dir, name), depth - 1, fan_out, files);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t depth = argc > 1 ? strtoull(argv[1], NULL, 10) : 4;
+    uint64_t fan_out = argc > 2 ? strtoull(argv[2], NULL, 10) : 10;
+    uint64_t files = argc > 3 ? strtoull(argv[3], NULL, 10) : 100;
+
+    path_table_t* paths = pt_create(16);
+    name_buf_t* file_buf = nb_create(paths, 16);
+    name_buf_t* dir_buf = nb_create(paths, 16);
+    generate(file_buf, dir_buf, pt_add(paths, PATH_NONE, "./src"), depth, fan_out, files);
+
+    // materialise every path once, as out_files does
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    uint64_t bytes = 0;
+    for (i = 0; i < file_buf->used; i++) {
+        bytes += strlen(nb_path(file_buf, "package", i, &fn));
+    }
+    file_name_uninit(&fn);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("{ \"files\": %lu, \"dirs\": %lu, \"path_bytes\": %lu, \"allocations\": %lu, \"peak_rss_kb\": %ld }\n", file_buf->used,
+        dir_buf->used, bytes, n_allocs, ru.ru_maxrss);
+
+    nb_free(file_buf);
+    nb_free(dir_buf);
+    pt_free(paths);
+    return 0;
+}
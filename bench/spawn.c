@@ -0,0 +1,60 @@
+// per invocation cost of starting a command through system() (the old run_command_) and through posix_spawnp
+// gcc -O2 bench/spawn.c -o spawn && ./spawn [iterations]
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+static char* args[] = { "true", "-c", "-O2", "-Wall", "./some/dir/file.c", "-o", "./some/dir/file.o", NULL };
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void run_system(void)
+{
+    char cmd[256] = { 0 };
+    char** arg;
+    for (arg = args; *arg != NULL; arg++) {
+        strcat(cmd, *arg);
+        strcat(cmd, " ");
+    }
+    system(cmd);
+}
+
+void run_spawn(void)
+{
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, args[0], NULL, NULL, args, environ) == 0) {
+        waitpid(pid, &status, 0);
+    }
+}
+
+void bench(char* name, void (*run)(void), uint64_t iterations)
+{
+    uint64_t i;
+    uint64_t start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        run();
+    }
+    uint64_t elapsed = now_ns() - start;
+    printf("%-8s %8.1f us/invocation\n", name, elapsed / 1000.0 / iterations);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000;
+    bench("system", run_system, iterations);
+    bench("spawn", run_spawn, iterations);
+    return 0;
+}
@@ -1,46 +1,1852 @@
-#include <stdarg.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-#define run_command(comp, ...) run_command_(comp, __VA_ARGS__, NULL);
+typedef struct job_t job_t;
+struct job_t {
+    char* src;
+    char* obj;
+    char* dep;
+    uint64_t part; // index in parts, the partial link of the directory of src
+};
 
-void run_command_(char* comp, ...)
+extern char** environ;
+
+pid_t start_command(char** args)
+{
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], NULL, NULL, args, environ);
+    if (err != 0) {
+        fprintf(stderr, "could not run %s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// waits for any child, whose pid is stored in waited unless that is NULL, and returns its exit status, -1 if it was killed
+int wait_status(pid_t* waited)
+{
+    int status;
+    pid_t pid = wait(&status);
+    if (waited != NULL) {
+        *waited = pid;
+    }
+    if (pid < 0) {
+        return -1;
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "command %d killed by signal %d\n", pid, WTERMSIG(status));
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+bool wait_command(pid_t* waited)
+{
+    return wait_status(waited) == 0;
+}
+
+// argument vector that grows as arguments are pushed, always NULL terminated
+typedef struct args_t args_t;
+struct args_t {
+    char** buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+void args_push(args_t* a, char* arg)
+{
+    if (a->used + 2 > a->allocated) {
+        a->allocated = a->allocated ? a->allocated << 1 : 16;
+        a->buf = realloc(a->buf, a->allocated * sizeof(*a->buf));
+    }
+    a->buf[a->used++] = arg;
+    a->buf[a->used] = NULL;
+}
+
+void args_push_all(args_t* a, char** args)
+{
+    for (; args != NULL && *args != NULL; args++) {
+        args_push(a, *args);
+    }
+}
+
+char* join_args(char** args)
+{
+    uint64_t len = 1;
+    char** arg;
+    for (arg = args; *arg != NULL; arg++) {
+        len += strlen(*arg) + 1;
+    }
+    char* s = calloc(1, len);
+    for (arg = args; *arg != NULL; arg++) {
+        strcat(s, *arg);
+        strcat(s, "\n");
+    }
+    return s;
+}
+
+bool run_command(char** args)
+{
+    if (start_command(args) < 0) {
+        return 0;
+    }
+    return wait_command(NULL);
+}
+
+// monotonic seconds
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define TIMING_OFF 0 // -T, how compile times are reported
+#define TIMING_TEXT 1
+#define TIMING_JSON 2
+
+void fprint_json_string(FILE* f, char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// modification time in nanoseconds, -1 if the file does not exist
+int64_t mtime_of(char* path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+char* read_file(char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* buf = malloc(len + 1);
+    if (fread(buf, 1, len, f) != (size_t)len) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    buf[len] = 0;
+    fclose(f);
+    return buf;
+}
+
+// true if the depfile written by -MMD is missing or lists a prerequisite newer than t
+bool deps_newer(char* dep_file, int64_t t)
+{
+    char* deps = read_file(dep_file);
+    if (deps == NULL) {
+        return 1;
+    }
+    char* p = strchr(deps, ':');
+    if (p == NULL) {
+        free(deps);
+        return 1;
+    }
+    p++;
+    char* name = malloc(strlen(p) + 1);
+    bool newer = 0;
+    while (*p && !newer) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || (*p == '\\' && p[1] == '\n')) {
+            p += *p == '\\' ? 2 : 1;
+        }
+        char* n = name;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+            if (*p == '\\' && (p[1] == ' ' || p[1] == '#')) {
+                p++;
+            } else if (*p == '$' && p[1] == '$') {
+                p++;
+            } else if (*p == '\\' && p[1] == '\n') {
+                break;
+            }
+            *n++ = *p++;
+        }
+        *n = 0;
+        if (n != name) {
+            int64_t m = mtime_of(name);
+            newer = m < 0 || m > t;
+        }
+    }
+    free(name);
+    free(deps);
+    return newer;
+}
+
+// rewrites stamp when its content differs, so that a flag change looks like a newer prerequisite
+void update_stamp(char* stamp, char* content)
+{
+    char* old = read_file(stamp);
+    if (old == NULL || strcmp(old, content) != 0) {
+        FILE* f = fopen(stamp, "w");
+        if (f != NULL) {
+            fputs(content, f);
+            fclose(f);
+        }
+    }
+    free(old);
+}
+
+bool needs_rebuild(job_t* job, int64_t stamp_time)
+{
+    int64_t obj_time = mtime_of(job->obj);
+    if (obj_time < 0 || stamp_time > obj_time) {
+        return 1;
+    }
+    int64_t src_time = mtime_of(job->src);
+    if (src_time < 0 || src_time > obj_time) {
+        return 1;
+    }
+    return deps_newer(job->dep, obj_time);
+}
+
+// object cache
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Objects are stored as dir/xx/<key>.o, keyed by a 128 bit hash of the preprocessed source, the compiler and the flags. Entries
+// are inserted through a temporary file and rename, so concurrent builds sharing dir never see a partial object, and a hit
+// touches its entry so that eviction drops the least recently used ones first.
+
+typedef struct cache_stats_t cache_stats_t;
+struct cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserted;
+};
+
+typedef struct cache_t cache_t;
+struct cache_t {
+    char* dir;
+    uint64_t max_size;
+    cache_stats_t* stats; // shared with the processes that compile the jobs
+    unsigned char* hit; // per job, set by the process that restored its object from the cache, shared as well
+};
+
+typedef struct cache_key_t cache_key_t;
+struct cache_key_t {
+    uint64_t h[2];
+};
+
+// two differently seeded multiply-xorshift lanes over 8 byte words
+void key_update(cache_key_t* k, void* data, uint64_t len)
+{
+    static const uint64_t mul[2] = { 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full };
+    unsigned char* p = data;
+    int lane;
+    for (lane = 0; lane < 2; lane++) {
+        uint64_t h = k->h[lane] ^ (len + 1) * mul[lane];
+        uint64_t w;
+        uint64_t i;
+        for (i = 0; i + 8 <= len; i += 8) {
+            memcpy(&w, p + i, 8);
+            h = (h ^ w) * mul[lane];
+            h ^= h >> 32;
+        }
+        w = 0;
+        memcpy(&w, p + i, len - i);
+        h = (h ^ w) * mul[lane];
+        h ^= h >> 29;
+        k->h[lane] = h;
+    }
+}
+
+void key_string(cache_key_t* k, char* s)
+{
+    key_update(k, s, strlen(s));
+}
+
+// identifies the compiler by name and by size and mtime of the executable that PATH resolves it to
+void key_compiler(cache_key_t* k, char* compiler)
+{
+    key_string(k, compiler);
+    struct stat st;
+    bool found = strchr(compiler, '/') != NULL && stat(compiler, &st) == 0;
+    char* path = getenv("PATH");
+    while (!found && path != NULL && *path != 0) {
+        uint64_t len = strcspn(path, ":");
+        char* name = malloc(len + strlen(compiler) + 2);
+        sprintf(name, "%.*s/%s", (int)len, path, compiler);
+        found = access(name, X_OK) == 0 && stat(name, &st) == 0;
+        free(name);
+        path += path[len] == ':' ? len + 1 : len;
+    }
+    if (found) {
+        key_update(k, &st.st_size, sizeof(st.st_size));
+        key_update(k, &st.st_mtim, sizeof(st.st_mtim));
+    }
+}
+
+// runs args and collects their standard output into a malloced buffer, NULL if they fail
+char* capture_command(char** args, uint64_t* len)
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return NULL;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0) {
+        fprintf(stderr, "could not run %s: %s\n", args[0], strerror(err));
+        close(fds[0]);
+        return NULL;
+    }
+    uint64_t allocated = 1 << 16;
+    char* buf = malloc(allocated);
+    *len = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf + *len, allocated - *len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        *len += n;
+        if (*len == allocated) {
+            allocated <<= 1;
+            buf = realloc(buf, allocated);
+        }
+    }
+    close(fds[0]);
+    if (!wait_command(NULL) || n < 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+bool copy_path(char* from, char* to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0) {
+        return 0;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return 0;
+    }
+    char buf[1 << 16];
+    ssize_t n;
+    bool ok = 1;
+    while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+        ok = n > 0 && write(out, buf, n) == n;
+    }
+    close(in);
+    return close(out) == 0 && ok;
+}
+
+// the entry of key, creating its directory
+char* cache_entry(cache_t* c, cache_key_t* k)
+{
+    char* name = malloc(strlen(c->dir) + 64);
+    sprintf(name, "%s/%02x", c->dir, (unsigned)(k->h[0] >> 56));
+    mkdir(name, 0755);
+    sprintf(name + strlen(name), "/%016llx%016llx.o", (unsigned long long)k->h[0], (unsigned long long)k->h[1]);
+    return name;
+}
+
+// restores obj from the cache, false on a miss
+bool cache_get(char* entry, char* obj)
+{
+    if (access(entry, R_OK) != 0 || !copy_path(entry, obj)) {
+        return 0;
+    }
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    return 1;
+}
+
+void cache_put(cache_t* c, char* entry, char* obj)
+{
+    char* tmp = malloc(strlen(entry) + 32);
+    sprintf(tmp, "%s.%d.tmp", entry, (int)getpid());
+    if (copy_path(obj, tmp) && rename(tmp, entry) == 0) {
+        __atomic_fetch_add(&c->stats->inserted, 1, __ATOMIC_RELAXED);
+    } else {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+typedef struct cache_file_t cache_file_t;
+struct cache_file_t {
+    char* name;
+    int64_t mtime;
+    uint64_t size;
+};
+
+int cache_file_cmp(const void* a, const void* b)
+{
+    const cache_file_t* x = a;
+    const cache_file_t* y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// removes the least recently used entries until the cache holds at most 90% of max_size
+void cache_evict(cache_t* c)
+{
+    cache_file_t* files = NULL;
+    uint64_t n_files = 0;
+    uint64_t allocated = 0;
+    uint64_t total = 0;
+    DIR* top = opendir(c->dir);
+    if (top == NULL) {
+        return;
+    }
+    struct dirent* d;
+    while ((d = readdir(top)) != NULL) {
+        if (d->d_name[0] == '.') {
+            continue;
+        }
+        char* sub_name = malloc(strlen(c->dir) + strlen(d->d_name) + 2);
+        sprintf(sub_name, "%s/%s", c->dir, d->d_name);
+        DIR* sub = opendir(sub_name);
+        struct dirent* e;
+        while (sub != NULL && (e = readdir(sub)) != NULL) {
+            struct stat st;
+            if (e->d_name[0] == '.' || fstatat(dirfd(sub), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if (n_files == allocated) {
+                allocated = allocated ? allocated << 1 : 256;
+                files = realloc(files, allocated * sizeof(*files));
+            }
+            files[n_files].name = malloc(strlen(sub_name) + strlen(e->d_name) + 2);
+            sprintf(files[n_files].name, "%s/%s", sub_name, e->d_name);
+            files[n_files].mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            files[n_files].size = st.st_size;
+            total += st.st_size;
+            n_files++;
+        }
+        if (sub != NULL) {
+            closedir(sub);
+        }
+        free(sub_name);
+    }
+    closedir(top);
+    if (total > c->max_size) {
+        qsort(files, n_files, sizeof(*files), cache_file_cmp);
+        uint64_t i;
+        for (i = 0; i < n_files && total > c->max_size / 10 * 9; i++) {
+            if (unlink(files[i].name) == 0) {
+                total -= files[i].size;
+            }
+        }
+    }
+    uint64_t i;
+    for (i = 0; i < n_files; i++) {
+        free(files[i].name);
+    }
+    free(files);
+}
+
+// compile workers
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// -w ADDRESS hands units to a worker started with pp --serve=ADDRESS, on unix:PATH or tcp:HOST:PORT. The unit is preprocessed
+// here, which also writes the depfile, the worker compiles it and sends back the object. Every request is one connection
+// carrying a frame, a worker_frame_t header and size bytes of payload: HELLO is answered with the number of compile slots
+// in status. JOB holds the length of the NUL separated compiler and flags as 8 bytes, them and the preprocessed source, and
+// is answered with a RESULT (the exit status, a worker_result_t, the object and the compiler output), BUSY when the queue
+// of the worker is full or REFUSED with the reason. A unit that was not compiled remotely is compiled here.
+
+#define WORKER_MAGIC "PPWORK1"
+#define WORKER_HELLO 1
+#define WORKER_JOB 2
+#define WORKER_RESULT 3
+#define WORKER_BUSY 4
+#define WORKER_REFUSED 5
+#define WORKER_TIMEOUT 5 // seconds to connect and to answer a HELLO
+
+#define REMOTE_FALLBACK 75 // exit status of a job whose worker did not compile it
+
+typedef struct worker_frame_t worker_frame_t;
+struct worker_frame_t {
+    char magic[8];
+    uint32_t type;
+    uint32_t status;
+    uint64_t size;
+};
+
+typedef struct worker_result_t worker_result_t;
+struct worker_result_t {
+    uint64_t queue_nanoseconds; // from accepting the job to starting its compile
+    uint64_t compile_nanoseconds;
+    uint64_t obj_size;
+    uint64_t log_size;
+};
+
+typedef struct worker_t worker_t;
+struct worker_t {
+    char* address;
+    long slots; // offered by the worker, one less every time it was busy
+    long running;
+    bool down;
+    uint64_t compiled;
+    uint64_t busy;
+    uint64_t sent;
+    uint64_t received;
+    double queue_seconds;
+    double max_queue_seconds;
+    double compile_seconds;
+    double round_trip_seconds;
+};
+
+// what the job of a unit sent to a worker found out, in memory shared with the driver
+typedef struct remote_t remote_t;
+struct remote_t {
+    int outcome;
+    uint64_t sent;
+    uint64_t received;
+    double queue_seconds;
+    double compile_seconds;
+    double round_trip_seconds;
+};
+
+#define REMOTE_COMPILED 0 // with or without errors
+#define REMOTE_BUSY 1
+#define REMOTE_UNREACHABLE 2
+#define REMOTE_REFUSED 3
+
+bool send_all(int fd, void* buf, uint64_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+bool recv_all(int fd, void* buf, uint64_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// connects to unix:PATH or tcp:HOST:PORT within WORKER_TIMEOUT, -1 if that fails
+int worker_connect(char* address)
+{
+    struct timeval timeout = { WORKER_TIMEOUT, 0 };
+    int fd = -1;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        if (strlen(address + 5) >= sizeof(sa.sun_path)) {
+            return -1;
+        }
+        strcpy(sa.sun_path, address + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    if (strncmp(address, "tcp:", 4) != 0 || strrchr(address, ':') == address + 3) {
+        return -1;
+    }
+    char* host = strdup(address + 4);
+    char* port = strrchr(host, ':');
+    *port++ = 0;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* ai;
+    struct addrinfo* a;
+    // no host is the loopback address, where pp --serve=tcp::PORT listens
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &ai) != 0) {
+        free(host);
+        return -1;
+    }
+    for (a = ai; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // a send timeout also bounds connect
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    free(host);
+    if (fd >= 0) {
+        int one = 1;
+        struct timeval none = { 0, 0 };
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+    }
+    return fd;
+}
+
+// the number of compile slots the worker at address offers, -1 if it does not answer
+long worker_hello(char* address)
+{
+    int fd = worker_connect(address);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval timeout = { WORKER_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    worker_frame_t f = { WORKER_MAGIC, WORKER_HELLO, 0, 0 };
+    bool ok = send_all(fd, &f, sizeof(f)) && recv_all(fd, &f, sizeof(f)) && memcmp(f.magic, WORKER_MAGIC, sizeof(f.magic)) == 0
+        && f.type == WORKER_HELLO;
+    close(fd);
+    return ok ? (long)f.status : -1;
+}
+
+// asks every worker for its slots, forgetting what earlier builds counted
+void workers_probe(worker_t* workers, uint64_t n)
+{
+    worker_t* w;
+    for (w = workers; w != workers + n; w++) {
+        *w = (worker_t) { .address = w->address, .slots = worker_hello(w->address) };
+        if (w->slots < 1) {
+            fprintf(stderr, "worker %s is unreachable, compiling its units here\n", w->address);
+            w->slots = 0;
+            w->down = 1;
+        }
+    }
+}
+
+// Compiles the preprocessed source on the worker at address with the compiler and flags in args, without the -include of
+// the precompiled header, whose content the source already has. Writes obj and the compiler output to stderr, and returns
+// the exit status of the compiler or REMOTE_FALLBACK.
+int remote_compile(char* address, char** args, char* source, uint64_t len, char* obj, remote_t* r)
+{
+    double start = now();
+    uint64_t args_size = 0;
+    char** arg;
+    for (arg = args; *arg != NULL; arg++) {
+        if (strcmp(*arg, "-include") == 0 && arg[1] != NULL) {
+            arg++;
+        } else {
+            args_size += strlen(*arg) + 1;
+        }
+    }
+    char* request = malloc(sizeof(worker_frame_t) + sizeof(args_size) + args_size);
+    char* p = request + sizeof(worker_frame_t) + sizeof(args_size);
+    for (arg = args; *arg != NULL; arg++) {
+        if (strcmp(*arg, "-include") == 0 && arg[1] != NULL) {
+            arg++;
+        } else {
+            p = stpcpy(p, *arg) + 1;
+        }
+    }
+    worker_frame_t f = { WORKER_MAGIC, WORKER_JOB, 0, sizeof(args_size) + args_size + len };
+    memcpy(request, &f, sizeof(f));
+    memcpy(request + sizeof(f), &args_size, sizeof(args_size));
+
+    int fd = worker_connect(address);
+    if (fd < 0) {
+        free(request);
+        r->outcome = REMOTE_UNREACHABLE;
+        return REMOTE_FALLBACK;
+    }
+    // a busy worker answers before reading the request, so its answer is looked for even if sending failed
+    bool sent = send_all(fd, request, p - request) && send_all(fd, source, len);
+    free(request);
+    r->sent = sent ? sizeof(f) + f.size : 0;
+    worker_result_t result;
+    if (!recv_all(fd, &f, sizeof(f)) || memcmp(f.magic, WORKER_MAGIC, sizeof(f.magic)) != 0 || f.type == WORKER_BUSY
+        || (f.type == WORKER_RESULT && (!sent || f.size < sizeof(result)))) {
+        close(fd);
+        r->outcome = REMOTE_BUSY;
+        return REMOTE_FALLBACK;
+    }
+    char* payload = malloc(f.size + 1);
+    if (payload == NULL || !recv_all(fd, payload, f.size)) {
+        close(fd);
+        free(payload);
+        r->outcome = REMOTE_BUSY;
+        return REMOTE_FALLBACK;
+    }
+    close(fd);
+    r->received = sizeof(f) + f.size;
+    if (f.type != WORKER_RESULT) {
+        fprintf(stderr, "worker %s refused %s: %.*s\n", address, obj, (int)f.size, payload);
+        free(payload);
+        r->outcome = REMOTE_REFUSED;
+        return REMOTE_FALLBACK;
+    }
+    memcpy(&result, payload, sizeof(result));
+    int status = f.status;
+    if (sizeof(result) + result.obj_size + result.log_size != f.size) {
+        fprintf(stderr, "worker %s sent a malformed result for %s\n", address, obj);
+        status = 1;
+    } else {
+        fwrite(payload + sizeof(result) + result.obj_size, 1, result.log_size, stderr);
+        int out = open(obj, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = out >= 0 && write(out, payload + sizeof(result), result.obj_size) == (ssize_t)result.obj_size;
+        if ((out >= 0 && close(out) != 0) || (!written && status == 0)) {
+            fprintf(stderr, "could not write %s: %s\n", obj, strerror(errno));
+            status = 1;
+        }
+    }
+    free(payload);
+    r->outcome = REMOTE_COMPILED;
+    r->queue_seconds = result.queue_nanoseconds / 1e9;
+    r->compile_seconds = result.compile_nanoseconds / 1e9;
+    r->round_trip_seconds = now() - start;
+    return status;
+}
+
+// counts the job that compiled a unit on w, or gives w up after it was unreachable or refused one
+void worker_account(worker_t* w, remote_t* r)
+{
+    w->running--;
+    if (r->outcome == REMOTE_BUSY) {
+        w->busy++;
+        w->slots -= w->slots > 0;
+        return;
+    }
+    if (r->outcome != REMOTE_COMPILED) {
+        if (!w->down) {
+            fprintf(stderr, "worker %s %s, compiling its units here\n", w->address,
+                    r->outcome == REMOTE_REFUSED ? "refused a unit" : "is unreachable");
+        }
+        w->down = 1;
+        return;
+    }
+    w->compiled++;
+    w->sent += r->sent;
+    w->received += r->received;
+    w->queue_seconds += r->queue_seconds;
+    w->max_queue_seconds = r->queue_seconds > w->max_queue_seconds ? r->queue_seconds : w->max_queue_seconds;
+    w->compile_seconds += r->compile_seconds;
+    w->round_trip_seconds += r->round_trip_seconds;
+}
+
+// the reachable worker with the most free slots relative to its size, NULL if all are full
+worker_t* worker_pick(worker_t* workers, uint64_t n)
+{
+    worker_t* best = NULL;
+    worker_t* w;
+    for (w = workers; w != workers + n; w++) {
+        if (!w->down && w->running < w->slots
+            && (best == NULL || (double)w->running / w->slots < (double)best->running / best->slots)) {
+            best = w;
+        }
+    }
+    return best;
+}
+
+// throughput over the makespan of the compiles, and the time units spent waiting in the queue of every worker
+void worker_report(FILE* f, worker_t* workers, uint64_t n, double makespan, int format)
+{
+    worker_t* w;
+    for (w = workers; w != workers + n; w++) {
+        double per_unit = w->compiled > 0 ? 1.0 / w->compiled : 0;
+        double rate = makespan > 0 ? w->compiled / makespan : 0;
+        double transfer = (w->round_trip_seconds - w->compile_seconds - w->queue_seconds) * per_unit;
+        if (format == TIMING_JSON) {
+            fprintf(f, "%s\n    { \"address\": ", w == workers ? "" : ",");
+            fprint_json_string(f, w->address);
+            fprintf(f,
+                    ", \"down\": %s, \"compiled\": %llu, \"busy\": %llu, \"units_per_second\": %.6f, \"bytes_sent\": %llu, "
+                    "\"bytes_received\": %llu, \"compile_seconds\": %.6f, \"mean_queue_seconds\": %.6f, \"max_queue_seconds\": %.6f, "
+                    "\"mean_transfer_seconds\": %.6f }",
+                    w->down ? "true" : "false", (unsigned long long)w->compiled, (unsigned long long)w->busy, rate,
+                    (unsigned long long)w->sent, (unsigned long long)w->received, w->compile_seconds,
+                    w->queue_seconds * per_unit, w->max_queue_seconds, transfer);
+            continue;
+        }
+        fprintf(f, "worker %s%s: %llu units, %.2f units/s, %.1f MB sent, %.1f MB received, %.3fs compiling, %.3fs queued "
+                   "(%.3fs at most) and %.3fs transferring per unit, busy %llu times\n",
+                w->address, w->down ? " (down)" : "", (unsigned long long)w->compiled, rate, w->sent / 1e6, w->received / 1e6,
+                w->compile_seconds * per_unit, w->queue_seconds * per_unit, w->max_queue_seconds, transfer,
+                (unsigned long long)w->busy);
+    }
+}
+
+// compile times
+//--------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct timing_t timing_t;
+struct timing_t {
+    job_t* job;
+    pid_t pid; // 0 once the job finished
+    double start;
+    double seconds;
+};
+
+// the job that runs as pid, jobs still running are at the end of timings
+timing_t* timing_find(timing_t* timings, uint64_t n, pid_t pid)
+{
+    timing_t* t;
+    for (t = timings + n; t != timings; t--) {
+        if (t[-1].pid == pid) {
+            return t - 1;
+        }
+    }
+    return NULL;
+}
+
+void timing_finish(timing_t* t, int format)
+{
+    t->pid = 0;
+    t->seconds = now() - t->start;
+    if (format == TIMING_TEXT) {
+        printf("compiled: %s (%.3fs)\n", t->job->src, t->seconds);
+    }
+}
+
+int timing_cmp(const void* a, const void* b)
+{
+    const timing_t* x = a;
+    const timing_t* y = b;
+    return (x->seconds < y->seconds) - (x->seconds > y->seconds);
+}
+
+// the slowest units as text, or every unit and every worker as JSON, slowest first. status is "ok" or why the build failed.
+void timing_report(FILE* f, timing_t* timings, uint64_t n, int format, double makespan, double predicted, double link_seconds,
+                   double total_seconds, char* status, worker_t* workers, uint64_t n_workers)
+{
+    qsort(timings, n, sizeof(*timings), timing_cmp);
+    uint64_t i;
+    if (format == TIMING_TEXT) {
+        if (n > 0) {
+            fprintf(f, "slowest translation units:\n");
+        }
+        for (i = 0; i < n && i < 10; i++) {
+            fprintf(f, "  %8.3fs %s\n", timings[i].seconds, timings[i].job->src);
+        }
+        if (strcmp(status, "ok") != 0) {
+            fprintf(f, "compiled %llu translation units, %s after %.3fs\n", (unsigned long long)n, status, total_seconds);
+            return;
+        }
+        fprintf(f, "compiled %llu translation units, linked in %.3fs, %.3fs in total\n", (unsigned long long)n, link_seconds,
+                total_seconds);
+        return;
+    }
+    fprintf(f, "{\n  \"status\": \"%s\",\n  \"compiled\": %llu,\n  \"makespan_seconds\": %.6f,\n  \"predicted_makespan_seconds\": ",
+            status, (unsigned long long)n, makespan);
+    if (predicted < 0) {
+        fprintf(f, "null");
+    } else {
+        fprintf(f, "%.6f", predicted);
+    }
+    fprintf(f, ",\n  \"link_seconds\": %.6f,\n  \"total_seconds\": %.6f,\n  \"units\": [", link_seconds, total_seconds);
+    for (i = 0; i < n; i++) {
+        fprintf(f, "%s\n    { \"src\": ", i ? "," : "");
+        fprint_json_string(f, timings[i].job->src);
+        fprintf(f, ", \"seconds\": %.6f }", timings[i].seconds);
+    }
+    fprintf(f, "%s]", n ? "\n  " : "");
+    if (n_workers > 0) {
+        fprintf(f, ",\n  \"workers\": [");
+        worker_report(f, workers, n_workers, makespan, TIMING_JSON);
+        fprintf(f, "\n  ]");
+    }
+    fprintf(f, "\n}\n");
+}
+
+// scheduling
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// .pp_timings keeps how long the last compile of every unit took, one "seconds path" line each. Units are started longest
+// first: they only depend on each other through the link, so the longest one is the critical path and has to start right
+// away. Units without a recorded time are estimated from their size at the average rate of the known ones.
+
+#define TIMINGS_NAME ".pp_timings"
+
+typedef struct sched_t sched_t;
+struct sched_t {
+    job_t* job;
+    uint64_t index; // in jobs, breaks ties so that equal costs keep the generated order
+    double cost; // predicted seconds
+};
+
+int job_src_cmp(const void* a, const void* b)
+{
+    return strcmp((*(job_t* const*)a)->src, (*(job_t* const*)b)->src);
+}
+
+// fills seconds[i] with the recorded time of jobs[i], or -1
+void timings_load(job_t* jobs, uint64_t n, double* seconds)
+{
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+        seconds[i] = -1;
+    }
+    FILE* f = fopen(TIMINGS_NAME, "r");
+    if (f == NULL) {
+        return;
+    }
+    job_t** by_src = malloc((n + 1) * sizeof(*by_src));
+    for (i = 0; i < n; i++) {
+        by_src[i] = &jobs[i];
+    }
+    qsort(by_src, n, sizeof(*by_src), job_src_cmp);
+    char* line = NULL;
+    size_t line_len = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_len, f)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = 0;
+        }
+        double s;
+        int path_start;
+        if (sscanf(line, "%lf %n", &s, &path_start) != 1) {
+            continue;
+        }
+        job_t key = { .src = line + path_start };
+        job_t* k = &key;
+        job_t** found = bsearch(&k, by_src, n, sizeof(*by_src), job_src_cmp);
+        if (found != NULL) {
+            seconds[*found - jobs] = s;
+        }
+    }
+    free(line);
+    free(by_src);
+    fclose(f);
+}
+
+void timings_save(job_t* jobs, uint64_t n, double* seconds)
+{
+    FILE* f = fopen(TIMINGS_NAME ".tmp", "w");
+    if (f == NULL) {
+        return;
+    }
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+        if (seconds[i] >= 0) {
+            fprintf(f, "%.6f %s\n", seconds[i], jobs[i].src);
+        }
+    }
+    if (fclose(f) != 0 || rename(TIMINGS_NAME ".tmp", TIMINGS_NAME) != 0) {
+        unlink(TIMINGS_NAME ".tmp");
+    }
+}
+
+// predicted seconds of every scheduled job, from its recorded time or its size, false if no time was recorded at all
+bool estimate_costs(sched_t* sched, uint64_t n, double* seconds)
+{
+    double known_seconds = 0;
+    double known_bytes = 0;
+    uint64_t i;
+    struct stat st;
+    for (i = 0; i < n; i++) {
+        if (seconds[sched[i].index] >= 0 && stat(sched[i].job->src, &st) == 0) {
+            known_seconds += seconds[sched[i].index];
+            known_bytes += st.st_size;
+        }
+    }
+    // without any history only the order matters
+    double rate = known_bytes > 0 ? known_seconds / known_bytes : 1e-6;
+    for (i = 0; i < n; i++) {
+        if (seconds[sched[i].index] >= 0) {
+            sched[i].cost = seconds[sched[i].index];
+        } else {
+            sched[i].cost = stat(sched[i].job->src, &st) == 0 ? st.st_size * rate : 0;
+        }
+    }
+    return known_bytes > 0;
+}
+
+int sched_cmp(const void* a, const void* b)
+{
+    const sched_t* x = a;
+    const sched_t* y = b;
+    if (x->cost != y->cost) {
+        return (x->cost < y->cost) - (x->cost > y->cost);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// makespan of running sched in order on slots parallel jobs, each starting on the slot that frees up first
+double predict_makespan(sched_t* sched, uint64_t n, long slots)
+{
+    double* busy = calloc(slots, sizeof(*busy));
+    double makespan = 0;
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+        long s;
+        long first = 0;
+        for (s = 1; s < slots; s++) {
+            if (busy[s] < busy[first]) {
+                first = s;
+            }
+        }
+        busy[first] += sched[i].cost;
+        if (busy[first] > makespan) {
+            makespan = busy[first];
+        }
+    }
+    free(busy);
+    return makespan;
+}
+
+static char* program = "pp";
+static char* flags[] = { "-Ofast", "-pthread", NULL };
+static char* pch = NULL;
+
+static job_t jobs[] = {
+    { "./main.c", "./main.o", "./main.d", 0 },
+    { NULL, NULL, NULL, 0 },
+};
+
+static char* parts[] = {
+    "./.pp_part.o",
+    NULL,
+};
+
+// Builds the precompiled header header.gch next to header, the pch of the package. A compiler that cannot do it leaves
+// header.failed behind, which keeps later runs from retrying until the flags or header change, and every translation unit is
+// compiled without it.
+bool build_pch(char* header, char* compiler, char** extra, int64_t stamp_time)
+{
+    char* gch = malloc(strlen(header) + 8);
+    char* dep = malloc(strlen(header) + 8);
+    char* failed = malloc(strlen(header) + 8);
+    sprintf(gch, "%s.gch", header);
+    sprintf(dep, "%s.d", header);
+    sprintf(failed, "%s.failed", header);
+    job_t job = { .src = header, .obj = gch, .dep = dep };
+    bool ok = 1;
+    int64_t failed_time = mtime_of(failed);
+    if (failed_time >= 0 && failed_time >= stamp_time && failed_time >= mtime_of(header)) {
+        ok = 0;
+    } else if (needs_rebuild(&job, stamp_time)) {
+        printf("precompiling: %s\n", header);
+        fflush(stdout);
+        args_t args = { 0 };
+        args_push(&args, compiler);
+        args_push(&args, "-x");
+        args_push(&args, "c-header");
+        args_push_all(&args, flags);
+        args_push_all(&args, extra);
+        args_push(&args, "-MMD");
+        args_push(&args, "-MF");
+        args_push(&args, dep);
+        args_push(&args, header);
+        args_push(&args, "-o");
+        args_push(&args, gch);
+        ok = run_command(args.buf);
+        free(args.buf);
+        if (!ok) {
+            fprintf(stderr, "could not precompile %s, compiling without it\n", header);
+            unlink(gch);
+            FILE* f = fopen(failed, "w");
+            if (f != NULL) {
+                fclose(f);
+            }
+        }
+    }
+    if (ok) {
+        unlink(failed);
+    }
+    free(gch);
+    free(dep);
+    free(failed);
+    return ok;
+}
+
+// base holds the compiler, the flags and the precompiled header
+args_t compile_args(job_t* job, args_t* base)
+{
+    args_t args = { 0 };
+    args_push_all(&args, base->buf);
+    args_push(&args, "-c");
+    args_push(&args, "-MMD");
+    args_push(&args, "-MF");
+    args_push(&args, job->dep);
+    args_push(&args, job->src);
+    args_push(&args, "-o");
+    args_push(&args, job->obj);
+    return args;
+}
+
+// Compiles job in the background. With a cache or a worker, a child process preprocesses the source, which also writes the
+// depfile, and restores the object from the cache, or compiles it on the worker or here and inserts it. A job whose worker
+// did not compile it exits with REMOTE_FALLBACK after recording why in remote, to be started again without a worker.
+pid_t start_job(job_t* job, args_t* base, cache_t* cache, cache_key_t* key, worker_t* worker, remote_t* remote)
+{
+    args_t args = compile_args(job, base);
+    if (cache == NULL && worker == NULL) {
+        printf("compiling: %s\n", job->src);
+        fflush(stdout);
+        pid_t pid = start_command(args.buf);
+        free(args.buf);
+        return pid;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        free(args.buf);
+        return pid;
+    }
+
+    args_t pre = { 0 };
+    args_push_all(&pre, base->buf);
+    args_push(&pre, "-E");
+    args_push(&pre, "-MMD");
+    args_push(&pre, "-MF");
+    args_push(&pre, job->dep);
+    args_push(&pre, job->src);
+    uint64_t len;
+    char* preprocessed = capture_command(pre.buf, &len);
+    char* entry = NULL;
+    if (preprocessed != NULL && cache != NULL) {
+        cache_key_t k = *key;
+        key_update(&k, preprocessed, len);
+        entry = cache_entry(cache, &k);
+        if (cache_get(entry, job->obj)) {
+            __atomic_fetch_add(&cache->stats->hits, 1, __ATOMIC_RELAXED);
+            cache->hit[job - jobs] = 1;
+            printf("cached: %s\n", job->src);
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+    if (cache != NULL) {
+        __atomic_fetch_add(&cache->stats->misses, 1, __ATOMIC_RELAXED);
+    }
+    bool ok;
+    if (worker != NULL && preprocessed != NULL) {
+        printf("compiling on %s: %s\n", worker->address, job->src);
+        fflush(stdout);
+        int status = remote_compile(worker->address, base->buf, preprocessed, len, job->obj, remote);
+        if (status == REMOTE_FALLBACK) {
+            if (cache != NULL) {
+                __atomic_fetch_sub(&cache->stats->misses, 1, __ATOMIC_RELAXED); // counted by the retry
+            }
+            _exit(REMOTE_FALLBACK);
+        }
+        ok = status == 0;
+    } else {
+        printf("compiling: %s\n", job->src);
+        fflush(stdout);
+        ok = run_command(args.buf);
+    }
+    if (ok && entry != NULL) {
+        cache_put(cache, entry, job->obj);
+    }
+    _exit(ok ? 0 : 1);
+}
+
+// Waits for a job. A unit its worker handed back is added to retry, to be compiled here. Returns false if a unit failed.
+bool wait_job(timing_t* timings, uint64_t n, worker_t** on, remote_t* remote, timing_t** retry, uint64_t* n_retry, long* local,
+              int format)
+{
+    pid_t pid;
+    int status = wait_status(&pid);
+    timing_t* t = pid > 0 ? timing_find(timings, n, pid) : NULL;
+    if (t == NULL) {
+        return status == 0;
+    }
+    worker_t* w = on[t->job - jobs];
+    if (w == NULL) {
+        (*local)--;
+    } else {
+        on[t->job - jobs] = NULL;
+        worker_account(w, &remote[t->job - jobs]);
+        if (status == REMOTE_FALLBACK) {
+            t->pid = -1; // neither running nor finished
+            retry[(*n_retry)++] = t;
+            return 1;
+        }
+    }
+    timing_finish(t, format);
+    return status == 0;
+}
+
+// Unless LTO needs every object in the final link, the objects of a directory with several units are linked into parts[i]
+// with -r, and the program from the parts and the objects of single unit directories. A change then relinks its directory
+// and the program from a few large objects. A part is relinked when one of its objects or compile.c, which may have moved
+// units, is newer. Returns false if a link failed, the inputs of the final link are pushed onto inputs.
+bool link_parts(char* compiler, long max_jobs, args_t* inputs, uint64_t* relinked)
+{
+    uint64_t n_parts = 0;
+    while (parts[n_parts] != NULL) {
+        n_parts++;
+    }
+    uint64_t* members = calloc(n_parts + 1, sizeof(*members));
+    int64_t* newest = calloc(n_parts + 1, sizeof(*newest));
+    job_t** first = calloc(n_parts + 1, sizeof(*first));
+    job_t* job;
+    for (job = jobs; job->src != NULL; job++) {
+        if (members[job->part]++ == 0) {
+            first[job->part] = job;
+        }
+        int64_t t = mtime_of(job->obj);
+        newest[job->part] = t > newest[job->part] ? t : newest[job->part];
+    }
+    int64_t compile_time = mtime_of("compile.c");
+    bool ok = 1;
+    long running = 0;
+    uint64_t p;
+    for (p = 0; p < n_parts && ok; p++) {
+        if (members[p] < 2) {
+            if (members[p] == 1) {
+                args_push(inputs, first[p]->obj);
+            }
+            continue;
+        }
+        args_push(inputs, parts[p]);
+        int64_t part_time = mtime_of(parts[p]);
+        if (part_time >= 0 && part_time >= newest[p] && part_time >= compile_time) {
+            continue;
+        }
+        if (running >= max_jobs) {
+            ok = wait_command(NULL) && ok;
+            running--;
+        }
+        args_t args = { 0 };
+        args_push(&args, compiler);
+        args_push(&args, "-r");
+        args_push(&args, "-nostdlib");
+        char** flag;
+        // -m32 and the like select what the linker produces
+        for (flag = flags; *flag != NULL; flag++) {
+            if (strncmp(*flag, "-m", 2) == 0) {
+                args_push(&args, *flag);
+            }
+        }
+        args_push(&args, "-o");
+        args_push(&args, parts[p]);
+        for (job = first[p]; job->src != NULL; job++) {
+            if (job->part == p) {
+                args_push(&args, job->obj);
+            }
+        }
+        ok = ok && start_command(args.buf) > 0;
+        free(args.buf);
+        if (!ok) {
+            break;
+        }
+        running++;
+        (*relinked)++;
+    }
+    while (running > 0) {
+        ok = wait_command(NULL) && ok;
+        running--;
+    }
+    free(members);
+    free(newest);
+    free(first);
+    return ok;
+}
+
+// a build of program, build_run compiles what is out of date and links
+typedef struct build_t build_t;
+struct build_t {
+    char* compiler;
+    long max_jobs;
+    cache_t cache;
+    int timing;
+    FILE* report;
+    args_t extra; // passed to every compile and the link, recorded in .pp_flags
+    args_t link_extra; // passed to the link only
+    bool lto;
+    worker_t* workers;
+    uint64_t n_workers;
+    bool pgo; // the JSON report of every build is a member of the one of build_pgo
+};
+
+// exits after a failed build, closing the JSON report of -p so that it stays one object
+void build_failed(build_t* b, char* status)
+{
+    fprintf(stderr, "%s\n", status);
+    if (b->pgo && b->timing == TIMING_JSON) {
+        fprintf(b->report, ",\n\"status\": \"%s\"\n}\n", status);
+    }
+    exit(1);
+}
+
+void build_run(build_t* b)
+{
+    double build_start = now();
+    uint64_t n_jobs = 0;
+    while (jobs[n_jobs].src != NULL) {
+        n_jobs++;
+    }
+
+    char* flags_stamp = join_args(flags);
+    if (b->extra.buf != NULL) {
+        char* extra = join_args(b->extra.buf);
+        flags_stamp = realloc(flags_stamp, strlen(flags_stamp) + strlen(extra) + 1);
+        strcat(flags_stamp, extra);
+        free(extra);
+    }
+    update_stamp(".pp_flags", flags_stamp);
+    free(flags_stamp);
+    int64_t stamp_time = mtime_of(".pp_flags");
+
+    bool use_pch = pch != NULL && build_pch(pch, b->compiler, b->extra.buf, stamp_time);
+    update_stamp(".pp_pch", use_pch ? "on\n" : "off\n");
+    // units do not list the headers they take from the precompiled header in their depfiles, so a rebuilt one rebuilds them all
+    int64_t pch_time = mtime_of(".pp_pch");
+    if (use_pch) {
+        char* gch = malloc(strlen(pch) + 8);
+        sprintf(gch, "%s.gch", pch);
+        int64_t gch_time = mtime_of(gch);
+        pch_time = gch_time > pch_time ? gch_time : pch_time;
+        free(gch);
+    }
+    if (pch_time > stamp_time) {
+        stamp_time = pch_time;
+    }
+
+    args_t base = { 0 };
+    args_push(&base, b->compiler);
+    args_push_all(&base, flags);
+    args_push_all(&base, b->extra.buf);
+    if (use_pch) {
+        args_push(&base, "-include");
+        args_push(&base, pch);
+    }
+    cache_t cache = b->cache;
+    cache_key_t key = { { 0 } };
+    if (cache.dir != NULL && *cache.dir != 0) {
+        mkdir(cache.dir, 0755);
+        cache.stats = mmap(NULL, sizeof(*cache.stats) + n_jobs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (cache.stats == MAP_FAILED) {
+            cache.stats = NULL;
+        } else {
+            cache.hit = (unsigned char*)(cache.stats + 1);
+        }
+        key_compiler(&key, b->compiler);
+        char** arg;
+        for (arg = base.buf + 1; *arg != NULL; arg++) {
+            key_string(&key, *arg);
+            // debug information records the build directory
+            if (strncmp(*arg, "-g", 2) == 0) {
+                char cwd[4096];
+                key_string(&key, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+            }
+        }
+    }
+    cache_t* job_cache = cache.stats != NULL ? &cache : NULL;
+
+    double* seconds = malloc((n_jobs + 1) * sizeof(*seconds));
+    timings_load(jobs, n_jobs, seconds);
+    sched_t* sched = malloc((n_jobs + 1) * sizeof(*sched));
+    uint64_t n_sched = 0;
+    uint64_t i;
+    for (i = 0; i < n_jobs; i++) {
+        if (needs_rebuild(&jobs[i], stamp_time)) {
+            sched[n_sched].job = &jobs[i];
+            sched[n_sched++].index = i;
+        }
+    }
+    bool known = estimate_costs(sched, n_sched, seconds);
+    qsort(sched, n_sched, sizeof(*sched), sched_cmp);
+    double predicted = known ? predict_makespan(sched, n_sched, b->max_jobs) : -1;
+    if (n_sched > 0 && known) {
+        printf("scheduling %llu translation units longest first, predicted makespan %.3fs\n", (unsigned long long)n_sched,
+               predicted);
+    }
+
+    timing_t* timings = calloc(n_jobs + 1, sizeof(*timings));
+    worker_t** on = calloc(n_jobs + 1, sizeof(*on)); // the worker compiling every job, NULL for jobs running here
+    timing_t** retry = malloc((n_sched + 1) * sizeof(*retry));
+    remote_t* remote = NULL;
+    if (n_sched > 0 && b->n_workers > 0) {
+        workers_probe(b->workers, b->n_workers);
+        remote = mmap(NULL, (n_jobs + 1) * sizeof(*remote), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (remote == MAP_FAILED) {
+            remote = NULL;
+        }
+    }
+    double compile_start = now();
+    long local = 0;
+    long running = 0;
+    uint64_t next = 0;
+    uint64_t n_retry = 0;
+    uint64_t handed_back = 0;
+    uint64_t compiled = 0;
+    bool failed = 0;
+    pid_t pid;
+    job_t* job;
+    // workers take units first, units they hand back are compiled here before the ones not started yet
+    while (!failed && (next < n_sched || n_retry > 0 || running > 0)) {
+        worker_t* w = remote != NULL && next < n_sched ? worker_pick(b->workers, b->n_workers) : NULL;
+        if (w == NULL && (local >= b->max_jobs || (next == n_sched && n_retry == 0))) {
+            uint64_t before = n_retry;
+            failed = !wait_job(timings, compiled, on, remote, retry, &n_retry, &local, b->timing);
+            handed_back += n_retry - before;
+            running--;
+            continue;
+        }
+        timing_t* t;
+        if (w == NULL && n_retry > 0) {
+            t = retry[--n_retry];
+        } else {
+            t = &timings[compiled++];
+            t->job = sched[next++].job;
+        }
+        job = t->job;
+        if (w != NULL) {
+            remote[job - jobs] = (remote_t) { 0 };
+        }
+        pid = start_job(job, &base, job_cache, &key, w, w != NULL ? &remote[job - jobs] : NULL);
+        if (pid < 0) {
+            failed = 1;
+            break;
+        }
+        t->pid = pid;
+        t->start = now();
+        on[job - jobs] = w;
+        if (w != NULL) {
+            w->running++;
+        } else {
+            local++;
+        }
+        running++;
+    }
+    while (running > 0) {
+        if (!wait_job(timings, compiled, on, remote, retry, &n_retry, &local, b->timing)) {
+            failed = 1;
+        }
+        running--;
+    }
+    double makespan = now() - compile_start;
+    // a unit restored from the cache says nothing about how long it takes to compile
+    for (i = 0; i < compiled; i++) {
+        if (timings[i].pid == 0 && (job_cache == NULL || !cache.hit[timings[i].job - jobs])) {
+            seconds[timings[i].job - jobs] = timings[i].seconds;
+        }
+    }
+    timings_save(jobs, n_jobs, seconds);
+    free(seconds);
+    free(sched);
+    if (compiled > 0 && known) {
+        printf("compiled %llu translation units in %.3fs, predicted %.3fs\n", (unsigned long long)compiled, makespan, predicted);
+    } else if (compiled > 0) {
+        printf("compiled %llu translation units in %.3fs\n", (unsigned long long)compiled, makespan);
+    }
+    uint64_t n_workers = remote != NULL ? b->n_workers : 0;
+    if (remote != NULL) {
+        worker_report(stdout, b->workers, b->n_workers, makespan, TIMING_TEXT);
+        if (handed_back > 0) {
+            printf("compiled %llu translation units here that busy or unreachable workers handed back\n",
+                   (unsigned long long)handed_back);
+        }
+        munmap(remote, (n_jobs + 1) * sizeof(*remote));
+    }
+    free(on);
+    free(retry);
+    if (failed) {
+        if (b->timing != TIMING_OFF) {
+            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, 0, now() - build_start,
+                          "compilation failed", b->workers, n_workers);
+        }
+        build_failed(b, "compilation failed");
+    }
+
+    free(base.buf);
+    if (job_cache != NULL) {
+        uint64_t looked_up = cache.stats->hits + cache.stats->misses;
+        if (looked_up > 0) {
+            printf("cache: %llu hits, %llu misses (%.0f%% hit rate)\n", (unsigned long long)cache.stats->hits,
+                   (unsigned long long)cache.stats->misses, 100.0 * cache.stats->hits / looked_up);
+        }
+        if (cache.stats->inserted > 0) {
+            cache_evict(&cache);
+        }
+        munmap(cache.stats, sizeof(*cache.stats) + n_jobs);
+    }
+
+    int64_t program_time = mtime_of(program);
+    bool relink = compiled > 0 || program_time < 0 || stamp_time > program_time || mtime_of("compile.c") > program_time;
+    for (job = jobs; job != jobs + n_jobs && !relink; job++) {
+        relink = mtime_of(job->obj) > program_time;
+    }
+    if (!relink) {
+        printf("%s is up to date\n", program);
+        if (b->timing != TIMING_OFF) {
+            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, 0, now() - build_start, "ok",
+                          b->workers, n_workers);
+        }
+        free(timings);
+        return;
+    }
+    double link_start = now();
+
+    args_t link = { 0 };
+    args_push(&link, b->compiler);
+    args_push(&link, "-o");
+    args_push(&link, program);
+    args_push_all(&link, flags);
+    args_push_all(&link, b->extra.buf);
+    args_push_all(&link, b->link_extra.buf);
+    uint64_t relinked = 0;
+    char* status = "ok";
+    if (b->lto) {
+        for (job = jobs; job != jobs + n_jobs; job++) {
+            args_push(&link, job->obj);
+        }
+    } else if (!link_parts(b->compiler, b->max_jobs, &link, &relinked)) {
+        status = "partial linking failed";
+    }
+    double parts_seconds = now() - link_start;
+    if (strcmp(status, "ok") == 0 && !run_command(link.buf)) {
+        status = "linking failed";
+    }
+    if (strcmp(status, "ok") != 0) {
+        if (b->timing != TIMING_OFF) {
+            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, now() - link_start,
+                          now() - build_start, status, b->workers, n_workers);
+        }
+        build_failed(b, status);
+    }
+    free(link.buf);
+    if (relinked > 0) {
+        printf("linked the objects of %llu director%s in %.3fs, %s in %.3fs\n", (unsigned long long)relinked,
+               relinked == 1 ? "y" : "ies", parts_seconds, program, now() - link_start - parts_seconds);
+    }
+    if (b->lto) {
+        // with LTO the link is where the code is optimised and generated
+        printf("linked with LTO on %ld jobs in %.3fs\n", b->max_jobs, now() - link_start);
+    }
+    if (b->timing != TIMING_OFF) {
+        timing_report(b->report, timings, compiled, b->timing, makespan, predicted, now() - link_start, now() - build_start,
+                      "ok", b->workers, n_workers);
+    }
+    free(timings);
+}
+
+// "-name=value" in a malloced buffer
+char* flag_value(char* name, char* value)
+{
+    char* flag = malloc(strlen(name) + strlen(value) + 2);
+    sprintf(flag, "%s=%s", name, value);
+    return flag;
+}
+
+bool is_clang(char* compiler)
+{
+    char* name = strrchr(compiler, '/');
+    return strstr(name != NULL ? name + 1 : compiler, "clang") != NULL;
+}
+
+// Whole program optimisation: GCC links with -flto=N, N parallel LTRANS processes on as many partitions, Clang uses ThinLTO
+// with N backend jobs.
+void build_lto(build_t* b)
+{
+    char n[32];
+    snprintf(n, sizeof(n), "%ld", b->max_jobs);
+    b->lto = 1;
+    if (is_clang(b->compiler)) {
+        args_push(&b->extra, "-flto=thin");
+        args_push(&b->link_extra, flag_value("-flto-jobs", n));
+    } else {
+        args_push(&b->extra, "-flto");
+        args_push(&b->link_extra, flag_value("-flto", n));
+        args_push(&b->link_extra, flag_value("--param=lto-partitions", n));
+    }
+}
+
+// profile guided optimisation
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// -p CMD builds with -fprofile-generate into PROFILE_DIR, runs the training command CMD, merges the profiles (Clang writes
+// raw ones for llvm-profdata, GCC's .gcda files are used as they are) and builds again with -fprofile-use. Every phase
+// changes the flags recorded in .pp_flags, so each one rebuilds all units.
+
+#define PROFILE_DIR ".pp_profile"
+
+// runs command through sh and returns how long it took, -1 if it failed
+double run_timed(char* command)
 {
-    va_list ap;
-    va_start(ap, comp);
-    char* cmd = malloc(256);
-    uint64_t len = 256;
-    uint64_t new_len = strlen(comp);
-    strcpy(cmd, comp);
-    char* next_arg = NULL;
+    char* args[] = { "sh", "-c", command, NULL };
+    double start = now();
+    if (!run_command(args)) {
+        return -1;
+    }
+    return now() - start;
+}
 
-    while ((next_arg = va_arg(ap, char*)) != NULL) {
-        new_len += strlen(next_arg) + 3;
-        if (new_len >= len) {
-            cmd = realloc(cmd, new_len << 1);
-            len = new_len << 1;
+// removes the profiles of earlier runs from dir, or creates it
+void clear_profiles(char* dir)
+{
+    mkdir(dir, 0755);
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    char path[4096];
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
         }
-        strcat(cmd, " ");
-        strcat(cmd, next_arg);
     }
+    closedir(d);
+}
 
-    system(cmd);
-    free(cmd);
+// merges the raw profiles in dir into dir/default.profdata, PP_PROFDATA names llvm-profdata
+bool merge_profiles(char* dir, char* profdata)
+{
+    args_t args = { 0 };
+    args_push(&args, getenv("PP_PROFDATA") != NULL ? getenv("PP_PROFDATA") : "llvm-profdata");
+    args_push(&args, "merge");
+    args_push(&args, flag_value("-output", profdata));
+    DIR* d = opendir(dir);
+    struct dirent* e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        uint64_t len = strlen(e->d_name);
+        if (len > 8 && strcmp(e->d_name + len - 8, ".profraw") == 0) {
+            char* path = malloc(strlen(dir) + len + 2);
+            sprintf(path, "%s/%s", dir, e->d_name);
+            args_push(&args, path);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    bool ok = run_command(args.buf);
+    uint64_t i;
+    for (i = 2; i < args.used; i++) {
+        free(args.buf[i]);
+    }
+    free(args.buf);
+    return ok;
+}
+
+void build_pgo(build_t* b, char* training)
+{
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "could not get the build directory: %s\n", strerror(errno));
+        exit(1);
+    }
+    // absolute, the training command may run the program from anywhere
+    char* dir = malloc(strlen(cwd) + sizeof(PROFILE_DIR) + 1);
+    sprintf(dir, "%s/%s", cwd, PROFILE_DIR);
+    char* profdata = malloc(strlen(dir) + 20);
+    sprintf(profdata, "%s/default.profdata", dir);
+    bool clang = is_clang(b->compiler);
+    FILE* json = b->timing == TIMING_JSON ? b->report : NULL;
+    b->pgo = 1;
+    uint64_t n_extra = b->extra.used;
+
+    double before = -1;
+    if (mtime_of(program) >= 0) {
+        printf("pgo: timing the training command with the previous build\n");
+        fflush(stdout);
+        before = run_timed(training);
+    }
+
+    double start = now();
+    clear_profiles(dir);
+    args_push(&b->extra, flag_value("-fprofile-generate", dir));
+    printf("pgo: instrumented build\n");
+    if (json != NULL) {
+        fprintf(json, "{\n\"instrumented\": ");
+    }
+    build_run(b);
+    double instrumented = now() - start;
+
+    printf("pgo: training: %s\n", training);
+    fflush(stdout);
+    double training_seconds = run_timed(training);
+    if (training_seconds < 0) {
+        build_failed(b, "training command failed");
+    }
+
+    start = now();
+    if (clang && !merge_profiles(dir, profdata)) {
+        fprintf(stderr, "could not merge the profiles in %s\n", dir);
+        build_failed(b, "merging the profiles failed");
+    }
+    double merge = now() - start;
+
+    start = now();
+    free(b->extra.buf[n_extra]);
+    b->extra.used = n_extra;
+    b->extra.buf[n_extra] = NULL;
+    if (clang) {
+        args_push(&b->extra, flag_value("-fprofile-use", profdata));
+    } else {
+        args_push(&b->extra, flag_value("-fprofile-use", dir));
+        // code the training did not reach keeps the usual optimisation instead of being treated as cold
+        args_push(&b->extra, "-fprofile-partial-training");
+        args_push(&b->extra, "-Wno-missing-profile");
+    }
+    printf("pgo: optimised build\n");
+    if (json != NULL) {
+        fprintf(json, ",\n\"optimized\": ");
+    }
+    build_run(b);
+    double optimised = now() - start;
+
+    printf("pgo: timing the training command with the optimised build\n");
+    fflush(stdout);
+    double after = run_timed(training);
+    printf("pgo: instrumented build %.3fs, training %.3fs, merge %.3fs, optimised build %.3fs\n", instrumented, training_seconds,
+           merge, optimised);
+    if (before > 0 && after > 0) {
+        printf("pgo: training command took %.3fs with the previous build, %.3fs optimised (%.2fx)\n", before, after,
+               before / after);
+    } else if (after > 0) {
+        printf("pgo: training command took %.3fs optimised\n", after);
+    }
+    if (json != NULL) {
+        fprintf(json,
+                ",\n\"instrumented_build_seconds\": %.6f,\n\"training_seconds\": %.6f,\n\"merge_seconds\": %.6f,\n"
+                "\"optimized_build_seconds\": %.6f,\n\"previous_run_seconds\": ",
+                instrumented, training_seconds, merge, optimised);
+        if (before > 0) {
+            fprintf(json, "%.6f", before);
+        } else {
+            fprintf(json, "null");
+        }
+        fprintf(json, ",\n\"optimized_run_seconds\": ");
+        if (after > 0) {
+            fprintf(json, "%.6f", after);
+        } else {
+            fprintf(json, "null");
+        }
+        fprintf(json, ",\n\"status\": \"ok\"\n}\n");
+    }
+    free(dir);
+    free(profdata);
+}
+
+void add_worker(build_t* b, char* address)
+{
+    b->workers = realloc(b->workers, (b->n_workers + 1) * sizeof(*b->workers));
+    b->workers[b->n_workers++] = (worker_t) { .address = address };
 }
 
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
+    build_t b = { 0 };
+    b.max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    b.cache = (cache_t) { getenv("PP_CACHE_DIR"), 1ull << 30, NULL, NULL };
+    if (getenv("PP_CACHE_SIZE") != NULL) {
+        b.cache.max_size = strtoull(getenv("PP_CACHE_SIZE"), NULL, 10) << 20;
+    }
+    int opt;
+    bool lto = 0;
+    char* training = NULL;
+    while ((opt = getopt(argc, argv, "j:c:s:T:lp:w:")) != -1) {
+        switch (opt) {
+        case 'j':
+            b.max_jobs = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            b.cache.dir = optarg;
+            break;
+        case 's':
+            b.cache.max_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'T':
+            b.timing = strcmp(optarg, "json") == 0 ? TIMING_JSON : TIMING_TEXT;
+            break;
+        case 'l':
+            lto = 1;
+            break;
+        case 'p':
+            training = optarg;
+            break;
+        case 'w':
+            add_worker(&b, optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-j jobs] [-c cache_dir] [-s cache_megabytes] [-T text|json] [-l] [-p training_command] "
+                    "[-w unix:PATH|tcp:HOST:PORT]... compiler\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
         fprintf(stderr, "wrong number of argmuents\n");
         exit(1);
     }
-    char* compiler = argv[1];
-
-printf("compiling: ./main.c\n");
-run_command(compiler, "-c","-Ofast", "./main.c", "-o ./main.o");
+    if (b.max_jobs < 1) {
+        b.max_jobs = 1;
+    }
+    // PP_WORKERS lists the workers separated by commas when there is no -w
+    if (b.n_workers == 0 && getenv("PP_WORKERS") != NULL) {
+        char* address;
+        for (address = strtok(strdup(getenv("PP_WORKERS")), ", "); address != NULL; address = strtok(NULL, ", ")) {
+            add_worker(&b, address);
+        }
+    }
+    b.compiler = argv[optind];
+    // the JSON report owns stdout, progress goes to stderr
+    b.report = stdout;
+    if (b.timing == TIMING_JSON) {
+        fflush(stdout);
+        b.report = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
 
-run_command(compiler, "-o pp", "-Ofast" , "./main.o");
-return 0;
+    if (lto) {
+        build_lto(&b);
+    }
+    if (training == NULL) {
+        build_run(&b);
+        return 0;
+    }
+    // the objects depend on the profile, which the cache key does not cover, and a worker compiles from a temporary path of
+    // its own, under which the profile of the instrumented build would not be found
+    b.cache.dir = NULL;
+    b.n_workers = 0;
+    build_pgo(&b, training);
+    return 0;
 }
@@ -0,0 +1,103 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// XXH64: four independent lanes over 32 byte stripes, fast enough to hash file contents while copying them
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * HASH_PRIME2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_PRIME1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+static inline uint64_t hash64(const void* data, uint64_t len, uint64_t seed)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        uint64_t v2 = seed + HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+        h = hash_merge_round(h, v1);
+        h = hash_merge_round(h, v2);
+        h = hash_merge_round(h, v3);
+        h = hash_merge_round(h, v4);
+    } else {
+        h = seed + HASH_PRIME5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)hash_read32(p) * HASH_PRIME1;
+        h = hash_rotl(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * HASH_PRIME5;
+        h = hash_rotl(h, 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t hash_string(const char* s)
+{
+    return hash64(s, strlen(s), 0);
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Byte oriented LZ77 in the LZ4 block layout: every sequence is a token (literal count in the high nibble, match length - 4
+// in the low one, 15 meaning more length bytes follow, each adding up to 255), the literals, a 16 bit little endian offset and
+// the extra match length bytes. The last sequence only has literals. Greedy matching on a hash of 4 bytes, with the step
+// growing over incompressible input.
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // matches end this far before the end at the latest
+
+static inline uint64_t lz_bound(uint64_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v, int bits)
+{
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+static inline uint8_t* lz_put_length(uint8_t* op, uint64_t len)
+{
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static inline uint8_t* lz_put_sequence(uint8_t* op, const uint8_t* lit, uint64_t n_lit, uint64_t offset, uint64_t match)
+{
+    uint8_t* token = op++;
+    *token = (uint8_t)((n_lit >= 15 ? 15 : n_lit) << 4);
+    if (n_lit >= 15) {
+        op = lz_put_length(op, n_lit - 15);
+    }
+    memcpy(op, lit, n_lit);
+    op += n_lit;
+    if (match == 0) {
+        return op;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match -= LZ_MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15) {
+        op = lz_put_length(op, match - 15);
+    }
+    return op;
+}
+
+// compresses n bytes of src into dst, which must hold lz_bound(n) bytes, and returns the compressed size
+static inline uint64_t lz_compress(const void* src, uint64_t n, void* dst)
+{
+    const uint8_t* in = src;
+    const uint8_t* end = in + n;
+    const uint8_t* anchor = in;
+    uint8_t* op = dst;
+    if (n > LZ_LAST_LITERALS + LZ_MIN_MATCH) {
+        // small inputs get a smaller table, clearing it would cost more than compressing them
+        int bits = 8;
+        while (bits < LZ_HASH_BITS && (1ull << (bits + 1)) < n) {
+            bits++;
+        }
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(*table) << bits);
+        const uint8_t* match_limit = end - LZ_LAST_LITERALS;
+        const uint8_t* ip = in + 1;
+        uint64_t misses = 0;
+        while (ip + LZ_MIN_MATCH <= match_limit) {
+            uint32_t h = lz_hash(lz_read32(ip), bits);
+            const uint8_t* ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip)) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* m = ip + LZ_MIN_MATCH;
+            const uint8_t* r = ref + LZ_MIN_MATCH;
+            uint64_t diff = 0;
+            while (m + 8 <= match_limit && (diff = lz_read64(m) ^ lz_read64(r)) == 0) {
+                m += 8;
+                r += 8;
+            }
+            if (diff != 0) {
+                m += __builtin_ctzll(diff) >> 3;
+            } else {
+                while (m < match_limit && *m == *r) {
+                    m++;
+                    r++;
+                }
+            }
+            op = lz_put_sequence(op, anchor, ip - anchor, ip - ref, m - ip);
+            if (m - 2 > in) {
+                table[lz_hash(lz_read32(m - 2), bits)] = (uint32_t)(m - 2 - in);
+            }
+            ip = anchor = m;
+        }
+    }
+    op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - (uint8_t*)dst;
+}
+
+static inline bool lz_get_length(const uint8_t** ip, const uint8_t* end, uint64_t* len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+// decompresses the n bytes at src into exactly out_n bytes at dst, false if the input is corrupt. Away from the ends of both
+// buffers short literal runs and matches are copied in whole words, running past their end into space written later anyway.
+static inline bool lz_decompress(const void* src, uint64_t n, void* dst, uint64_t out_n)
+{
+    const uint8_t* ip = src;
+    const uint8_t* end = ip + n;
+    uint8_t* op = dst;
+    uint8_t* out_end = op + out_n;
+    while (ip < end) {
+        uint8_t token = *ip++;
+        uint64_t n_lit = token >> 4;
+        if (n_lit < 15 && end - ip >= 16 && out_end - op >= 16) {
+            memcpy(op, ip, 16);
+            ip += n_lit;
+            op += n_lit;
+            goto match;
+        }
+        if (n_lit == 15 && !lz_get_length(&ip, end, &n_lit)) {
+            return 0;
+        }
+        if (n_lit > (uint64_t)(end - ip) || n_lit > (uint64_t)(out_end - op)) {
+            return 0;
+        }
+        memcpy(op, ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+    match:
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return 0;
+        }
+        uint64_t offset = ip[0] | (uint64_t)ip[1] << 8;
+        ip += 2;
+        uint64_t match = token & 15;
+        if (match == 15 && !lz_get_length(&ip, end, &match)) {
+            return 0;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (uint64_t)(op - (uint8_t*)dst) || match > (uint64_t)(out_end - op)) {
+            return 0;
+        }
+        const uint8_t* ref = op - offset;
+        if (offset >= 8 && out_end - op >= (int64_t)match + 8) {
+            uint8_t* stop = op + match;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < stop);
+            op = stop;
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            uint8_t* stop = op + match;
+            while (op < stop) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == out_end;
+}
+
+#endif
@@ -1,42 +1,245 @@
+#define _GNU_SOURCE
+#include "lib/hash.h"
+#include "lib/lz.h"
 #include "lib/panic.h"
 #include <dirent.h>
 #include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
+// file name
+//--------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct file_name_t file_name_t;
+struct file_name_t {
+    uint64_t block_size;
+    char* buf;
+};
+
+void file_name_init(file_name_t* fn)
+{
+    fn->buf = calloc(1, 256);
+    fn->block_size = 256;
+}
+
+void file_name_uninit(file_name_t* fn)
+{
+    free(fn->buf);
+}
+
+void file_name_reserve(file_name_t* fn, uint64_t len)
+{
+    if (len >= fn->block_size) {
+        fn->block_size = len;
+        fn->buf = realloc(fn->buf, fn->block_size);
+        panic_if(fn->buf == NULL, "could not realloc file name: %s", strerror(errno));
+    }
+}
+
+char* file_name_cat(file_name_t* fn, char* s1, char* s2)
+{
+    uint64_t len1 = strlen(s1);
+    uint64_t len2 = strlen(s2);
+    file_name_reserve(fn, len1 + len2 + 2);
+    memcpy(fn->buf, s1, len1);
+    fn->buf[len1] = '/';
+    memcpy(fn->buf + len1 + 1, s2, len2 + 1);
+    return fn->buf;
+}
+
+// arena
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// strings packed back to back and addressed by offset, so they survive the arena growing
+
+typedef struct arena_t arena_t;
+struct arena_t {
+    char* buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+uint64_t arena_push_len(arena_t* a, char* s, uint64_t len)
+{
+    if (a->used + len + 1 > a->allocated) {
+        a->allocated = a->allocated ? a->allocated : 4096;
+        while (a->used + len + 1 > a->allocated) {
+            a->allocated <<= 1;
+        }
+        a->buf = realloc(a->buf, a->allocated);
+        panic_if(a->buf == NULL, "could not realloc arena: %s", strerror(errno));
+    }
+    uint64_t offset = a->used;
+    memcpy(a->buf + offset, s, len);
+    a->buf[offset + len] = 0;
+    a->used += len + 1;
+    return offset;
+}
+
+uint64_t arena_push(arena_t* a, char* s)
+{
+    return arena_push_len(a, s, strlen(s));
+}
+
+void arena_free(arena_t* a)
+{
+    free(a->buf);
+    a->buf = NULL;
+    a->used = 0;
+    a->allocated = 0;
+}
+
+// path table
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Every path is stored once as the index of its parent plus its own name in an arena, so the prefix shared by all files of a
+// directory is kept once instead of once per file. Full paths are only built (pt_path) when a syscall needs one.
+
+#define PATH_NONE UINT32_MAX
+
+typedef struct path_t path_t;
+struct path_t {
+    uint64_t name;
+    uint32_t parent;
+    uint32_t len;
+};
+
+typedef struct path_table_t path_table_t;
+struct path_table_t {
+    arena_t names;
+    path_t* buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+path_table_t* pt_create(uint64_t init_length)
+{
+    path_table_t* pt = calloc(1, sizeof(*pt));
+    if (pt == NULL) {
+        return NULL;
+    }
+    pt->allocated = init_length;
+    pt->buf = malloc(sizeof(*pt->buf) * pt->allocated);
+    if (pt->buf == NULL) {
+        free(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+void pt_free(path_table_t* pt)
+{
+    if (pt == NULL) {
+        return;
+    }
+    arena_free(&pt->names);
+    free(pt->buf);
+    free(pt);
+}
+
+uint32_t pt_add(path_table_t* pt, uint32_t parent, char* name)
+{
+    if (pt->used >= pt->allocated) {
+        pt->allocated <<= 1;
+        pt->buf = realloc(pt->buf, pt->allocated * sizeof(*pt->buf));
+        panic_if(pt->buf == NULL, "could not realloc path table: %s", strerror(errno));
+    }
+    panic_if(pt->used >= PATH_NONE, "too many paths");
+    path_t* p = &pt->buf[pt->used];
+    p->len = strlen(name);
+    p->name = arena_push_len(&pt->names, name, p->len);
+    p->parent = parent;
+    return pt->used++;
+}
+
+char* pt_name(path_table_t* pt, uint32_t id)
+{
+    return pt->names.buf + pt->buf[id].name;
+}
+
+// builds "prefix/path" (or just the path if prefix is NULL) in fn
+char* pt_path(path_table_t* pt, char* prefix, uint32_t id, file_name_t* fn)
+{
+    if (id == PATH_NONE) {
+        file_name_reserve(fn, (prefix == NULL ? 0 : strlen(prefix)) + 1);
+        return strcpy(fn->buf, prefix == NULL ? "" : prefix);
+    }
+    uint64_t prefix_len = prefix == NULL ? 0 : strlen(prefix) + 1;
+    uint64_t len = prefix_len;
+    uint32_t p;
+    for (p = id; p != PATH_NONE; p = pt->buf[p].parent) {
+        len += pt->buf[p].len + 1;
+    }
+    file_name_reserve(fn, len + 1);
+    char* end = fn->buf + len - 1;
+    *end = 0;
+    for (p = id; p != PATH_NONE; p = pt->buf[p].parent) {
+        end -= pt->buf[p].len;
+        memcpy(end, pt_name(pt, p), pt->buf[p].len);
+        if (end != fn->buf) {
+            *--end = '/';
+        }
+    }
+    if (prefix != NULL) {
+        memcpy(fn->buf, prefix, prefix_len - 1);
+    }
+    return fn->buf;
+}
+
 // name buffer
 //--------------------------------------------------------------------------------------------------------------------------------
 
 typedef struct name_buf_t name_buf_t;
 struct name_buf_t {
-    char** buf;
+    path_table_t* table;
+    uint32_t* buf;
     uint64_t used;
     uint64_t allocated;
 };
-name_buf_t* nb_create(uint64_t init_length);
-int nb_push(name_buf_t* nb, char* name);
+name_buf_t* nb_create(path_table_t* table, uint64_t init_length);
+int nb_push(name_buf_t* nb, uint32_t path);
 
 name_buf_t* nb_copy(name_buf_t* nb)
 {
-    name_buf_t* new = nb_create(nb->used);
+    name_buf_t* new = nb_create(nb->table, nb->used);
     panic_if(new == NULL, "could not copy name buf");
-    char** name;
-    for (name = nb->buf; name != nb->buf + nb->used; name++) {
-        nb_push(new, *name);
-    }
+    memcpy(new->buf, nb->buf, nb->used * sizeof(*nb->buf));
+    new->used = nb->used;
     return new;
 }
 
-int nb_push(name_buf_t* nb, char* name)
+int nb_push(name_buf_t* nb, uint32_t path)
 {
     if (nb->used >= nb->allocated) {
         nb->allocated <<= 1;
@@ -45,19 +248,18 @@ int nb_push(name_buf_t* nb, char* name)
             return -1;
         }
     }
-    nb->buf[nb->used] = malloc(strlen(name) + 1);
-    panic_if(nb->buf == NULL, "could not realloc name_buf: %s", strerror(errno));
-    strcpy(nb->buf[nb->used++], name);
+    nb->buf[nb->used++] = path;
     return 0;
 }
 
-name_buf_t* nb_create(uint64_t init_length)
+name_buf_t* nb_create(path_table_t* table, uint64_t init_length)
 {
     name_buf_t* nb = malloc(sizeof(*nb));
     if (nb == NULL) {
         return NULL;
     }
-    nb->allocated = init_length;
+    nb->table = table;
+    nb->allocated = init_length ? init_length : 1;
     nb->used = 0;
     nb->buf = malloc(sizeof(*nb->buf) * nb->allocated);
     if (nb->buf == NULL) {
@@ -72,223 +274,6925 @@ void nb_free(name_buf_t* nb)
     if (nb == NULL) {
         return;
     }
-    char** p;
-    for (p = nb->buf; p != nb->buf + nb->used; p++) {
-        free(*p);
-    }
     free(nb->buf);
     free(nb);
 }
 
-// file_t
+// builds the full path of entry i, see pt_path
+char* nb_path(name_buf_t* nb, char* prefix, uint64_t i, file_name_t* fn)
+{
+    return pt_path(nb->table, prefix, nb->buf[i], fn);
+}
+
+// path map
 //--------------------------------------------------------------------------------------------------------------------------------
 
-bool is_c_file(struct dirent* entry)
+// maps path strings (kept in an arena) to a number, open addressing on the hash of the path
+
+typedef struct path_map_entry_t path_map_entry_t;
+struct path_map_entry_t {
+    uint64_t path; // offset in names, 0 marks an empty slot
+    uint64_t value;
+};
+
+typedef struct path_map_t path_map_t;
+struct path_map_t {
+    arena_t names;
+    path_map_entry_t* buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+path_map_t* pm_create(uint64_t init_length)
 {
-    uint64_t len = strlen(entry->d_name);
-    if (entry->d_name[len - 2] != '.') {
-        return 0;
-    }
-    if (entry->d_name[len - 1] != 'c' && entry->d_name[len - 1] != 'h') {
-        return 0;
+    path_map_t* pm = calloc(1, sizeof(*pm));
+    panic_if(pm == NULL, "could not allocate path map: %s", strerror(errno));
+    pm->allocated = 16;
+    while (pm->allocated < init_length * 2) {
+        pm->allocated <<= 1;
     }
-    return 1;
+    pm->buf = calloc(pm->allocated, sizeof(*pm->buf));
+    panic_if(pm->buf == NULL, "could not allocate path map: %s", strerror(errno));
+    arena_push(&pm->names, "");
+    return pm;
 }
 
-typedef struct file_name_t file_name_t;
-struct file_name_t {
-    uint64_t block_size;
-    char* buf;
-};
-
-void file_name_init(file_name_t* fn)
+void pm_free(path_map_t* pm)
 {
-    fn->buf = calloc(1, 256);
-    fn->block_size = 256;
+    if (pm == NULL) {
+        return;
+    }
+    arena_free(&pm->names);
+    free(pm->buf);
+    free(pm);
 }
 
-void file_name_uninit(file_name_t* fn)
+char* pm_path(path_map_t* pm, path_map_entry_t* e)
 {
-    free(fn->buf);
+    return pm->names.buf + e->path;
 }
 
-char* file_name_cat(file_name_t* fn, char* s1, char* s2)
+path_map_entry_t* pm_slot(path_map_t* pm, char* path)
 {
-    uint64_t len = strlen(s1) + strlen(s2) + 3;
-    if (len >= fn->block_size) {
-        fn->block_size = len;
-        fn->buf = realloc(fn->buf, fn->block_size);
+    uint64_t i = hash_string(path) & (pm->allocated - 1);
+    while (pm->buf[i].path != 0 && strcmp(pm->names.buf + pm->buf[i].path, path) != 0) {
+        i = (i + 1) & (pm->allocated - 1);
     }
-    memset(fn->buf, 0, fn->block_size);
-    strcpy(fn->buf, s1);
-    strcat(fn->buf, "/");
-    strcat(fn->buf, s2);
-    return fn->buf;
+    return &pm->buf[i];
 }
 
-void push_all_files_in_directory(name_buf_t* file_buf, name_buf_t* dir_buf, char* dir_name)
+path_map_entry_t* pm_get(path_map_t* pm, char* path)
 {
-    DIR* dir = opendir(dir_name);
-    file_name_t fn;
-    file_name_init(&fn);
-    panic_if(dir == NULL, "could not open directory: %s: %s", dir_name, strerror(errno));
-    char* sub_dir;
-    bool dir_added = 0;
-    struct dirent* entry = NULL;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
-            continue;
-        }
-        if (entry->d_type == DT_DIR) {
-            sub_dir = file_name_cat(&fn, dir_name, entry->d_name);
-            push_all_files_in_directory(file_buf, dir_buf, sub_dir);
-            continue;
-        } else if (is_c_file(entry)) {
-            if (!dir_added) {
-                nb_push(dir_buf, dir_name);
-                dir_added = 1;
+    path_map_entry_t* e = pm_slot(pm, path);
+    return e->path == 0 ? NULL : e;
+}
+
+// returns the entry for path, new entries have the value 0
+path_map_entry_t* pm_put(path_map_t* pm, char* path)
+{
+    if ((pm->used + 1) * 2 > pm->allocated) {
+        path_map_entry_t* old = pm->buf;
+        uint64_t old_allocated = pm->allocated;
+        pm->allocated <<= 1;
+        pm->buf = calloc(pm->allocated, sizeof(*pm->buf));
+        panic_if(pm->buf == NULL, "could not realloc path map: %s", strerror(errno));
+        path_map_entry_t* e;
+        for (e = old; e != old + old_allocated; e++) {
+            if (e->path != 0) {
+                *pm_slot(pm, pm->names.buf + e->path) = *e;
             }
-            nb_push(file_buf, file_name_cat(&fn, dir_name, entry->d_name));
         }
+        free(old);
     }
-    file_name_uninit(&fn);
+    path_map_entry_t* e = pm_slot(pm, path);
+    if (e->path == 0) {
+        e->path = arena_push(&pm->names, path);
+        pm->used++;
+    }
+    return e;
 }
 
-void out_structure(char* main_dir, name_buf_t* dir_buf)
+// stats
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// --stats counts what every phase did and measures its wall and cpu time. The counters are bumped from the walk and extraction
+// threads, so they are atomics. Read and write syscalls and bytes come from /proc/self/io, the other syscalls are counted at
+// their call sites.
+
+typedef enum stat_counter_t stat_counter_t;
+enum stat_counter_t {
+    STAT_ENTRIES,
+    STAT_DIRS_CREATED,
+    STAT_FILES_COPIED,
+    STAT_FILES_UNCHANGED,
+    STAT_BYTES_COPIED,
+    STAT_OPEN,
+    STAT_STAT,
+    STAT_MKDIR,
+    STAT_UNLINK,
+    STAT_IGNORED,
+    STAT_COUNTERS,
+};
+
+char* stat_counter_names[STAT_COUNTERS] = { "entries_visited", "dirs_created", "files_copied", "files_unchanged", "bytes_copied",
+    "open_calls", "stat_calls", "mkdir_calls", "unlink_calls",
+    "entries_ignored" };
+
+atomic_uint_fast64_t stat_counters[STAT_COUNTERS];
+
+void stat_add(stat_counter_t counter, uint64_t n)
 {
-    mkdir(main_dir, S_IRWXU);
-    file_name_t fn;
-    file_name_init(&fn);
-    char** dir;
-    for (dir = dir_buf->buf; dir != dir_buf->buf + dir_buf->used; dir++) {
-        mkdir(file_name_cat(&fn, main_dir, *dir), S_IRWXU);
-    }
-    file_name_uninit(&fn);
+    atomic_fetch_add_explicit(&stat_counters[counter], n, memory_order_relaxed);
 }
 
-void copy_file(char* dest_name, char* src_name)
-{
-    int dest = open(dest_name, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    int src = open(src_name, O_RDONLY);
+#define IO_SYSCR 0
+#define IO_SYSCW 1
+#define IO_RCHAR 2
+#define IO_WCHAR 3
+#define IO_COUNTERS 4
 
-    uint64_t len;
-    struct stat st;
-    stat(src_name, &st);
-    len = st.st_size;
+char* io_counter_names[IO_COUNTERS] = { "read_syscalls", "write_syscalls", "bytes_read", "bytes_written" };
+
+typedef struct phase_t phase_t;
+struct phase_t {
+    char* name;
+    double wall; // seconds
+    double cpu;
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t io[IO_COUNTERS];
+};
 
-    sendfile(dest, src, 0, len);
+typedef struct stats_t stats_t;
+struct stats_t {
+    bool enabled;
+    bool json;
+    phase_t phases[16];
+    uint64_t n_phases;
+    uint64_t io_overhead[IO_COUNTERS]; // what reading /proc/self/io adds to the counters itself
+};
 
-    close(dest);
-    close(src);
+stats_t stats;
+
+// every other report goes to stderr when the statistics are printed as JSON, so that stdout stays parseable
+FILE* report_out(void)
+{
+    return stats.json ? stderr : stdout;
 }
 
-void out_files(char* out_dir, name_buf_t* file_buf)
+void read_io(uint64_t* io)
 {
-    char** src_file;
-    file_name_t fn;
-    file_name_init(&fn);
-    for (src_file = file_buf->buf; src_file != file_buf->buf + file_buf->used; src_file++) {
-        copy_file(file_name_cat(&fn, out_dir, *src_file), *src_file);
+    memset(io, 0, IO_COUNTERS * sizeof(*io));
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f == NULL) {
+        return;
     }
-
-    file_name_uninit(&fn);
+    char key[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "syscr") == 0) {
+            io[IO_SYSCR] = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            io[IO_SYSCW] = value;
+        } else if (strcmp(key, "rchar") == 0) {
+            io[IO_RCHAR] = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            io[IO_WCHAR] = value;
+        }
+    }
+    fclose(f);
 }
 
-char static_instructions[] = "#include <stdarg.h>\n"
-                             "#include <stdint.h>\n"
-                             "#include <stdio.h>\n"
-                             "#include <stdlib.h>\n"
-                             "#include <string.h>\n"
-                             "\n"
-                             "#define run_command(comp, ...) run_command_(comp, __VA_ARGS__, NULL);\n"
-                             "\n"
-                             "void run_command_(char* comp, ...)\n"
-                             "{\n"
-                             "    va_list ap;\n"
-                             "    va_start(ap, comp);\n"
-                             "    char* cmd = malloc(256);\n"
-                             "    uint64_t len = 256;\n"
-                             "    uint64_t new_len = strlen(comp);\n"
-                             "    strcpy(cmd, comp);\n"
-                             "    char* next_arg = NULL;\n"
-                             "\n"
-                             "    while ((next_arg = va_arg(ap, char*)) != NULL) {\n"
-                             "        new_len += strlen(next_arg) + 3;\n"
-                             "        if (new_len >= len) {\n"
-                             "            cmd = realloc(cmd, new_len << 1);\n"
-                             "            len = new_len << 1;\n"
-                             "        }\n"
-                             "        strcat(cmd, \" \");\n"
-                             "        strcat(cmd, next_arg);\n"
-                             "    }\n"
-                             "\n"
-                             "    system(cmd);\n"
-                             "    free(cmd);\n"
-                             "}\n"
-                             "\n"
-                             "int main(int argc, char** argv)\n"
-                             "{\n"
-                             "    if (argc != 2) {\n"
-                             "        fprintf(stderr, \"wrong number of argmuents\\n\");\n"
-                             "        exit(1);\n"
-                             "    }\n"
-                             "    char* compiler = argv[1];\n"
-                             "\n";
-
-void out_compile_instructions(char* out_dir, char* program_name, char* flags, name_buf_t* file_buf)
+double cpu_seconds(void)
 {
-    file_name_t fn;
-    file_name_init(&fn);
-    FILE* compile_file = fopen(file_name_cat(&fn, out_dir, "compile.c"), "w");
-    panic_if(compile_file == NULL, "could not open compile.c");
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
 
-    fprintf(compile_file, "%s", static_instructions);
+double wall_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    char** file;
-    uint64_t file_len;
-    for (file = file_buf->buf; file != file_buf->buf + file_buf->used; file++) {
-        file_len = strlen(*file);
-        if ((*file)[file_len - 1] == 'c') {
-            fprintf(compile_file, "printf(\"compiling: %s\\n\");\n", *file);
-            fprintf(compile_file, "run_command(compiler, \"-c\",\"%s\", \"%s\", ",flags, *file);
-            (*file)[file_len - 1] = 'o';
-            fprintf(compile_file, "\"-o %s\");\n\n", *file);
+// the phase keeps the start values until phase_end turns them into differences
+void phase_begin(char* name)
+{
+    if (!stats.enabled || stats.n_phases == sizeof(stats.phases) / sizeof(*stats.phases)) {
+        return;
+    }
+    if (stats.n_phases == 0) {
+        uint64_t a[IO_COUNTERS];
+        uint64_t b[IO_COUNTERS];
+        read_io(a);
+        read_io(b);
+        int i;
+        for (i = 0; i < IO_COUNTERS; i++) {
+            stats.io_overhead[i] = b[i] - a[i];
         }
     }
+    phase_t* p = &stats.phases[stats.n_phases];
+    p->name = name;
+    p->wall = wall_seconds();
+    p->cpu = cpu_seconds();
+    read_io(p->io);
+    int i;
+    for (i = 0; i < STAT_COUNTERS; i++) {
+        p->counters[i] = atomic_load(&stat_counters[i]);
+    }
+}
 
-    fprintf(compile_file, "run_command(compiler, \"-o %s\", \"%s\" ", program_name, flags);
+void phase_end(void)
+{
+    if (!stats.enabled || stats.n_phases == sizeof(stats.phases) / sizeof(*stats.phases)) {
+        return;
+    }
+    phase_t* p = &stats.phases[stats.n_phases++];
+    p->wall = wall_seconds() - p->wall;
+    p->cpu = cpu_seconds() - p->cpu;
+    uint64_t io[IO_COUNTERS];
+    read_io(io);
+    int i;
+    for (i = 0; i < IO_COUNTERS; i++) {
+        p->io[i] = io[i] - p->io[i] > stats.io_overhead[i] ? io[i] - p->io[i] - stats.io_overhead[i] : 0;
+    }
+    for (i = 0; i < STAT_COUNTERS; i++) {
+        p->counters[i] = atomic_load(&stat_counters[i]) - p->counters[i];
+    }
+}
 
-    for (file = file_buf->buf; file != file_buf->buf + file_buf->used; file++) {
-        file_len = strlen(*file);
-        if ((*file)[file_len - 1] == 'o') {
-            fprintf(compile_file, ", \"%s\"", *file);
+void stats_report(FILE* f)
+{
+    uint64_t i;
+    int c;
+    if (stats.json) {
+        fprintf(f, "{\n  \"phases\": [");
+    }
+    for (i = 0; i < stats.n_phases; i++) {
+        phase_t* p = &stats.phases[i];
+        if (stats.json) {
+            fprintf(f, "%s\n    { \"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f", i ? "," : "", p->name,
+                p->wall, p->cpu);
+            for (c = 0; c < STAT_COUNTERS; c++) {
+                fprintf(f, ", \"%s\": %llu", stat_counter_names[c], (unsigned long long)p->counters[c]);
+            }
+            for (c = 0; c < IO_COUNTERS; c++) {
+                fprintf(f, ", \"%s\": %llu", io_counter_names[c], (unsigned long long)p->io[c]);
+            }
+            fprintf(f, " }");
+            continue;
+        }
+        fprintf(f, "%-26s %9.3fs wall %9.3fs cpu\n", p->name, p->wall, p->cpu);
+        for (c = 0; c < STAT_COUNTERS; c++) {
+            if (p->counters[c] > 0) {
+                fprintf(f, "    %-22s %llu\n", stat_counter_names[c], (unsigned long long)p->counters[c]);
+            }
+        }
+        for (c = 0; c < IO_COUNTERS; c++) {
+            if (p->io[c] > 0) {
+                fprintf(f, "    %-22s %llu\n", io_counter_names[c], (unsigned long long)p->io[c]);
+            }
         }
     }
-    fprintf(compile_file, ");\nreturn 0;\n}\n");
+    if (stats.json) {
+        fprintf(f, "%s]\n}\n", stats.n_phases ? "\n  " : "");
+    }
+}
 
-    fclose(compile_file);
+// ignore rules
+//--------------------------------------------------------------------------------------------------------------------------------
 
-    file_name_uninit(&fn);
+// A .ppignore in any directory of the tree excludes entries below it, in the syntax of .gitignore: one glob per line, '#'
+// comments, '!' re-includes, a trailing '/' only matches directories, and a pattern with a '/' before its end is anchored to
+// the directory of the .ppignore while any other matches names at every depth. '*', '?' and "[...]" do not match '/', "**"
+// does. Every rule is compiled once into glob tokens, and the common shapes (a name, "*.ext", "prefix*") into a single
+// compare. The last matching rule decides, rules of deeper directories before those above. Excluded directories are skipped
+// before they are opened, so nothing below them is read.
+
+#define IGNORE_NAME ".ppignore"
+
+// "**/" at the start matches no or any number of leading directories, "/**/" one or more slashes with directories between
+// them, "/**" at the end everything below, "**" anywhere else any string
+enum { GLOB_LITERAL, GLOB_ONE, GLOB_CLASS, GLOB_STAR, GLOB_ANY, GLOB_LEADING_DIRS, GLOB_DIRS, GLOB_BELOW };
+
+typedef struct glob_token_t glob_token_t;
+struct glob_token_t {
+    uint8_t op;
+    uint32_t len; // of the literal
+    uint64_t lit; // offset in the names of the ignore_t
+    uint8_t class[32]; // bitmap of the bytes GLOB_CLASS accepts
+};
+
+enum { RULE_NAME, RULE_SUFFIX, RULE_PREFIX, RULE_GLOB };
+
+typedef struct ignore_rule_t ignore_rule_t;
+struct ignore_rule_t {
+    uint8_t kind;
+    bool negate;
+    bool dir_only;
+    bool anchored; // matched against the path below the directory of the .ppignore instead of the name
+    uint32_t len; // of the literal of RULE_NAME, RULE_SUFFIX and RULE_PREFIX
+    uint64_t lit;
+    glob_token_t* tokens; // RULE_GLOB
+    uint64_t n_tokens;
+};
+
+// the rules of one .ppignore, shared by every directory below it
+typedef struct ignore_t ignore_t;
+struct ignore_t {
+    ignore_t* parent; // the rules of the directories above
+    atomic_uint_fast64_t refs;
+    uint64_t base_len; // length of the path of its directory and the slash after it
+    bool needs_path; // a rule here or above is anchored
+    ignore_rule_t* rules;
+    uint64_t n_rules;
+    arena_t names;
+};
+
+void glob_push(ignore_rule_t* r, uint8_t op)
+{
+    r->tokens[r->n_tokens++] = (glob_token_t) { .op = op };
 }
 
-int main(int argc, char** argv)
+void glob_flush(ignore_t* ig, ignore_rule_t* r, char* lit, uint32_t* lit_len)
 {
-    // TODO: actual argument stuff
-    panic_if(argc != 4, "wrong number of arguments");
+    if (*lit_len > 0) {
+        glob_push(r, GLOB_LITERAL);
+        r->tokens[r->n_tokens - 1].len = *lit_len;
+        r->tokens[r->n_tokens - 1].lit = arena_push_len(&ig->names, lit, *lit_len);
+        *lit_len = 0;
+    }
+}
 
-    name_buf_t* file_buf = nb_create(16);
-    name_buf_t* dir_buf = nb_create(16);
+// parses the class starting at the '[' of p into t, returns the end of it, or NULL if it is not closed
+char* glob_class(char* p, glob_token_t* t)
+{
+    char* q = p + 1;
+    bool negate = *q == '!' || *q == '^';
+    q += negate;
+    memset(t->class, 0, sizeof(t->class));
+    bool first = 1;
+    for (; *q != 0 && (*q != ']' || first); first = 0) {
+        uint8_t lo = *q == '\\' && q[1] != 0 ? *++q : *q;
+        uint8_t hi = lo;
+        q++;
+        if (*q == '-' && q[1] != ']' && q[1] != 0) {
+            hi = q[1] == '\\' && q[2] != 0 ? q[2] : q[1];
+            q += q[1] == '\\' && q[2] != 0 ? 3 : 2;
+        }
+        unsigned c;
+        for (c = lo; c <= hi; c++) {
+            t->class[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    if (*q != ']') {
+        return NULL;
+    }
+    uint64_t i;
+    for (i = 0; negate && i < sizeof(t->class); i++) {
+        t->class[i] = ~t->class[i];
+    }
+    return q + 1;
+}
 
-    push_all_files_in_directory(file_buf, dir_buf, argv[1]);
+// compiles the glob p into r, with a single compare for a name, "*suffix" or "prefix*"
+void glob_compile(ignore_t* ig, ignore_rule_t* r, char* p)
+{
+    uint64_t n = strlen(p);
+    r->tokens = malloc((n + 1) * sizeof(*r->tokens));
+    char* lit = malloc(n + 1);
+    panic_if(r->tokens == NULL || lit == NULL, "could not allocate ignore rule: %s", strerror(errno));
+    uint32_t lit_len = 0;
+    char* start = p;
+    while (*p != 0) {
+        if (p[0] == '*' && p[1] == '*') {
+            bool after_slash = lit_len > 0 && lit[lit_len - 1] == '/';
+            if (p == start && p[2] == '/') {
+                glob_push(r, GLOB_LEADING_DIRS);
+                p += 3;
+            } else if (after_slash && (p[2] == '/' || p[2] == 0)) {
+                lit_len--;
+                glob_flush(ig, r, lit, &lit_len);
+                glob_push(r, p[2] == '/' ? GLOB_DIRS : GLOB_BELOW);
+                p += p[2] == '/' ? 3 : 2;
+            } else {
+                glob_flush(ig, r, lit, &lit_len);
+                glob_push(r, GLOB_ANY);
+                while (*p == '*') {
+                    p++;
+                }
+            }
+        } else if (*p == '*' || *p == '?') {
+            glob_flush(ig, r, lit, &lit_len);
+            glob_push(r, *p == '*' ? GLOB_STAR : GLOB_ONE);
+            p++;
+        } else if (*p == '[' && glob_class(p, &r->tokens[r->n_tokens]) != NULL) {
+            glob_flush(ig, r, lit, &lit_len);
+            p = glob_class(p, &r->tokens[r->n_tokens]);
+            r->tokens[r->n_tokens++].op = GLOB_CLASS;
+        } else {
+            p += *p == '\\' && p[1] != 0;
+            lit[lit_len++] = *p++;
+        }
+    }
+    glob_flush(ig, r, lit, &lit_len);
+    free(lit);
 
-    char* out = "package";
-    out_structure(out, dir_buf);
-    out_files(out, file_buf);
+    glob_token_t* t = r->tokens;
+    r->kind = RULE_GLOB;
+    if (r->n_tokens == 1 && t[0].op == GLOB_LITERAL) {
+        r->kind = RULE_NAME;
+    } else if (!r->anchored && r->n_tokens == 2 && t[0].op == GLOB_STAR && t[1].op == GLOB_LITERAL) {
+        r->kind = RULE_SUFFIX;
+        t++;
+    } else if (!r->anchored && r->n_tokens == 2 && t[0].op == GLOB_LITERAL && t[1].op == GLOB_STAR) {
+        r->kind = RULE_PREFIX;
+    }
+    if (r->kind != RULE_GLOB) {
+        r->len = t->len;
+        r->lit = t->lit;
+        free(r->tokens);
+        r->tokens = NULL;
+        r->n_tokens = 0;
+    }
+}
 
-    out_compile_instructions(out, argv[2], argv[3], file_buf);
+bool glob_match(glob_token_t* t, glob_token_t* end, char* names, char* s)
+{
+    for (; t != end; t++) {
+        switch (t->op) {
+        case GLOB_LITERAL:
+            if (strncmp(s, names + t->lit, t->len) != 0) {
+                return 0;
+            }
+            s += t->len;
+            break;
+        case GLOB_ONE:
+        case GLOB_CLASS:
+            if (*s == 0 || *s == '/' || (t->op == GLOB_CLASS && !(t->class[(uint8_t)*s >> 3] & 1 << (*s & 7)))) {
+                return 0;
+            }
+            s++;
+            break;
+        case GLOB_STAR:
+        case GLOB_ANY:
+            for (;; s++) {
+                if (glob_match(t + 1, end, names, s)) {
+                    return 1;
+                }
+                if (*s == 0 || (*s == '/' && t->op == GLOB_STAR)) {
+                    return 0;
+                }
+            }
+        case GLOB_DIRS:
+        case GLOB_LEADING_DIRS:
+            if (t->op == GLOB_DIRS && *s++ != '/') {
+                return 0;
+            }
+            for (;;) {
+                if (glob_match(t + 1, end, names, s)) {
+                    return 1;
+                }
+                s = strchr(s, '/');
+                if (s == NULL) {
+                    return 0;
+                }
+                s++;
+            }
+        case GLOB_BELOW:
+            return *s == '/' && s[1] != 0;
+        }
+    }
+    return *s == 0;
+}
+
+bool rule_match(ignore_t* ig, ignore_rule_t* r, char* s, uint64_t len)
+{
+    char* lit = ig->names.buf + r->lit;
+    switch (r->kind) {
+    case RULE_NAME:
+        return len == r->len && memcmp(s, lit, len) == 0;
+    case RULE_SUFFIX:
+        return len >= r->len && memcmp(s + len - r->len, lit, r->len) == 0;
+    case RULE_PREFIX:
+        return len >= r->len && memcmp(s, lit, r->len) == 0;
+    }
+    return glob_match(r->tokens, r->tokens + r->n_tokens, ig->names.buf, s);
+}
+
+// adds the rule on line, if it holds one
+void ignore_add_rule(ignore_t* ig, char* line)
+{
+    uint64_t n = strlen(line);
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+        n--;
+    }
+    while (n > 0 && line[n - 1] == ' ' && (n < 2 || line[n - 2] != '\\')) {
+        n--;
+    }
+    line[n] = 0;
+    if (n == 0 || line[0] == '#') {
+        return;
+    }
+    ignore_rule_t r = { 0 };
+    char* p = line;
+    r.negate = *p == '!';
+    p += r.negate;
+    n = strlen(p);
+    if (n > 0 && p[n - 1] == '/') {
+        r.dir_only = 1;
+        p[--n] = 0;
+    }
+    r.anchored = strchr(p, '/') != NULL;
+    p += *p == '/';
+    if (strncmp(p, "**/", 3) == 0 && strchr(p + 3, '/') == NULL) {
+        p += 3;
+        r.anchored = 0;
+    }
+    if (*p == 0) {
+        return;
+    }
+    glob_compile(ig, &r, p);
+    if ((ig->n_rules & (ig->n_rules - 1)) == 0) {
+        ig->rules = realloc(ig->rules, (ig->n_rules ? ig->n_rules << 1 : 8) * sizeof(*ig->rules));
+        panic_if(ig->rules == NULL, "could not allocate ignore rules: %s", strerror(errno));
+    }
+    ig->rules[ig->n_rules++] = r;
+    ig->needs_path |= r.anchored;
+}
+
+ignore_t* ignore_ref(ignore_t* ig)
+{
+    if (ig != NULL) {
+        atomic_fetch_add(&ig->refs, 1);
+    }
+    return ig;
+}
+
+void ignore_unref(ignore_t* ig)
+{
+    while (ig != NULL && atomic_fetch_sub(&ig->refs, 1) == 1) {
+        ignore_t* parent = ig->parent;
+        uint64_t i;
+        for (i = 0; i < ig->n_rules; i++) {
+            free(ig->rules[i].tokens);
+        }
+        free(ig->rules);
+        arena_free(&ig->names);
+        free(ig);
+        ig = parent;
+    }
+}
+
+// The rules for the entries of the directory open as dir_fd, whose path is dir_len long: those of its .ppignore, if it has
+// one, on top of parent. Returns a reference, name is for errors.
+ignore_t* ignore_enter(int dir_fd, ignore_t* parent, uint64_t dir_len, char* name)
+{
+    int fd = openat(dir_fd, IGNORE_NAME, O_RDONLY | O_CLOEXEC);
+    stat_add(STAT_OPEN, 1);
+    if (fd < 0) {
+        panic_if(errno != ENOENT, "could not open %s in %s: %s", IGNORE_NAME, name, strerror(errno));
+        return ignore_ref(parent);
+    }
+    FILE* f = fdopen(fd, "r");
+    panic_if(f == NULL, "could not open %s in %s: %s", IGNORE_NAME, name, strerror(errno));
+    ignore_t* ig = calloc(1, sizeof(*ig));
+    panic_if(ig == NULL, "could not allocate ignore rules: %s", strerror(errno));
+    char* line = NULL;
+    size_t line_len = 0;
+    while (getline(&line, &line_len, f) > 0) {
+        ignore_add_rule(ig, line);
+    }
+    free(line);
+    fclose(f);
+    if (ig->n_rules == 0) {
+        free(ig->rules);
+        arena_free(&ig->names);
+        free(ig);
+        return ignore_ref(parent);
+    }
+    atomic_init(&ig->refs, 1);
+    ig->parent = ignore_ref(parent);
+    ig->base_len = dir_len + 1;
+    ig->needs_path |= parent != NULL && parent->needs_path;
+    return ig;
+}
+
+// true if the rules of ig exclude the entry name of the directory with path dir, which is only read if ig->needs_path
+bool ignored(ignore_t* ig, char* dir, char* name, bool is_dir, file_name_t* fn)
+{
+    if (ig == NULL) {
+        return 0;
+    }
+    uint64_t name_len = strlen(name);
+    char* path = ig->needs_path ? file_name_cat(fn, dir, name) : NULL;
+    uint64_t path_len = path != NULL ? strlen(path) : 0;
+    for (; ig != NULL; ig = ig->parent) {
+        ignore_rule_t* r;
+        for (r = ig->rules + ig->n_rules; r != ig->rules; r--) {
+            if (r[-1].dir_only && !is_dir) {
+                continue;
+            }
+            bool match = r[-1].anchored ? rule_match(ig, &r[-1], path + ig->base_len, path_len - ig->base_len)
+                                        : rule_match(ig, &r[-1], name, name_len);
+            if (match) {
+                stat_add(STAT_IGNORED, !r[-1].negate);
+                return !r[-1].negate;
+            }
+        }
+    }
+    return 0;
+}
+
+// file_t
+//--------------------------------------------------------------------------------------------------------------------------------
+
+bool is_c_name(char* name)
+{
+    uint64_t len = strlen(name);
+    if (len < 2 || name[len - 2] != '.') {
+        return 0;
+    }
+    if (name[len - 1] != 'c' && name[len - 1] != 'h') {
+        return 0;
+    }
+    return 1;
+}
+
+bool is_c_file(struct dirent* entry)
+{
+    return is_c_name(entry->d_name);
+}
+
+// filesystems that do not fill in d_type report DT_UNKNOWN, those entries are looked up relative to their directory
+bool entry_is_dir(int dir_fd, struct dirent* entry)
+{
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type == DT_DIR;
+    }
+    struct stat st;
+    stat_add(STAT_STAT, 1);
+    return fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// --pipeline creates every directory and hands every file to the copy workers as soon as the walk finds it
+typedef struct pipeline_t pipeline_t;
+void pipeline_dir(pipeline_t* pipe, name_buf_t* dir_buf, uint64_t dir);
+void pipeline_push(pipeline_t* pipe, name_buf_t* file_buf, uint64_t file);
+
+// opens the directory dir_path of the path table, relative to parent_fd when that is open
+int open_dir_at(path_table_t* pt, int parent_fd, uint32_t dir_path)
+{
+    int fd;
+    if (parent_fd < 0) {
+        file_name_t fn;
+        file_name_init(&fn);
+        fd = open(pt_path(pt, NULL, dir_path, &fn), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        file_name_uninit(&fn);
+    } else {
+        fd = openat(parent_fd, pt_name(pt, dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        int err = errno;
+        file_name_t fn;
+        file_name_init(&fn);
+        panic("could not open directory: %s: %s", pt_path(pt, NULL, dir_path, &fn), strerror(err));
+    }
+    stat_add(STAT_OPEN, 1);
+    return fd;
+}
+
+// walks the directory open as fd, whose path is dir_len long, subdirectories are opened relative to it
+void push_all_files_at(name_buf_t* file_buf, name_buf_t* dir_buf, int fd, uint32_t dir_path, uint64_t dir_len,
+    ignore_t* parent_ignore, pipeline_t* pipe)
+{
+    path_table_t* pt = file_buf->table;
+    DIR* dir = fdopendir(fd);
+    panic_if(dir == NULL, "could not open directory: %s: %s", pt_name(pt, dir_path), strerror(errno));
+    ignore_t* ig = ignore_enter(fd, parent_ignore, dir_len, pt_name(pt, dir_path));
+    file_name_t dir_name = { 0 }; // only allocated if a rule needs paths
+    file_name_t fn = { 0 };
+    char* dir_str = NULL;
+    if (ig != NULL && ig->needs_path) {
+        file_name_init(&dir_name);
+        file_name_init(&fn);
+        dir_str = pt_path(pt, NULL, dir_path, &dir_name);
+    }
+    bool dir_added = 0;
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+            continue;
+        }
+        stat_add(STAT_ENTRIES, 1);
+        if (entry_is_dir(fd, entry)) {
+            if (ignored(ig, dir_str, entry->d_name, 1, &fn)) {
+                continue;
+            }
+            uint32_t sub = pt_add(pt, dir_path, entry->d_name);
+            push_all_files_at(file_buf, dir_buf, open_dir_at(pt, fd, sub), sub, dir_len + 1 + strlen(entry->d_name), ig, pipe);
+            continue;
+        } else if (is_c_file(entry) && !ignored(ig, dir_str, entry->d_name, 0, &fn)) {
+            if (!dir_added) {
+                nb_push(dir_buf, dir_path);
+                dir_added = 1;
+                if (pipe != NULL) {
+                    pipeline_dir(pipe, dir_buf, dir_buf->used - 1);
+                }
+            }
+            nb_push(file_buf, pt_add(pt, dir_path, entry->d_name));
+            if (pipe != NULL) {
+                pipeline_push(pipe, file_buf, file_buf->used - 1);
+            }
+        }
+    }
+    closedir(dir);
+    ignore_unref(ig);
+    file_name_uninit(&dir_name);
+    file_name_uninit(&fn);
+}
+
+void push_all_files_in_directory(name_buf_t* file_buf, name_buf_t* dir_buf, uint32_t dir_path, pipeline_t* pipe)
+{
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t dir_len = strlen(pt_path(file_buf->table, NULL, dir_path, &fn));
+    file_name_uninit(&fn);
+    push_all_files_at(file_buf, dir_buf, open_dir_at(file_buf->table, -1, dir_path), dir_path, dir_len, NULL, pipe);
+}
+
+// parallel walk
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Every directory becomes a walk_node_t that records its entries in readdir order. Nodes are spread over the worker threads
+// with work stealing and merged depth first afterwards, so file_buf and dir_buf end up exactly as the serial walk leaves them.
+
+typedef struct walk_node_t walk_node_t;
+typedef struct walk_item_t walk_item_t;
+
+struct walk_item_t {
+    walk_node_t* dir; // NULL for files
+    uint64_t name; // offset in names of the owning node
+};
+
+struct walk_node_t {
+    walk_node_t* parent;
+    int fd; // opened relative to the parent, -1 if the fd budget was exhausted
+    ignore_t* ignore; // the rules of the directories above, a reference
+    uint64_t path_len;
+    walk_item_t* items;
+    uint64_t used;
+    uint64_t allocated;
+    arena_t names;
+    char name[];
+};
+
+typedef struct walk_deque_t walk_deque_t;
+struct walk_deque_t {
+    pthread_mutex_t lock;
+    walk_node_t** buf;
+    uint64_t top; // thieves take from here
+    uint64_t bottom; // the owner pushes and pops here
+    uint64_t allocated;
+};
+
+typedef struct walker_t walker_t;
+struct walker_t {
+    walk_deque_t* deques;
+    uint64_t n_threads;
+    atomic_uint_fast64_t pending;
+    atomic_uint_fast64_t queued; // nodes in the deques
+    atomic_uint_fast64_t idle; // threads parked on idle_cond until work is queued or the walk is done
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_int_fast64_t fd_budget;
+};
+
+typedef struct walk_worker_t walk_worker_t;
+struct walk_worker_t {
+    walker_t* walker;
+    uint64_t id;
+};
+
+walk_node_t* walk_node_create(walk_node_t* parent, char* name, int fd, ignore_t* ignore)
+{
+    walk_node_t* node = calloc(1, sizeof(*node) + strlen(name) + 1);
+    panic_if(node == NULL, "could not allocate walk node: %s", strerror(errno));
+    strcpy(node->name, name);
+    node->parent = parent;
+    node->fd = fd;
+    node->ignore = ignore_ref(ignore);
+    node->path_len = parent == NULL ? strlen(name) : parent->path_len + 1 + strlen(name);
+    return node;
+}
+
+void walk_node_push(walk_node_t* node, walk_node_t* dir, char* name)
+{
+    if (node->used >= node->allocated) {
+        node->allocated = node->allocated ? node->allocated << 1 : 8;
+        node->items = realloc(node->items, node->allocated * sizeof(*node->items));
+        panic_if(node->items == NULL, "could not realloc walk node: %s", strerror(errno));
+    }
+    node->items[node->used].dir = dir;
+    node->items[node->used++].name = name == NULL ? 0 : arena_push(&node->names, name);
+}
+
+// written back to front from path_len, so every name is copied once
+char* walk_node_path(walk_node_t* node, file_name_t* fn)
+{
+    file_name_reserve(fn, node->path_len + 1);
+    fn->buf[node->path_len] = 0;
+    uint64_t end = node->path_len;
+    for (; node != NULL; node = node->parent) {
+        uint64_t len = strlen(node->name);
+        end -= len;
+        memcpy(fn->buf + end, node->name, len);
+        if (end > 0) {
+            fn->buf[--end] = '/';
+        }
+    }
+    return fn->buf;
+}
+
+void walk_deque_push(walk_deque_t* dq, walk_node_t* node)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom >= dq->allocated) {
+        if (dq->top > 0) {
+            memmove(dq->buf, dq->buf + dq->top, (dq->bottom - dq->top) * sizeof(*dq->buf));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        } else {
+            dq->allocated <<= 1;
+            dq->buf = realloc(dq->buf, dq->allocated * sizeof(*dq->buf));
+            panic_if(dq->buf == NULL, "could not realloc walk deque: %s", strerror(errno));
+        }
+    }
+    dq->buf[dq->bottom++] = node;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+walk_node_t* walk_deque_pop(walk_deque_t* dq)
+{
+    walk_node_t* node = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        node = dq->buf[--dq->bottom];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return node;
+}
+
+walk_node_t* walk_deque_steal(walk_deque_t* dq)
+{
+    walk_node_t* node = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        node = dq->buf[dq->top++];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return node;
+}
+
+int walk_open_subdir(walker_t* w, int parent_fd, char* name)
+{
+    if (atomic_fetch_sub(&w->fd_budget, 1) <= 0) {
+        atomic_fetch_add(&w->fd_budget, 1);
+        return -1;
+    }
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stat_add(STAT_OPEN, 1);
+    if (fd < 0) {
+        atomic_fetch_add(&w->fd_budget, 1);
+    }
+    return fd;
+}
+
+void walk_wake(walker_t* w, bool all)
+{
+    pthread_mutex_lock(&w->idle_lock);
+    if (all) {
+        pthread_cond_broadcast(&w->idle_cond);
+    } else {
+        pthread_cond_signal(&w->idle_cond);
+    }
+    pthread_mutex_unlock(&w->idle_lock);
+}
+
+// parks the thread until a node is queued or the walk is done, idle threads take no cpu while one waits on getdents
+void walk_wait(walker_t* w)
+{
+    pthread_mutex_lock(&w->idle_lock);
+    atomic_fetch_add(&w->idle, 1);
+    while (atomic_load(&w->pending) > 0 && atomic_load(&w->queued) == 0) {
+        pthread_cond_wait(&w->idle_cond, &w->idle_lock);
+    }
+    atomic_fetch_sub(&w->idle, 1);
+    pthread_mutex_unlock(&w->idle_lock);
+}
+
+void walk_directory(walker_t* w, walk_deque_t* own, walk_node_t* node)
+{
+    int fd = node->fd;
+    if (fd < 0) {
+        file_name_t fn;
+        file_name_init(&fn);
+        fd = open(walk_node_path(node, &fn), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        panic_if(fd < 0, "could not open directory: %s: %s", fn.buf, strerror(errno));
+        stat_add(STAT_OPEN, 1);
+        file_name_uninit(&fn);
+        atomic_fetch_sub(&w->fd_budget, 1);
+    }
+    DIR* dir = fdopendir(fd);
+    panic_if(dir == NULL, "could not open directory: %s: %s", node->name, strerror(errno));
+    ignore_t* ig = ignore_enter(fd, node->ignore, node->path_len, node->name);
+    ignore_unref(node->ignore);
+    node->ignore = NULL;
+    file_name_t dir_name = { 0 }; // only allocated if a rule needs paths
+    file_name_t fn = { 0 };
+    char* dir_str = NULL;
+    if (ig != NULL && ig->needs_path) {
+        file_name_init(&dir_name);
+        file_name_init(&fn);
+        dir_str = walk_node_path(node, &dir_name);
+    }
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+            continue;
+        }
+        stat_add(STAT_ENTRIES, 1);
+        if (entry_is_dir(fd, entry)) {
+            if (ignored(ig, dir_str, entry->d_name, 1, &fn)) {
+                continue;
+            }
+            walk_node_t* sub = walk_node_create(node, entry->d_name, walk_open_subdir(w, fd, entry->d_name), ig);
+            walk_node_push(node, sub, NULL);
+            atomic_fetch_add(&w->pending, 1);
+            walk_deque_push(own, sub);
+            atomic_fetch_add(&w->queued, 1);
+            if (atomic_load(&w->idle) > 0) {
+                walk_wake(w, 0);
+            }
+        } else if (is_c_file(entry) && !ignored(ig, dir_str, entry->d_name, 0, &fn)) {
+            walk_node_push(node, NULL, entry->d_name);
+        }
+    }
+    closedir(dir);
+    ignore_unref(ig);
+    file_name_uninit(&dir_name);
+    file_name_uninit(&fn);
+    atomic_fetch_add(&w->fd_budget, 1);
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        walk_wake(w, 1);
+    }
+}
+
+void* walk_worker(void* arg)
+{
+    walk_worker_t* worker = arg;
+    walker_t* w = worker->walker;
+    walk_deque_t* own = &w->deques[worker->id];
+    uint64_t i;
+    while (atomic_load(&w->pending) > 0) {
+        walk_node_t* node = walk_deque_pop(own);
+        for (i = 1; node == NULL && i < w->n_threads; i++) {
+            node = walk_deque_steal(&w->deques[(worker->id + i) % w->n_threads]);
+        }
+        if (node == NULL) {
+            walk_wait(w);
+            continue;
+        }
+        atomic_fetch_sub(&w->queued, 1);
+        walk_directory(w, own, node);
+    }
+    return NULL;
+}
+
+void walk_merge(walk_node_t* node, uint32_t dir_path, name_buf_t* file_buf, name_buf_t* dir_buf)
+{
+    path_table_t* pt = file_buf->table;
+    bool dir_added = 0;
+    walk_item_t* item;
+    for (item = node->items; item != node->items + node->used; item++) {
+        if (item->dir != NULL) {
+            walk_merge(item->dir, pt_add(pt, dir_path, item->dir->name), file_buf, dir_buf);
+            continue;
+        }
+        if (!dir_added) {
+            nb_push(dir_buf, dir_path);
+            dir_added = 1;
+        }
+        nb_push(file_buf, pt_add(pt, dir_path, node->names.buf + item->name));
+    }
+    arena_free(&node->names);
+    free(node->items);
+    free(node);
+}
+
+void push_all_files_in_directory_parallel(name_buf_t* file_buf, name_buf_t* dir_buf, uint32_t dir_path, uint64_t n_threads)
+{
+    char* dir_name = pt_name(file_buf->table, dir_path);
+    int fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    panic_if(fd < 0, "could not open directory: %s: %s", dir_name, strerror(errno));
+    stat_add(STAT_OPEN, 1);
+    walk_node_t* root = walk_node_create(NULL, dir_name, fd, NULL);
+
+    struct rlimit rl;
+    int64_t budget = 256;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        budget = rl.rlim_cur / 2;
+    }
+
+    walker_t w;
+    w.n_threads = n_threads;
+    atomic_init(&w.pending, 1);
+    atomic_init(&w.queued, 1);
+    atomic_init(&w.idle, 0);
+    atomic_init(&w.fd_budget, budget - 1);
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.idle_cond, NULL);
+    w.deques = calloc(n_threads, sizeof(*w.deques));
+    walk_worker_t* workers = malloc(n_threads * sizeof(*workers));
+    pthread_t* threads = malloc(n_threads * sizeof(*threads));
+    panic_if(w.deques == NULL || workers == NULL || threads == NULL, "could not allocate walker: %s", strerror(errno));
+
+    uint64_t i;
+    for (i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+        w.deques[i].allocated = 64;
+        w.deques[i].buf = malloc(w.deques[i].allocated * sizeof(*w.deques[i].buf));
+        panic_if(w.deques[i].buf == NULL, "could not allocate walk deque: %s", strerror(errno));
+    }
+    walk_deque_push(&w.deques[0], root);
+
+    for (i = 0; i < n_threads; i++) {
+        workers[i].walker = &w;
+        workers[i].id = i;
+        panic_if(pthread_create(&threads[i], NULL, walk_worker, &workers[i]) != 0, "could not start walk thread");
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    walk_merge(root, dir_path, file_buf, dir_buf);
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].buf);
+    }
+    pthread_mutex_destroy(&w.idle_lock);
+    pthread_cond_destroy(&w.idle_cond);
+    free(w.deques);
+    free(workers);
+    free(threads);
+}
+
+// include graph
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// splits s at whitespace into a malloced NULL terminated array, quotes group words like in sh
+char** split_args(char* s)
+{
+    uint64_t n = 0;
+    uint64_t allocated = 8;
+    char** args = malloc(allocated * sizeof(*args));
+    panic_if(args == NULL, "could not allocate arguments: %s", strerror(errno));
+    while (*s) {
+        while (*s == ' ' || *s == '\t' || *s == '\n') {
+            s++;
+        }
+        if (*s == 0) {
+            break;
+        }
+        char* arg = malloc(strlen(s) + 1);
+        panic_if(arg == NULL, "could not allocate arguments: %s", strerror(errno));
+        char* a = arg;
+        char quote = 0;
+        for (; *s && (quote || (*s != ' ' && *s != '\t' && *s != '\n')); s++) {
+            if (*s == quote) {
+                quote = 0;
+            } else if (!quote && (*s == '\'' || *s == '"')) {
+                quote = *s;
+            } else {
+                *a++ = *s;
+            }
+        }
+        *a = 0;
+        if (n + 2 > allocated) {
+            allocated <<= 1;
+            args = realloc(args, allocated * sizeof(*args));
+            panic_if(args == NULL, "could not allocate arguments: %s", strerror(errno));
+        }
+        args[n++] = arg;
+    }
+    args[n] = NULL;
+    return args;
+}
+
+void free_args(char** args)
+{
+    char** arg;
+    for (arg = args; *arg != NULL; arg++) {
+        free(*arg);
+    }
+    free(args);
+}
+
+// joins dir and name (dir may be NULL or empty) and collapses "." and ".." components, "./a/../b.h" becomes "b.h"
+char* normalize_path(char* dir, char* name, file_name_t* fn)
+{
+    bool join = dir != NULL && dir[0] != 0 && name[0] != '/';
+    char* in;
+    panic_if(asprintf(&in, "%s%s%s", join ? dir : "", join ? "/" : "", name) < 0, "could not allocate path");
+    uint64_t len = strlen(in);
+    file_name_reserve(fn, len + 2);
+    uint64_t* parts = malloc((len / 2 + 2) * sizeof(*parts)); // start of every component written to out
+    panic_if(parts == NULL, "could not allocate path: %s", strerror(errno));
+    uint64_t n_parts = 0;
+
+    char* out = fn->buf;
+    uint64_t o = 0;
+    out[0] = 0;
+    bool absolute = in[0] == '/';
+    char* p = in;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        uint64_t n = strcspn(p, "/");
+        if (n == 0 || (n == 1 && p[0] == '.')) {
+            p += n;
+            continue;
+        }
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            if (n_parts > 0 && strcmp(out + parts[n_parts - 1], "..") != 0) {
+                o = parts[--n_parts];
+                if (o > (absolute ? 1 : 0)) {
+                    o--;
+                }
+                out[o] = 0;
+                p += n;
+                continue;
+            }
+            if (absolute) {
+                p += n;
+                continue;
+            }
+        }
+        if (o == 0 ? absolute : out[o - 1] != '/') {
+            out[o++] = '/';
+        }
+        parts[n_parts++] = o;
+        memcpy(out + o, p, n);
+        o += n;
+        out[o] = 0;
+        p += n;
+    }
+    if (o == 0 && absolute) {
+        out[o++] = '/';
+    }
+    out[o] = 0;
+    free(parts);
+    free(in);
+    return out;
+}
+
+// directory part of a normalized path, "" for a file in the current directory
+char* dir_of(char* path, file_name_t* fn)
+{
+    char* slash = strrchr(path, '/');
+    uint64_t len = slash == NULL ? 0 : (uint64_t)(slash - path);
+    file_name_reserve(fn, len + 1);
+    memmove(fn->buf, path, len);
+    fn->buf[len] = 0;
+    return fn->buf;
+}
+
+// Edges from every packaged file to the packaged files it includes, stored as one array with per file start offsets.
+typedef struct include_graph_t include_graph_t;
+struct include_graph_t {
+    path_map_t* files; // normalized path to index in file_buf
+    uint64_t* start; // the includes of file i are edges[start[i]] .. edges[start[i + 1]]
+    uint64_t* edges;
+    uint64_t n_edges;
+    uint64_t allocated;
+};
+
+typedef struct include_scan_t include_scan_t;
+struct include_scan_t {
+    include_graph_t* graph;
+    char** include_dirs;
+    char* dir; // directory of the including file
+    file_name_t fn;
+};
+
+void include_graph_add(include_scan_t* scan, char* name, bool quoted)
+{
+    include_graph_t* g = scan->graph;
+    path_map_entry_t* e = NULL;
+    if (quoted) {
+        e = pm_get(g->files, normalize_path(scan->dir, name, &scan->fn));
+    }
+    char** dir;
+    for (dir = scan->include_dirs; e == NULL && *dir != NULL; dir++) {
+        e = pm_get(g->files, normalize_path(*dir, name, &scan->fn));
+    }
+    if (e == NULL) {
+        return;
+    }
+    if (g->n_edges >= g->allocated) {
+        g->allocated = g->allocated ? g->allocated << 1 : 64;
+        g->edges = realloc(g->edges, g->allocated * sizeof(*g->edges));
+        panic_if(g->edges == NULL, "could not realloc include graph: %s", strerror(errno));
+    }
+    g->edges[g->n_edges++] = e->value;
+}
+
+// feeds every #include "name" and #include <name> directive of the file to include_graph_add
+void scan_includes(include_scan_t* scan, char* name)
+{
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    panic_if(fd < 0, "could not open %s: %s", name, strerror(errno));
+    struct stat st;
+    panic_if(fstat(fd, &st) < 0, "could not stat %s: %s", name, strerror(errno));
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    panic_if(data == MAP_FAILED, "could not map %s: %s", name, strerror(errno));
+    close(fd);
+
+    char* end = data + st.st_size;
+    char* p = data;
+    file_name_t inc;
+    file_name_init(&inc);
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p == '#') {
+            p++;
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (end - p > 7 && memcmp(p, "include", 7) == 0) {
+                p += 7;
+                while (p < end && (*p == ' ' || *p == '\t')) {
+                    p++;
+                }
+                if (p < end && (*p == '"' || *p == '<')) {
+                    char close_quote = *p == '"' ? '"' : '>';
+                    char* start = ++p;
+                    while (p < end && *p != close_quote && *p != '\n') {
+                        p++;
+                    }
+                    if (p < end && *p == close_quote) {
+                        file_name_reserve(&inc, p - start + 1);
+                        memcpy(inc.buf, start, p - start);
+                        inc.buf[p - start] = 0;
+                        include_graph_add(scan, inc.buf, close_quote == '"');
+                    }
+                }
+            }
+        }
+        while (p < end && *p != '\n') {
+            p++;
+        }
+        p++;
+    }
+    file_name_uninit(&inc);
+    munmap(data, st.st_size);
+}
+
+// the -I and -iquote directories of flags
+char** include_dirs_of(char* flags)
+{
+    char** args = split_args(flags);
+    char** dirs = calloc(1, sizeof(*dirs));
+    uint64_t n = 0;
+    char** arg;
+    for (arg = args; *arg != NULL; arg++) {
+        char* dir = NULL;
+        if (strcmp(*arg, "-I") == 0 || strcmp(*arg, "-iquote") == 0) {
+            dir = arg[1];
+        } else if (strncmp(*arg, "-I", 2) == 0) {
+            dir = *arg + 2;
+        }
+        if (dir != NULL) {
+            dirs = realloc(dirs, (n + 2) * sizeof(*dirs));
+            panic_if(dirs == NULL, "could not allocate include dirs: %s", strerror(errno));
+            dirs[n++] = strdup(dir);
+            dirs[n] = NULL;
+        }
+    }
+    free_args(args);
+    return dirs;
+}
+
+void include_graph_build(include_graph_t* g, name_buf_t* file_buf, char* flags)
+{
+    memset(g, 0, sizeof(*g));
+    g->files = pm_create(file_buf->used);
+    g->start = malloc((file_buf->used + 1) * sizeof(*g->start));
+    panic_if(g->start == NULL, "could not allocate include graph: %s", strerror(errno));
+    file_name_t fn;
+    file_name_t norm;
+    file_name_init(&fn);
+    file_name_init(&norm);
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        pm_put(g->files, normalize_path(NULL, nb_path(file_buf, NULL, i, &fn), &norm))->value = i;
+    }
+
+    include_scan_t scan;
+    scan.graph = g;
+    scan.include_dirs = include_dirs_of(flags);
+    file_name_init(&scan.fn);
+    for (i = 0; i < file_buf->used; i++) {
+        g->start[i] = g->n_edges;
+        char* path = nb_path(file_buf, NULL, i, &fn);
+        scan.dir = dir_of(normalize_path(NULL, path, &norm), &norm);
+        scan_includes(&scan, path);
+    }
+    g->start[file_buf->used] = g->n_edges;
+    file_name_uninit(&scan.fn);
+    free_args(scan.include_dirs);
+    file_name_uninit(&fn);
+    file_name_uninit(&norm);
+}
+
+void include_graph_free(include_graph_t* g)
+{
+    pm_free(g->files);
+    free(g->start);
+    free(g->edges);
+}
+
+// Keeps only the files reachable from the entry translation units through #include. A reached header also pulls in the
+// source of the same name next to it (util.h brings util.c), which is where its definitions usually live.
+void prune_unreachable(name_buf_t* file_buf, name_buf_t* dir_buf, char** entries, uint64_t n_entries, char* flags)
+{
+    include_graph_t g;
+    include_graph_build(&g, file_buf, flags);
+
+    bool* reached = calloc(file_buf->used + 1, sizeof(*reached));
+    uint64_t* stack = malloc((file_buf->used + 1) * sizeof(*stack));
+    panic_if(reached == NULL || stack == NULL, "could not allocate include graph: %s", strerror(errno));
+    uint64_t n_stack = 0;
+    file_name_t fn;
+    file_name_t norm;
+    file_name_init(&fn);
+    file_name_init(&norm);
+    uint64_t i;
+    for (i = 0; i < n_entries; i++) {
+        path_map_entry_t* e = pm_get(g.files, normalize_path(NULL, entries[i], &fn));
+        panic_if(e == NULL, "entry %s is not a packaged file", entries[i]);
+        if (!reached[e->value]) {
+            reached[e->value] = 1;
+            stack[n_stack++] = e->value;
+        }
+    }
+    while (n_stack > 0) {
+        uint64_t file = stack[--n_stack];
+        uint64_t* edge;
+        for (edge = g.edges + g.start[file]; edge != g.edges + g.start[file + 1]; edge++) {
+            if (!reached[*edge]) {
+                reached[*edge] = 1;
+                stack[n_stack++] = *edge;
+            }
+        }
+        char* path = normalize_path(NULL, nb_path(file_buf, NULL, file, &fn), &norm);
+        uint64_t len = strlen(path);
+        if (path[len - 1] == 'h') {
+            path[len - 1] = 'c';
+            path_map_entry_t* e = pm_get(g.files, path);
+            if (e != NULL && !reached[e->value]) {
+                reached[e->value] = 1;
+                stack[n_stack++] = e->value;
+            }
+        }
+    }
+    file_name_uninit(&fn);
+    file_name_uninit(&norm);
+
+    path_table_t* pt = file_buf->table;
+    bool* dir_kept = calloc(pt->used + 1, sizeof(*dir_kept));
+    panic_if(dir_kept == NULL, "could not allocate include graph: %s", strerror(errno));
+    uint64_t kept = 0;
+    for (i = 0; i < file_buf->used; i++) {
+        if (reached[i]) {
+            dir_kept[pt->buf[file_buf->buf[i]].parent] = 1;
+            file_buf->buf[kept++] = file_buf->buf[i];
+        }
+    }
+    file_buf->used = kept;
+    kept = 0;
+    for (i = 0; i < dir_buf->used; i++) {
+        if (dir_kept[dir_buf->buf[i]]) {
+            dir_buf->buf[kept++] = dir_buf->buf[i];
+        }
+    }
+    dir_buf->used = kept;
+
+    free(dir_kept);
+    free(reached);
+    free(stack);
+    include_graph_free(&g);
+}
+
+// like mkdir -p, dir_buf only holds directories that contain files so parents may be missing
+void make_dir(char* path)
+{
+    stat_add(STAT_MKDIR, 1);
+    if (mkdir(path, S_IRWXU) == 0) {
+        stat_add(STAT_DIRS_CREATED, 1);
+        return;
+    }
+    if (errno == EEXIST) {
+        return;
+    }
+    char* slash = strrchr(path, '/');
+    panic_if(errno != ENOENT || slash == NULL, "could not create directory %s: %s", path, strerror(errno));
+    *slash = 0;
+    make_dir(path);
+    *slash = '/';
+    stat_add(STAT_MKDIR, 1);
+    if (mkdir(path, S_IRWXU) == 0) {
+        stat_add(STAT_DIRS_CREATED, 1);
+        return;
+    }
+    panic_if(errno != EEXIST, "could not create directory %s: %s", path, strerror(errno));
+}
+
+// directory handles
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// out_structure and out_files work relative to directory fds: each directory of the path table is opened once, relative to its
+// parent, and the files in it are created, opened and stat'ed through that fd, so the kernel resolves every path component
+// once instead of once per file. The handles are O_PATH fds, when they reach the budget they are all closed and reopened on
+// demand.
+
+typedef struct dir_fds_t dir_fds_t;
+struct dir_fds_t {
+    path_table_t* pt;
+    char* prefix; // in front of the root, NULL for the source tree
+    bool create; // missing directories are created
+    int* fds; // per path table entry, -1 while closed
+    uint64_t allocated;
+    uint64_t n_open;
+    uint64_t budget;
+};
+
+void dir_fds_init(dir_fds_t* d, path_table_t* pt, char* prefix, bool create)
+{
+    d->pt = pt;
+    d->prefix = prefix;
+    d->create = create;
+    d->allocated = pt->used + 1;
+    d->fds = malloc(d->allocated * sizeof(*d->fds));
+    panic_if(d->fds == NULL, "could not allocate directory handles: %s", strerror(errno));
+    memset(d->fds, -1, d->allocated * sizeof(*d->fds));
+    d->n_open = 0;
+    d->budget = 256;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        d->budget = rl.rlim_cur > 8 ? rl.rlim_cur / 4 : 2;
+    }
+}
+
+void dir_fds_close_all(dir_fds_t* d)
+{
+    uint64_t i;
+    for (i = 0; i < d->allocated && d->n_open > 0; i++) {
+        if (d->fds[i] >= 0) {
+            close(d->fds[i]);
+            d->fds[i] = -1;
+            d->n_open--;
+        }
+    }
+}
+
+void dir_fds_uninit(dir_fds_t* d)
+{
+    dir_fds_close_all(d);
+    free(d->fds);
+}
+
+void make_dir_at(int parent_fd, char* name)
+{
+    stat_add(STAT_MKDIR, 1);
+    if (mkdirat(parent_fd, name, S_IRWXU) == 0) {
+        stat_add(STAT_DIRS_CREATED, 1);
+        return;
+    }
+    panic_if(errno != EEXIST, "could not create directory %s: %s", name, strerror(errno));
+}
+
+int dir_fds_open(dir_fds_t* d, uint32_t id)
+{
+    if (d->fds[id] >= 0) {
+        return d->fds[id];
+    }
+    uint32_t parent = d->pt->buf[id].parent;
+    int fd;
+    if (parent == PATH_NONE) {
+        file_name_t fn;
+        file_name_init(&fn);
+        char* path = pt_path(d->pt, d->prefix, id, &fn);
+        if (d->create) {
+            make_dir(path);
+        }
+        fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        panic_if(fd < 0, "could not open directory: %s: %s", path, strerror(errno));
+        file_name_uninit(&fn);
+    } else {
+        int parent_fd = dir_fds_open(d, parent);
+        char* name = pt_name(d->pt, id);
+        if (d->create) {
+            make_dir_at(parent_fd, name);
+        }
+        fd = openat(parent_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        panic_if(fd < 0, "could not open directory: %s: %s", name, strerror(errno));
+    }
+    stat_add(STAT_OPEN, 1);
+    d->fds[id] = fd;
+    d->n_open++;
+    return fd;
+}
+
+// the fd of directory id, opening (and with create making) it and its parents as needed
+int dir_fds_get(dir_fds_t* d, uint32_t id)
+{
+    if (d->fds[id] < 0 && d->n_open >= d->budget) {
+        dir_fds_close_all(d);
+    }
+    return dir_fds_open(d, id);
+}
+
+void out_structure(char* main_dir, name_buf_t* dir_buf)
+{
+    make_dir(main_dir);
+    dir_fds_t d;
+    dir_fds_init(&d, dir_buf->table, main_dir, 1);
+    uint64_t i;
+    for (i = 0; i < dir_buf->used; i++) {
+        // only directories with subdirectories get opened
+        uint32_t parent = dir_buf->table->buf[dir_buf->buf[i]].parent;
+        if (parent == PATH_NONE) {
+            dir_fds_get(&d, dir_buf->buf[i]);
+        } else {
+            make_dir_at(dir_fds_get(&d, parent), pt_name(dir_buf->table, dir_buf->buf[i]));
+        }
+    }
+    dir_fds_uninit(&d);
+}
+
+// manifest
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// package/.pp_manifest remembers size, mtime and content hash of every packaged file, one "hash size mtime path" line each
+
+#define MANIFEST_NAME ".pp_manifest"
+
+typedef struct file_meta_t file_meta_t;
+struct file_meta_t {
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+};
+
+typedef struct manifest_entry_t manifest_entry_t;
+struct manifest_entry_t {
+    uint64_t path; // offset in the names of index
+    file_meta_t meta;
+    bool seen;
+};
+
+// the manifest of the previous run, looked up by path
+typedef struct manifest_t manifest_t;
+struct manifest_t {
+    path_map_t* index; // path to position in buf
+    manifest_entry_t* buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+manifest_t* manifest_create(uint64_t init_length)
+{
+    manifest_t* m = calloc(1, sizeof(*m));
+    panic_if(m == NULL, "could not allocate manifest: %s", strerror(errno));
+    m->index = pm_create(init_length);
+    m->allocated = init_length ? init_length : 1;
+    m->buf = malloc(m->allocated * sizeof(*m->buf));
+    panic_if(m->buf == NULL, "could not allocate manifest: %s", strerror(errno));
+    return m;
+}
+
+void manifest_free(manifest_t* m)
+{
+    pm_free(m->index);
+    free(m->buf);
+    free(m);
+}
+
+manifest_entry_t* manifest_get(manifest_t* m, char* path)
+{
+    path_map_entry_t* e = pm_get(m->index, path);
+    return e == NULL ? NULL : &m->buf[e->value];
+}
+
+manifest_entry_t* manifest_put(manifest_t* m, char* path)
+{
+    path_map_entry_t* e = pm_get(m->index, path);
+    if (e != NULL) {
+        return &m->buf[e->value];
+    }
+    if (m->used >= m->allocated) {
+        m->allocated <<= 1;
+        m->buf = realloc(m->buf, m->allocated * sizeof(*m->buf));
+        panic_if(m->buf == NULL, "could not realloc manifest: %s", strerror(errno));
+    }
+    e = pm_put(m->index, path);
+    e->value = m->used;
+    manifest_entry_t* entry = &m->buf[m->used++];
+    entry->path = e->path;
+    entry->seen = 0;
+    return entry;
+}
+
+manifest_t* manifest_load(char* out_dir)
+{
+    manifest_t* m = manifest_create(16);
+    file_name_t fn;
+    file_name_init(&fn);
+    FILE* f = fopen(file_name_cat(&fn, out_dir, MANIFEST_NAME), "r");
+    file_name_uninit(&fn);
+    if (f == NULL) {
+        return m;
+    }
+    char* line = NULL;
+    size_t line_len = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_len, f)) > 0) {
+        if (line[n - 1] == '\n') {
+            line[n - 1] = 0;
+        }
+        unsigned long long hash;
+        unsigned long long size;
+        long long mtime;
+        int path_start;
+        if (sscanf(line, "%llx %llu %lld %n", &hash, &size, &mtime, &path_start) != 3) {
+            continue;
+        }
+        manifest_put(m, line + path_start)->meta = (file_meta_t) { hash, size, mtime };
+    }
+    free(line);
+    fclose(f);
+    return m;
+}
+
+// the manifest is written to a temporary file and renamed over the old one once complete
+FILE* manifest_begin(char* out_dir, file_name_t* tmp_name)
+{
+    FILE* f = fopen(file_name_cat(tmp_name, out_dir, MANIFEST_NAME ".tmp"), "w");
+    panic_if(f == NULL, "could not write manifest: %s: %s", tmp_name->buf, strerror(errno));
+    return f;
+}
+
+void manifest_finish(char* out_dir, FILE* f, file_name_t* tmp_name)
+{
+    panic_if(fclose(f) != 0, "could not write manifest: %s: %s", tmp_name->buf, strerror(errno));
+    file_name_t fn;
+    file_name_init(&fn);
+    panic_if(rename(tmp_name->buf, file_name_cat(&fn, out_dir, MANIFEST_NAME)) < 0, "could not write manifest: %s", strerror(errno));
+    file_name_uninit(&fn);
+}
+
+// writes the manifest for file_buf, meta[i] belongs to file i
+void manifest_save(char* out_dir, name_buf_t* file_buf, file_meta_t* meta)
+{
+    file_name_t tmp_name;
+    file_name_t fn;
+    file_name_init(&tmp_name);
+    file_name_init(&fn);
+    FILE* f = manifest_begin(out_dir, &tmp_name);
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        fprintf(f, "%016llx %llu %lld %s\n", (unsigned long long)meta[i].hash, (unsigned long long)meta[i].size,
+                (long long)meta[i].mtime, nb_path(file_buf, NULL, i, &fn));
+    }
+    manifest_finish(out_dir, f, &tmp_name);
+    file_name_uninit(&tmp_name);
+    file_name_uninit(&fn);
+}
+
+// writes the entries of m that are marked seen, for --watch, which keeps the manifest in memory
+void manifest_save_seen(char* out_dir, manifest_t* m)
+{
+    file_name_t tmp_name;
+    file_name_init(&tmp_name);
+    FILE* f = manifest_begin(out_dir, &tmp_name);
+    manifest_entry_t* e;
+    for (e = m->buf; e != m->buf + m->used; e++) {
+        if (e->seen) {
+            fprintf(f, "%016llx %llu %lld %s\n", (unsigned long long)e->meta.hash, (unsigned long long)e->meta.size,
+                    (long long)e->meta.mtime, m->index->names.buf + e->path);
+        }
+    }
+    manifest_finish(out_dir, f, &tmp_name);
+    file_name_uninit(&tmp_name);
+}
+
+// files
+//--------------------------------------------------------------------------------------------------------------------------------
+
+int64_t stat_mtime(struct stat* st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// a file as the syscalls see it, name relative to the directory fd dir (AT_FDCWD for a path), and its path for the manifest and
+// messages
+typedef struct file_at_t file_at_t;
+struct file_at_t {
+    int dir;
+    char* name;
+    char* path;
+};
+
+uint64_t hash_file(file_at_t* file, uint64_t size)
+{
+    if (size == 0) {
+        return hash64(NULL, 0, 0);
+    }
+    int fd = openat(file->dir, file->name, O_RDONLY | O_CLOEXEC);
+    panic_if(fd < 0, "could not open %s: %s", file->path, strerror(errno));
+    stat_add(STAT_OPEN, 1);
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    panic_if(data == MAP_FAILED, "could not map %s: %s", file->path, strerror(errno));
+    uint64_t hash = hash64(data, size, 0);
+    munmap(data, size);
+    close(fd);
+    return hash;
+}
+
+// deduplication
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// With --dedup files are told apart by size and xxh64 of their content. The first file with a given content is packaged,
+// later ones become hardlinks to it in a package directory and entries sharing its data in an archive. The hash only finds
+// the candidate, which is compared byte for byte before anything is shared, so a collision packages the file on its own.
+// Empty files are left alone, there is nothing to save on them.
+
+// true if the files, both size bytes long, have the same content
+bool files_equal(file_at_t* a, file_at_t* b, uint64_t size)
+{
+    int fd_a = openat(a->dir, a->name, O_RDONLY | O_CLOEXEC);
+    panic_if(fd_a < 0, "could not open %s: %s", a->path, strerror(errno));
+    int fd_b = openat(b->dir, b->name, O_RDONLY | O_CLOEXEC);
+    panic_if(fd_b < 0, "could not open %s: %s", b->path, strerror(errno));
+    stat_add(STAT_OPEN, 2);
+    void* data_a = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd_a, 0);
+    panic_if(data_a == MAP_FAILED, "could not map %s: %s", a->path, strerror(errno));
+    void* data_b = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd_b, 0);
+    panic_if(data_b == MAP_FAILED, "could not map %s: %s", b->path, strerror(errno));
+    bool equal = memcmp(data_a, data_b, size) == 0;
+    munmap(data_a, size);
+    munmap(data_b, size);
+    close(fd_a);
+    close(fd_b);
+    return equal;
+}
+
+typedef struct blob_slot_t blob_slot_t;
+struct blob_slot_t {
+    uint64_t hash;
+    uint64_t size;
+    uint64_t first; // index + 1 of the first file or entry with this content, 0 for a free slot
+};
+
+// open addressing on the content hash, which is already well mixed
+typedef struct blob_set_t blob_set_t;
+struct blob_set_t {
+    blob_slot_t* buf;
+    uint64_t used;
+    uint64_t allocated;
+};
+
+blob_slot_t* blob_slot(blob_set_t* s, uint64_t hash, uint64_t size)
+{
+    uint64_t mask = s->allocated - 1;
+    uint64_t i = hash & mask;
+    while (s->buf[i].first != 0 && (s->buf[i].hash != hash || s->buf[i].size != size)) {
+        i = (i + 1) & mask;
+    }
+    return &s->buf[i];
+}
+
+// returns the index of the first blob with this hash and size, which is index if there was none so far, the caller compares
+// the contents
+uint64_t blob_set_first(blob_set_t* s, uint64_t hash, uint64_t size, uint64_t index)
+{
+    if ((s->used + 1) * 2 > s->allocated) {
+        blob_slot_t* old = s->buf;
+        uint64_t old_allocated = s->allocated;
+        s->allocated = s->allocated ? s->allocated << 1 : 1024;
+        s->buf = calloc(s->allocated, sizeof(*s->buf));
+        panic_if(s->buf == NULL, "could not allocate dedup table: %s", strerror(errno));
+        blob_slot_t* e;
+        for (e = old; e != old + old_allocated; e++) {
+            if (e->first != 0) {
+                *blob_slot(s, e->hash, e->size) = *e;
+            }
+        }
+        free(old);
+    }
+    blob_slot_t* slot = blob_slot(s, hash, size);
+    if (slot->first == 0) {
+        *slot = (blob_slot_t) { hash, size, index + 1 };
+        s->used++;
+    }
+    return slot->first - 1;
+}
+
+typedef struct dedup_stats_t dedup_stats_t;
+struct dedup_stats_t {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t duplicates;
+    uint64_t duplicate_bytes;
+    uint64_t shared; // duplicates written as a link or shared entry by this run
+    uint64_t hashed_bytes; // by a pass of its own, not as part of other work
+    double hash_seconds;
+};
+
+void dedup_report(dedup_stats_t* d)
+{
+    uint64_t unique = d->bytes - d->duplicate_bytes;
+    fprintf(report_out(), "dedup: %llu of %llu files duplicate an earlier one, %.1f MB of %.1f MB (%.2fx), %llu shared by this run\n",
+           (unsigned long long)d->duplicates, (unsigned long long)d->files, d->duplicate_bytes / 1e6, d->bytes / 1e6,
+           unique > 0 ? (double)d->bytes / unique : 1.0, (unsigned long long)d->shared);
+    if (d->hashed_bytes > 0) {
+        fprintf(report_out(), "dedup: hashed %.1f MB in %.3fs, %.2f GB/s\n", d->hashed_bytes / 1e6, d->hash_seconds,
+               d->hashed_bytes / d->hash_seconds / 1e9);
+    }
+}
+
+// copy engine
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Methods are tried from cheapest to most expensive. A method that the filesystem or kernel does not support is disabled for
+// the rest of the run after its first failure, so later files go straight to the first working one.
+
+typedef enum copy_method_t copy_method_t;
+enum copy_method_t {
+    COPY_HARDLINK,
+    COPY_URING,
+    COPY_REFLINK,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+    COPY_METHODS,
+};
+
+char* copy_method_names[COPY_METHODS] = { "hardlink", "io_uring", "reflink", "copy_file_range", "sendfile", "read/write" };
+
+typedef struct copy_engine_t copy_engine_t;
+struct copy_engine_t {
+    bool hardlink;
+    bool verbose;
+    bool dedup;
+    uint64_t n_threads; // hashing threads for dedup
+    uint64_t uring_depth; // files in flight through io_uring, 0 disables it
+    atomic_bool unsupported[COPY_METHODS];
+    atomic_uint_fast64_t counts[COPY_METHODS];
+};
+
+#define COPY_OK 0
+#define COPY_UNSUPPORTED 1
+
+bool copy_errno_unsupported(int err)
+{
+    return err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV || err == EINVAL || err == ENOSYS || err == ENOTTY
+        || err == EBADF || err == EPERM;
+}
+
+int copy_reflink(int dest, int src, uint64_t len, char* name)
+{
+    (void)len;
+    if (ioctl(dest, FICLONE, src) < 0) {
+        panic_if(!copy_errno_unsupported(errno), "could not clone %s: %s", name, strerror(errno));
+        return COPY_UNSUPPORTED;
+    }
+    return COPY_OK;
+}
+
+int copy_range(int dest, int src, uint64_t len, char* name)
+{
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(src, NULL, dest, NULL, len - done, 0);
+        if (n < 0) {
+            panic_if(done > 0 || !copy_errno_unsupported(errno), "could not copy %s: %s", name, strerror(errno));
+            return COPY_UNSUPPORTED;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return COPY_OK;
+}
+
+int copy_sendfile(int dest, int src, uint64_t len, char* name)
+{
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = sendfile(dest, src, NULL, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic_if(done > 0 || !copy_errno_unsupported(errno), "could not copy %s: %s", name, strerror(errno));
+            return COPY_UNSUPPORTED;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return COPY_OK;
+}
+
+int copy_read_write(int dest, int src, uint64_t len, char* name)
+{
+    (void)len;
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(src, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        panic_if(n < 0, "could not read %s: %s", name, strerror(errno));
+        char* p = buf;
+        while (n > 0) {
+            ssize_t w = write(dest, p, n);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            panic_if(w < 0, "could not write %s: %s", name, strerror(errno));
+            p += w;
+            n -= w;
+        }
+    }
+    return COPY_OK;
+}
+
+typedef int (*copy_fn_t)(int dest, int src, uint64_t len, char* name);
+
+copy_fn_t copy_fns[COPY_METHODS] = { NULL, NULL, copy_reflink, copy_range, copy_sendfile, copy_read_write };
+
+// copies src_name to dest_name and returns the method that did it
+copy_method_t copy_file_at(copy_engine_t* engine, file_at_t* dest_file, file_at_t* src_file)
+{
+    char* dest_name = dest_file->path;
+    char* src_name = src_file->path;
+    // never write through dest_name, it may be a hardlink to the source from an earlier run
+    panic_if(unlinkat(dest_file->dir, dest_file->name, 0) < 0 && errno != ENOENT, "could not replace %s: %s", dest_name,
+        strerror(errno));
+    stat_add(STAT_UNLINK, 1);
+
+    copy_method_t method = COPY_HARDLINK;
+    if (engine->hardlink && !atomic_load(&engine->unsupported[COPY_HARDLINK])) {
+        if (linkat(src_file->dir, src_file->name, dest_file->dir, dest_file->name, 0) == 0) {
+            goto done;
+        }
+        panic_if(!copy_errno_unsupported(errno) && errno != EMLINK, "could not link %s: %s", dest_name, strerror(errno));
+        atomic_store(&engine->unsupported[COPY_HARDLINK], 1);
+    }
+
+    int src = openat(src_file->dir, src_file->name, O_RDONLY | O_CLOEXEC);
+    panic_if(src < 0, "could not open %s: %s", src_name, strerror(errno));
+    int dest = openat(dest_file->dir, dest_file->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    panic_if(dest < 0, "could not open %s: %s", dest_name, strerror(errno));
+    struct stat st;
+    panic_if(fstat(src, &st) < 0, "could not stat %s: %s", src_name, strerror(errno));
+    stat_add(STAT_OPEN, 2);
+    stat_add(STAT_STAT, 1);
+    stat_add(STAT_BYTES_COPIED, st.st_size);
+
+    for (method = COPY_REFLINK; method < COPY_METHODS; method++) {
+        if (atomic_load(&engine->unsupported[method])) {
+            continue;
+        }
+        if (copy_fns[method](dest, src, st.st_size, src_name) == COPY_OK) {
+            break;
+        }
+        atomic_store(&engine->unsupported[method], 1);
+    }
+    close(dest);
+    close(src);
+
+done:
+    stat_add(STAT_FILES_COPIED, 1);
+    atomic_fetch_add(&engine->counts[method], 1);
+    if (engine->verbose) {
+        fprintf(report_out(), "%s: %s\n", copy_method_names[method], src_name);
+    }
+    return method;
+}
+
+copy_method_t copy_file(copy_engine_t* engine, char* dest_name, char* src_name)
+{
+    file_at_t dest = { AT_FDCWD, dest_name, dest_name };
+    file_at_t src = { AT_FDCWD, src_name, src_name };
+    return copy_file_at(engine, &dest, &src);
+}
+
+void copy_engine_report(copy_engine_t* engine)
+{
+    copy_method_t method;
+    fprintf(report_out(), "copied:");
+    for (method = 0; method < COPY_METHODS; method++) {
+        fprintf(report_out(), " %s %llu%s", copy_method_names[method], (unsigned long long)atomic_load(&engine->counts[method]),
+                method + 1 < COPY_METHODS ? "," : "\n");
+    }
+}
+
+// io_uring copy
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Small files are copied through io_uring, each as one chain of linked requests: open both files into fixed file slots, read
+// the source into a buffer, write it out and close both slots. The destination is opened with O_EXCL, so that a file left over
+// from an earlier run (possibly a hardlink to the source) is never written through; such a file is unlinked and its chain
+// queued once more. With up to uring_depth chains in flight a batch of files costs a few io_uring_enter calls instead of six
+// blocking syscalls per file. A chain that fails otherwise is redone by copy_file, and so is everything when the kernel
+// refuses io_uring (too old, seccomp, io_uring_disabled) or io_uring_enter fails for good.
+
+#define URING_MAX_SIZE (64 << 10) // larger files go straight to copy_file
+#define URING_CHAIN 6
+
+enum {
+    URING_OPEN_SRC,
+    URING_OPEN_DEST,
+    URING_READ,
+    URING_WRITE,
+    URING_CLOSE_SRC,
+    URING_CLOSE_DEST,
+};
+
+typedef struct uring_t uring_t;
+struct uring_t {
+    int fd;
+    void* ring; // submission and completion ring share one mapping
+    uint64_t ring_size;
+    struct io_uring_sqe* sqes;
+    uint64_t sqes_size;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+    uint32_t prepared; // entries behind the tail the kernel sees
+    uint32_t published; // entries before the tail the kernel did not consume yet
+};
+
+void uring_free(uring_t* u)
+{
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->ring != NULL && u->ring != MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+    }
+    close(u->fd);
+}
+
+// false if the kernel does not offer what the copy chains need
+bool uring_init(uring_t* u, uint32_t entries, uint32_t n_files)
+{
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p = { 0 };
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(u->fd);
+        return 0;
+    }
+    u->ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_size) {
+        u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    struct io_uring_rsrc_register files = { 0 };
+    files.nr = n_files;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED
+        || syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        uring_free(u);
+        return 0;
+    }
+    char* ring = u->ring;
+    u->sq_tail = (uint32_t*)(ring + p.sq_off.tail);
+    u->sq_mask = (uint32_t*)(ring + p.sq_off.ring_mask);
+    u->sq_array = (uint32_t*)(ring + p.sq_off.array);
+    u->cq_head = (uint32_t*)(ring + p.cq_off.head);
+    u->cq_tail = (uint32_t*)(ring + p.cq_off.tail);
+    u->cq_mask = (uint32_t*)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+    return 1;
+}
+
+// the next free submission entry, the caller makes sure the ring has room
+struct io_uring_sqe* uring_sqe(uring_t* u, uint8_t opcode, uint8_t flags, uint64_t user_data)
+{
+    uint32_t tail = *u->sq_tail + u->prepared++;
+    uint32_t index = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+// publishes the prepared entries, has the kernel consume every published one and waits for at least one completion, false if
+// io_uring_enter fails for good
+bool uring_submit(uring_t* u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + u->prepared, __ATOMIC_RELEASE);
+    u->published += u->prepared;
+    u->prepared = 0;
+    while (u->published > 0 || __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) == *u->cq_head) {
+        int n = syscall(__NR_io_uring_enter, u->fd, u->published, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            // the kernel may want completions reaped before it takes more, the rest goes with the next call
+            if (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != *u->cq_head) {
+                return 1;
+            }
+            continue;
+        }
+        if (n < 0) {
+            return 0;
+        }
+        u->published -= n;
+    }
+    return 1;
+}
+
+typedef struct copy_batch_t copy_batch_t;
+struct copy_batch_t {
+    arena_t names;
+    uint64_t* files; // dest name, src name and size of each file
+    uint64_t used;
+    uint64_t allocated;
+};
+
+void copy_batch_push(copy_batch_t* b, char* dest_name, char* src_name, uint64_t size)
+{
+    if (b->used + 3 > b->allocated) {
+        b->allocated = b->allocated ? b->allocated << 1 : 3 * 256;
+        b->files = realloc(b->files, b->allocated * sizeof(*b->files));
+        panic_if(b->files == NULL, "could not allocate copy batch: %s", strerror(errno));
+    }
+    b->files[b->used++] = arena_push(&b->names, dest_name);
+    b->files[b->used++] = arena_push(&b->names, src_name);
+    b->files[b->used++] = size;
+}
+
+typedef struct uring_slot_t uring_slot_t;
+struct uring_slot_t {
+    uint64_t* file;
+    uint32_t pending; // completions still to come
+    bool failed;
+    bool existed; // the destination was there before, unlinked before the chain is queued again
+    bool requeued;
+};
+
+void uring_queue_chain(uring_t* u, copy_batch_t* b, uring_slot_t* slots, uint32_t slot, char* buf)
+{
+    uint64_t* file = slots[slot].file;
+    char* dest_name = b->names.buf + file[0];
+    char* src_name = b->names.buf + file[1];
+    uint64_t data = (uint64_t)slot * URING_CHAIN;
+    struct io_uring_sqe* sqe;
+
+    // every request runs whatever happened before it, so that the closes always free both slots, and a read or write on a
+    // slot that failed to open fails with EBADF
+    sqe = uring_sqe(u, IORING_OP_OPENAT, IOSQE_IO_HARDLINK, data + URING_OPEN_SRC);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)src_name;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = 2 * slot + 1;
+    sqe = uring_sqe(u, IORING_OP_OPENAT, IOSQE_IO_HARDLINK, data + URING_OPEN_DEST);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)dest_name;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+    sqe->len = S_IRUSR | S_IWUSR;
+    sqe->file_index = 2 * slot + 2;
+    sqe = uring_sqe(u, IORING_OP_READ, IOSQE_IO_HARDLINK | IOSQE_FIXED_FILE, data + URING_READ);
+    sqe->fd = 2 * slot;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = file[2];
+    sqe = uring_sqe(u, IORING_OP_WRITE, IOSQE_IO_HARDLINK | IOSQE_FIXED_FILE, data + URING_WRITE);
+    sqe->fd = 2 * slot + 1;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = file[2];
+    sqe = uring_sqe(u, IORING_OP_CLOSE, IOSQE_IO_HARDLINK, data + URING_CLOSE_SRC);
+    sqe->file_index = 2 * slot + 1;
+    sqe = uring_sqe(u, IORING_OP_CLOSE, 0, data + URING_CLOSE_DEST);
+    sqe->file_index = 2 * slot + 2;
+
+    slots[slot].pending = URING_CHAIN;
+    slots[slot].failed = 0;
+    slots[slot].existed = 0;
+}
+
+// copies every file of the batch, through io_uring where possible
+void copy_batch_run(copy_engine_t* engine, copy_batch_t* b)
+{
+    uint64_t n_files = b->used / 3;
+    uint32_t depth = engine->uring_depth < n_files ? engine->uring_depth : n_files;
+    uring_t u;
+    if (n_files == 0 || atomic_load(&engine->unsupported[COPY_URING]) || !uring_init(&u, depth * URING_CHAIN, 2 * depth)) {
+        atomic_store(&engine->unsupported[COPY_URING], n_files > 0);
+        uint64_t* file;
+        for (file = b->files; file != b->files + b->used; file += 3) {
+            copy_file(engine, b->names.buf + file[0], b->names.buf + file[1]);
+        }
+        return;
+    }
+
+    char* bufs = malloc((uint64_t)depth * URING_MAX_SIZE);
+    uring_slot_t* slots = calloc(depth, sizeof(*slots));
+    uint32_t* free_slots = malloc(depth * sizeof(*free_slots));
+    panic_if(bufs == NULL || slots == NULL || free_slots == NULL, "could not allocate io_uring buffers: %s", strerror(errno));
+    uint32_t n_free;
+    for (n_free = 0; n_free < depth; n_free++) {
+        free_slots[n_free] = depth - 1 - n_free;
+    }
+
+    uint64_t* next = b->files;
+    uint64_t done = 0;
+    while (done < n_files) {
+        while (n_free > 0 && next != b->files + b->used) {
+            uint32_t slot = free_slots[--n_free];
+            slots[slot].file = next;
+            slots[slot].requeued = 0;
+            uring_queue_chain(&u, b, slots, slot, bufs + (uint64_t)slot * URING_MAX_SIZE);
+            next += 3;
+        }
+        if (!uring_submit(&u)) {
+            break;
+        }
+        uint32_t head = *u.cq_head;
+        uint32_t tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &u.cqes[head & *u.cq_mask];
+            uint32_t slot = cqe->user_data / URING_CHAIN;
+            uint32_t op = cqe->user_data % URING_CHAIN;
+            uring_slot_t* s = &slots[slot];
+            if ((op == URING_OPEN_SRC || op == URING_OPEN_DEST) && cqe->res < 0) {
+                s->failed = 1;
+                s->existed = op == URING_OPEN_DEST && cqe->res == -EEXIST;
+            } else if ((op == URING_READ || op == URING_WRITE) && (uint64_t)cqe->res != s->file[2]) {
+                s->failed = 1;
+            }
+            if (--s->pending > 0) {
+                continue;
+            }
+            char* src_name = b->names.buf + s->file[1];
+            if (s->failed && s->existed && !s->requeued) {
+                char* dest_name = b->names.buf + s->file[0];
+                panic_if(unlink(dest_name) < 0 && errno != ENOENT, "could not replace %s: %s", dest_name, strerror(errno));
+                stat_add(STAT_UNLINK, 1);
+                s->requeued = 1;
+                uring_queue_chain(&u, b, slots, slot, bufs + (uint64_t)slot * URING_MAX_SIZE);
+                continue;
+            }
+            if (s->failed) {
+                copy_file(engine, b->names.buf + s->file[0], src_name);
+            } else {
+                stat_add(STAT_FILES_COPIED, 1);
+                stat_add(STAT_BYTES_COPIED, s->file[2]);
+                atomic_fetch_add(&engine->counts[COPY_URING], 1);
+                if (engine->verbose) {
+                    fprintf(report_out(), "%s: %s\n", copy_method_names[COPY_URING], src_name);
+                }
+            }
+            free_slots[n_free++] = slot;
+            done++;
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_free(&u);
+    if (done < n_files) {
+        // closing the ring cancels what is still in flight, but the buffers are left to it
+        atomic_store(&engine->unsupported[COPY_URING], 1);
+        uint32_t slot;
+        for (slot = 0; slot < depth; slot++) {
+            if (slots[slot].pending > 0) {
+                copy_file(engine, b->names.buf + slots[slot].file[0], b->names.buf + slots[slot].file[1]);
+            }
+        }
+        for (; next != b->files + b->used; next += 3) {
+            copy_file(engine, b->names.buf + next[0], b->names.buf + next[1]);
+        }
+    } else {
+        free(bufs);
+    }
+    free(slots);
+    free(free_slots);
+}
+
+// fills meta for src, taking the hash from prev, its manifest entry, when size and mtime did not change, and returns the
+// bytes hashed
+uint64_t file_meta_fill(manifest_entry_t* prev, file_meta_t* meta, file_at_t* src)
+{
+    struct stat st;
+    panic_if(fstatat(src->dir, src->name, &st, 0) < 0, "could not stat %s: %s", src->path, strerror(errno));
+    stat_add(STAT_STAT, 1);
+    meta->size = st.st_size;
+    meta->mtime = stat_mtime(&st);
+    if (prev != NULL && prev->meta.size == meta->size && prev->meta.mtime == meta->mtime) {
+        meta->hash = prev->meta.hash;
+        return 0;
+    }
+    meta->hash = hash_file(src, meta->size);
+    return meta->size;
+}
+
+// true if dest, packaged as prev, already holds the content meta describes, and without --hardlink is not the hardlink to
+// src an earlier run with it left
+bool package_current(copy_engine_t* engine, manifest_entry_t* prev, file_meta_t* meta, file_at_t* dest, file_at_t* src)
+{
+    if (prev == NULL) {
+        return 0;
+    }
+    prev->seen = 1;
+    struct stat st;
+    stat_add(STAT_STAT, 1);
+    bool current = fstatat(dest->dir, dest->name, &st, 0) == 0 && (uint64_t)st.st_size == meta->size
+        && prev->meta.hash == meta->hash;
+    if (current && !engine->hardlink && st.st_nlink > 1) {
+        struct stat src_st;
+        stat_add(STAT_STAT, 1);
+        current = fstatat(src->dir, src->name, &src_st, 0) < 0 || src_st.st_ino != st.st_ino || src_st.st_dev != st.st_dev;
+    }
+    if (current) {
+        stat_add(STAT_FILES_UNCHANGED, 1);
+    }
+    return current;
+}
+
+// copies src to dest, which may exist from an earlier run, small files are queued on batch when there is one
+void package_copy(copy_engine_t* engine, copy_batch_t* batch, bool existed, file_meta_t* meta, file_at_t* dest, file_at_t* src)
+{
+    if (batch != NULL && meta->size <= URING_MAX_SIZE) {
+        if (existed) {
+            panic_if(unlinkat(dest->dir, dest->name, 0) < 0 && errno != ENOENT, "could not replace %s: %s", dest->path,
+                strerror(errno));
+            stat_add(STAT_UNLINK, 1);
+        }
+        copy_batch_push(batch, dest->path, src->path, meta->size);
+        return;
+    }
+    copy_file_at(engine, dest, src);
+}
+
+// copies src unless the manifest shows that dest already holds the same content
+void package_file(copy_engine_t* engine, copy_batch_t* batch, manifest_t* old, file_meta_t* meta, file_at_t* dest, file_at_t* src)
+{
+    manifest_entry_t* prev = manifest_get(old, src->path);
+    file_meta_fill(prev, meta, src);
+    if (!package_current(engine, prev, meta, dest, src)) {
+        package_copy(engine, batch, prev != NULL, meta, dest, src);
+    }
+}
+
+// compile.c partially links the objects of every directory into PART_NAME there
+#define PART_NAME ".pp_part.o"
+
+// removes a packaged file and the object built from it, and its directory once that is empty
+void remove_packaged(char* dest)
+{
+    unlink(dest);
+    stat_add(STAT_UNLINK, 1);
+    uint64_t len = strlen(dest);
+    bool source = dest[len - 1] == 'c';
+    if (source) {
+        dest[len - 1] = 'o';
+        unlink(dest);
+        dest[len - 1] = 'd';
+        unlink(dest);
+        dest[len - 1] = 'c';
+        stat_add(STAT_UNLINK, 2);
+    }
+    char* slash = strrchr(dest, '/');
+    *slash = 0;
+    if (source) {
+        // the partial link of the directory lost a member, and would keep it from being removed
+        file_name_t fn;
+        file_name_init(&fn);
+        unlink(file_name_cat(&fn, dest, PART_NAME));
+        file_name_uninit(&fn);
+        stat_add(STAT_UNLINK, 1);
+    }
+    rmdir(dest);
+    *slash = '/';
+}
+
+// removes packaged files (and the objects built from them) whose source is gone
+void remove_vanished(char* out_dir, manifest_t* old)
+{
+    file_name_t fn;
+    file_name_init(&fn);
+    manifest_entry_t* e;
+    for (e = old->buf; e != old->buf + old->used; e++) {
+        if (!e->seen) {
+            remove_packaged(file_name_cat(&fn, out_dir, old->index->names.buf + e->path));
+        }
+    }
+    file_name_uninit(&fn);
+}
+
+// fills meta for the files of file_buf, spread over threads for dedup
+typedef struct meta_filler_t meta_filler_t;
+struct meta_filler_t {
+    name_buf_t* file_buf;
+    manifest_t* old;
+    file_meta_t* meta;
+    atomic_uint_fast64_t next;
+    atomic_uint_fast64_t hashed_bytes;
+};
+
+void* meta_fill_worker(void* arg)
+{
+    meta_filler_t* f = arg;
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    while ((i = atomic_fetch_add(&f->next, 1)) < f->file_buf->used) {
+        char* path = nb_path(f->file_buf, NULL, i, &fn);
+        file_at_t src = { AT_FDCWD, path, path };
+        atomic_fetch_add(&f->hashed_bytes, file_meta_fill(manifest_get(f->old, path), &f->meta[i], &src));
+    }
+    file_name_uninit(&fn);
+    return NULL;
+}
+
+// returns the bytes hashed
+uint64_t fill_meta_parallel(name_buf_t* file_buf, manifest_t* old, file_meta_t* meta, uint64_t n_threads)
+{
+    meta_filler_t f = { file_buf, old, meta, 0, 0 };
+    atomic_init(&f.next, 0);
+    atomic_init(&f.hashed_bytes, 0);
+    if (n_threads > file_buf->used) {
+        n_threads = file_buf->used;
+    }
+    if (n_threads <= 1) {
+        meta_fill_worker(&f);
+        return atomic_load(&f.hashed_bytes);
+    }
+    pthread_t* threads = malloc(n_threads * sizeof(*threads));
+    panic_if(threads == NULL, "could not allocate hash threads: %s", strerror(errno));
+    uint64_t i;
+    for (i = 0; i < n_threads; i++) {
+        panic_if(pthread_create(&threads[i], NULL, meta_fill_worker, &f) != 0, "could not start hash thread");
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return atomic_load(&f.hashed_bytes);
+}
+
+// makes dest a hardlink to first, the packaged file with the same content
+void package_link(file_at_t* dest, char* first)
+{
+    panic_if(linkat(AT_FDCWD, first, dest->dir, dest->name, 0) < 0, "could not link %s to %s: %s", dest->path, first,
+        strerror(errno));
+}
+
+void out_files(char* out_dir, name_buf_t* file_buf, copy_engine_t* engine)
+{
+    manifest_t* old = manifest_load(out_dir);
+    file_meta_t* meta = malloc(file_buf->used * sizeof(*meta) + 1);
+    panic_if(meta == NULL, "could not allocate manifest: %s", strerror(errno));
+    // with dedup every file is hashed up front, so that a copy can be told from the first file with its content
+    bool dedup = engine->dedup && !engine->hardlink;
+    dedup_stats_t dedup_stats = { 0 };
+    blob_set_t blobs = { 0 };
+    uint64_t* first = NULL;
+    if (dedup) {
+        double start = wall_seconds();
+        dedup_stats.hashed_bytes = fill_meta_parallel(file_buf, old, meta, engine->n_threads);
+        dedup_stats.hash_seconds = wall_seconds() - start;
+        first = malloc(file_buf->used * sizeof(*first) + 1);
+        panic_if(first == NULL, "could not allocate dedup table: %s", strerror(errno));
+    }
+
+    file_name_t src_fn;
+    file_name_t dest_fn;
+    file_name_init(&src_fn);
+    file_name_init(&dest_fn);
+    dir_fds_t src_dirs;
+    dir_fds_t dest_dirs;
+    dir_fds_init(&src_dirs, file_buf->table, NULL, 0);
+    dir_fds_init(&dest_dirs, file_buf->table, out_dir, 0);
+    file_name_t first_fn;
+    file_name_init(&first_fn);
+    copy_batch_t batch = { 0 };
+    bool uring = engine->uring_depth > 0 && !engine->hardlink;
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        uint32_t id = file_buf->buf[i];
+        uint32_t parent = file_buf->table->buf[id].parent;
+        char* name = pt_name(file_buf->table, id);
+        file_at_t src = { dir_fds_get(&src_dirs, parent), name, nb_path(file_buf, NULL, i, &src_fn) };
+        file_at_t dest = { dir_fds_get(&dest_dirs, parent), name, nb_path(file_buf, out_dir, i, &dest_fn) };
+        if (!dedup) {
+            package_file(engine, uring ? &batch : NULL, old, &meta[i], &dest, &src);
+            continue;
+        }
+        first[i] = meta[i].size > 0 ? blob_set_first(&blobs, meta[i].hash, meta[i].size, i) : i;
+        if (first[i] != i) {
+            char* first_path = nb_path(file_buf, NULL, first[i], &first_fn);
+            file_at_t first_src = { AT_FDCWD, first_path, first_path };
+            first[i] = files_equal(&first_src, &src, meta[i].size) ? first[i] : i;
+        }
+        dedup_stats.files++;
+        dedup_stats.bytes += meta[i].size;
+        dedup_stats.duplicates += first[i] != i;
+        dedup_stats.duplicate_bytes += first[i] != i ? meta[i].size : 0;
+        manifest_entry_t* prev = manifest_get(old, src.path);
+        if (package_current(engine, prev, &meta[i], &dest, &src)) {
+            first[i] = i;
+        } else if (first[i] == i) {
+            package_copy(engine, uring ? &batch : NULL, prev != NULL, &meta[i], &dest, &src);
+        } else if (prev != NULL) {
+            panic_if(unlinkat(dest.dir, dest.name, 0) < 0 && errno != ENOENT, "could not replace %s: %s", dest.path,
+                strerror(errno));
+            stat_add(STAT_UNLINK, 1);
+        }
+    }
+    copy_batch_run(engine, &batch);
+    arena_free(&batch.names);
+    free(batch.files);
+    // after the batch, which may still have been copying the first files
+    for (i = 0; dedup && i < file_buf->used; i++) {
+        if (first[i] != i) {
+            uint32_t id = file_buf->buf[i];
+            file_at_t dest = { dir_fds_get(&dest_dirs, file_buf->table->buf[id].parent), pt_name(file_buf->table, id),
+                nb_path(file_buf, out_dir, i, &dest_fn) };
+            package_link(&dest, nb_path(file_buf, out_dir, first[i], &first_fn));
+            dedup_stats.shared++;
+        }
+    }
+    file_name_uninit(&first_fn);
+    dir_fds_uninit(&src_dirs);
+    dir_fds_uninit(&dest_dirs);
+    file_name_uninit(&src_fn);
+    file_name_uninit(&dest_fn);
+    if (dedup) {
+        dedup_report(&dedup_stats);
+        free(blobs.buf);
+        free(first);
+    }
+
+    remove_vanished(out_dir, old);
+    manifest_save(out_dir, file_buf, meta);
+    manifest_free(old);
+    free(meta);
+}
+
+// pipelined packaging
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// With --pipeline the serial walk creates every package directory when it finds the first file in it and pushes the files
+// onto a bounded queue, where worker threads package them while the walk goes on. Only the queue holds materialized paths,
+// the file list itself stays in the compact path table for the manifest and code generation at the end.
+
+#define PIPELINE_QUEUE 4096
+#define PIPELINE_BATCH 64 // jobs handed over per wakeup, waking a worker for every file costs more than the copy
+#define PIPELINE_META_CHUNK 65536
+
+typedef struct pipeline_job_t pipeline_job_t;
+struct pipeline_job_t {
+    char* dest; // the source name follows in the same allocation
+    char* src;
+    file_meta_t* meta;
+};
+
+struct pipeline_t {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pipeline_job_t jobs[PIPELINE_QUEUE];
+    uint64_t head;
+    uint64_t tail;
+    bool closed;
+
+    char* out_dir;
+    copy_engine_t* engine;
+    manifest_t* old;
+    file_meta_t** meta; // chunks of PIPELINE_META_CHUNK, owned by the walk, which hands out pointers into them
+    uint64_t n_meta_chunks;
+    file_name_t src;
+    file_name_t dest;
+};
+
+// the directory is created before any of its files is queued, so the workers never find it missing
+void pipeline_dir(pipeline_t* pipe, name_buf_t* dir_buf, uint64_t dir)
+{
+    make_dir(nb_path(dir_buf, pipe->out_dir, dir, &pipe->dest));
+}
+
+void pipeline_push(pipeline_t* pipe, name_buf_t* file_buf, uint64_t file)
+{
+    if (file % PIPELINE_META_CHUNK == 0) {
+        pipe->meta = realloc(pipe->meta, (pipe->n_meta_chunks + 1) * sizeof(*pipe->meta));
+        panic_if(pipe->meta == NULL, "could not allocate manifest: %s", strerror(errno));
+        pipe->meta[pipe->n_meta_chunks] = malloc(PIPELINE_META_CHUNK * sizeof(**pipe->meta));
+        panic_if(pipe->meta[pipe->n_meta_chunks++] == NULL, "could not allocate manifest: %s", strerror(errno));
+    }
+    pipeline_job_t job;
+    char* dest = nb_path(file_buf, pipe->out_dir, file, &pipe->dest);
+    char* src = nb_path(file_buf, NULL, file, &pipe->src);
+    uint64_t dest_len = strlen(dest);
+    job.dest = malloc(dest_len + strlen(src) + 2);
+    panic_if(job.dest == NULL, "could not allocate pipeline job: %s", strerror(errno));
+    job.src = job.dest + dest_len + 1;
+    strcpy(job.dest, dest);
+    strcpy(job.src, src);
+    job.meta = &pipe->meta[file / PIPELINE_META_CHUNK][file % PIPELINE_META_CHUNK];
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->tail - pipe->head == PIPELINE_QUEUE) {
+        pthread_cond_wait(&pipe->not_full, &pipe->lock);
+    }
+    pipe->jobs[pipe->tail++ % PIPELINE_QUEUE] = job;
+    if ((pipe->tail - pipe->head) % PIPELINE_BATCH == 0) {
+        pthread_cond_signal(&pipe->not_empty);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void* pipeline_worker(void* arg)
+{
+    pipeline_t* pipe = arg;
+    pipeline_job_t jobs[PIPELINE_BATCH];
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->tail - pipe->head < PIPELINE_BATCH && !pipe->closed) {
+            pthread_cond_wait(&pipe->not_empty, &pipe->lock);
+        }
+        uint64_t n = pipe->tail - pipe->head;
+        if (n == 0) {
+            pthread_mutex_unlock(&pipe->lock);
+            return NULL;
+        }
+        n = n < PIPELINE_BATCH ? n : PIPELINE_BATCH;
+        uint64_t i;
+        for (i = 0; i < n; i++) {
+            jobs[i] = pipe->jobs[pipe->head++ % PIPELINE_QUEUE];
+        }
+        pthread_cond_signal(&pipe->not_full);
+        pthread_mutex_unlock(&pipe->lock);
+
+        for (i = 0; i < n; i++) {
+            file_at_t dest = { AT_FDCWD, jobs[i].dest, jobs[i].dest };
+            file_at_t src = { AT_FDCWD, jobs[i].src, jobs[i].src };
+            package_file(pipe->engine, NULL, pipe->old, jobs[i].meta, &dest, &src);
+            free(jobs[i].dest);
+        }
+    }
+}
+
+// walks the tree below dir_path and packages its files at the same time, the walk's part of out_structure and out_files
+void walk_and_package(char* out_dir, name_buf_t* file_buf, name_buf_t* dir_buf, uint32_t dir_path, copy_engine_t* engine,
+    uint64_t n_workers)
+{
+    make_dir(out_dir);
+    pipeline_t* pipe = calloc(1, sizeof(*pipe));
+    panic_if(pipe == NULL, "could not allocate pipeline: %s", strerror(errno));
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->not_empty, NULL);
+    pthread_cond_init(&pipe->not_full, NULL);
+    pipe->out_dir = out_dir;
+    pipe->engine = engine;
+    pipe->old = manifest_load(out_dir);
+    file_name_init(&pipe->src);
+    file_name_init(&pipe->dest);
+
+    pthread_t* workers = malloc(n_workers * sizeof(*workers));
+    panic_if(workers == NULL, "could not allocate pipeline: %s", strerror(errno));
+    uint64_t i;
+    for (i = 0; i < n_workers; i++) {
+        panic_if(pthread_create(&workers[i], NULL, pipeline_worker, pipe) != 0, "could not start copy thread");
+    }
+    push_all_files_in_directory(file_buf, dir_buf, dir_path, pipe);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->closed = 1;
+    pthread_cond_broadcast(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    file_meta_t* meta = malloc(file_buf->used * sizeof(*meta) + 1);
+    panic_if(meta == NULL, "could not allocate manifest: %s", strerror(errno));
+    for (i = 0; i < file_buf->used; i++) {
+        meta[i] = pipe->meta[i / PIPELINE_META_CHUNK][i % PIPELINE_META_CHUNK];
+    }
+    remove_vanished(out_dir, pipe->old);
+    manifest_save(out_dir, file_buf, meta);
+    free(meta);
+
+    manifest_free(pipe->old);
+    for (i = 0; i < pipe->n_meta_chunks; i++) {
+        free(pipe->meta[i]);
+    }
+    free(pipe->meta);
+    file_name_uninit(&pipe->src);
+    file_name_uninit(&pipe->dest);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->not_empty);
+    pthread_cond_destroy(&pipe->not_full);
+    free(pipe);
+    free(workers);
+}
+
+char static_instructions[] = "#include <dirent.h>\n"
+                             "#include <errno.h>\n"
+                             "#include <fcntl.h>\n"
+                             "#include <netdb.h>\n"
+                             "#include <netinet/in.h>\n"
+                             "#include <netinet/tcp.h>\n"
+                             "#include <spawn.h>\n"
+                             "#include <stdbool.h>\n"
+                             "#include <stdint.h>\n"
+                             "#include <stdio.h>\n"
+                             "#include <stdlib.h>\n"
+                             "#include <string.h>\n"
+                             "#include <sys/mman.h>\n"
+                             "#include <sys/socket.h>\n"
+                             "#include <sys/stat.h>\n"
+                             "#include <sys/types.h>\n"
+                             "#include <sys/un.h>\n"
+                             "#include <sys/wait.h>\n"
+                             "#include <time.h>\n"
+                             "#include <unistd.h>\n"
+                             "\n"
+                             "typedef struct job_t job_t;\n"
+                             "struct job_t {\n"
+                             "    char* src;\n"
+                             "    char* obj;\n"
+                             "    char* dep;\n"
+                             "    uint64_t part; // index in parts, the partial link of the directory of src\n"
+                             "};\n"
+                             "\n"
+                             "extern char** environ;\n"
+                             "\n"
+                             "pid_t start_command(char** args)\n"
+                             "{\n"
+                             "    pid_t pid;\n"
+                             "    int err = posix_spawnp(&pid, args[0], NULL, NULL, args, environ);\n"
+                             "    if (err != 0) {\n"
+                             "        fprintf(stderr, \"could not run %s: %s\\n\", args[0], strerror(err));\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    return pid;\n"
+                             "}\n"
+                             "\n"
+                             "// waits for any child, whose pid is stored in waited unless that is NULL, and returns its exit status, -1 if it was killed\n"
+                             "int wait_status(pid_t* waited)\n"
+                             "{\n"
+                             "    int status;\n"
+                             "    pid_t pid = wait(&status);\n"
+                             "    if (waited != NULL) {\n"
+                             "        *waited = pid;\n"
+                             "    }\n"
+                             "    if (pid < 0) {\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    if (WIFSIGNALED(status)) {\n"
+                             "        fprintf(stderr, \"command %d killed by signal %d\\n\", pid, WTERMSIG(status));\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;\n"
+                             "}\n"
+                             "\n"
+                             "bool wait_command(pid_t* waited)\n"
+                             "{\n"
+                             "    return wait_status(waited) == 0;\n"
+                             "}\n"
+                             "\n"
+                             "// argument vector that grows as arguments are pushed, always NULL terminated\n"
+                             "typedef struct args_t args_t;\n"
+                             "struct args_t {\n"
+                             "    char** buf;\n"
+                             "    uint64_t used;\n"
+                             "    uint64_t allocated;\n"
+                             "};\n"
+                             "\n"
+                             "void args_push(args_t* a, char* arg)\n"
+                             "{\n"
+                             "    if (a->used + 2 > a->allocated) {\n"
+                             "        a->allocated = a->allocated ? a->allocated << 1 : 16;\n"
+                             "        a->buf = realloc(a->buf, a->allocated * sizeof(*a->buf));\n"
+                             "    }\n"
+                             "    a->buf[a->used++] = arg;\n"
+                             "    a->buf[a->used] = NULL;\n"
+                             "}\n"
+                             "\n"
+                             "void args_push_all(args_t* a, char** args)\n"
+                             "{\n"
+                             "    for (; args != NULL && *args != NULL; args++) {\n"
+                             "        args_push(a, *args);\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "char* join_args(char** args)\n"
+                             "{\n"
+                             "    uint64_t len = 1;\n"
+                             "    char** arg;\n"
+                             "    for (arg = args; *arg != NULL; arg++) {\n"
+                             "        len += strlen(*arg) + 1;\n"
+                             "    }\n"
+                             "    char* s = calloc(1, len);\n"
+                             "    for (arg = args; *arg != NULL; arg++) {\n"
+                             "        strcat(s, *arg);\n"
+                             "        strcat(s, \"\\n\");\n"
+                             "    }\n"
+                             "    return s;\n"
+                             "}\n"
+                             "\n"
+                             "bool run_command(char** args)\n"
+                             "{\n"
+                             "    if (start_command(args) < 0) {\n"
+                             "        return 0;\n"
+                             "    }\n"
+                             "    return wait_command(NULL);\n"
+                             "}\n"
+                             "\n"
+                             "// monotonic seconds\n"
+                             "double now(void)\n"
+                             "{\n"
+                             "    struct timespec ts;\n"
+                             "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+                             "    return ts.tv_sec + ts.tv_nsec / 1e9;\n"
+                             "}\n"
+                             "\n"
+                             "#define TIMING_OFF 0 // -T, how compile times are reported\n"
+                             "#define TIMING_TEXT 1\n"
+                             "#define TIMING_JSON 2\n"
+                             "\n"
+                             "void fprint_json_string(FILE* f, char* s)\n"
+                             "{\n"
+                             "    fputc('\"', f);\n"
+                             "    for (; *s; s++) {\n"
+                             "        if (*s == '\"' || *s == '\\\\') {\n"
+                             "            fputc('\\\\', f);\n"
+                             "        }\n"
+                             "        if ((unsigned char)*s < 0x20) {\n"
+                             "            fprintf(f, \"\\\\u%04x\", *s);\n"
+                             "        } else {\n"
+                             "            fputc(*s, f);\n"
+                             "        }\n"
+                             "    }\n"
+                             "    fputc('\"', f);\n"
+                             "}\n"
+                             "\n"
+                             "// modification time in nanoseconds, -1 if the file does not exist\n"
+                             "int64_t mtime_of(char* path)\n"
+                             "{\n"
+                             "    struct stat st;\n"
+                             "    if (stat(path, &st) < 0) {\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;\n"
+                             "}\n"
+                             "\n"
+                             "char* read_file(char* path)\n"
+                             "{\n"
+                             "    FILE* f = fopen(path, \"r\");\n"
+                             "    if (f == NULL) {\n"
+                             "        return NULL;\n"
+                             "    }\n"
+                             "    fseek(f, 0, SEEK_END);\n"
+                             "    long len = ftell(f);\n"
+                             "    fseek(f, 0, SEEK_SET);\n"
+                             "    char* buf = malloc(len + 1);\n"
+                             "    if (fread(buf, 1, len, f) != (size_t)len) {\n"
+                             "        free(buf);\n"
+                             "        fclose(f);\n"
+                             "        return NULL;\n"
+                             "    }\n"
+                             "    buf[len] = 0;\n"
+                             "    fclose(f);\n"
+                             "    return buf;\n"
+                             "}\n"
+                             "\n"
+                             "// true if the depfile written by -MMD is missing or lists a prerequisite newer than t\n"
+                             "bool deps_newer(char* dep_file, int64_t t)\n"
+                             "{\n"
+                             "    char* deps = read_file(dep_file);\n"
+                             "    if (deps == NULL) {\n"
+                             "        return 1;\n"
+                             "    }\n"
+                             "    char* p = strchr(deps, ':');\n"
+                             "    if (p == NULL) {\n"
+                             "        free(deps);\n"
+                             "        return 1;\n"
+                             "    }\n"
+                             "    p++;\n"
+                             "    char* name = malloc(strlen(p) + 1);\n"
+                             "    bool newer = 0;\n"
+                             "    while (*p && !newer) {\n"
+                             "        while (*p == ' ' || *p == '\\t' || *p == '\\n' || (*p == '\\\\' && p[1] == '\\n')) {\n"
+                             "            p += *p == '\\\\' ? 2 : 1;\n"
+                             "        }\n"
+                             "        char* n = name;\n"
+                             "        while (*p && *p != ' ' && *p != '\\t' && *p != '\\n') {\n"
+                             "            if (*p == '\\\\' && (p[1] == ' ' || p[1] == '#')) {\n"
+                             "                p++;\n"
+                             "            } else if (*p == '$' && p[1] == '$') {\n"
+                             "                p++;\n"
+                             "            } else if (*p == '\\\\' && p[1] == '\\n') {\n"
+                             "                break;\n"
+                             "            }\n"
+                             "            *n++ = *p++;\n"
+                             "        }\n"
+                             "        *n = 0;\n"
+                             "        if (n != name) {\n"
+                             "            int64_t m = mtime_of(name);\n"
+                             "            newer = m < 0 || m > t;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    free(name);\n"
+                             "    free(deps);\n"
+                             "    return newer;\n"
+                             "}\n"
+                             "\n"
+                             "// rewrites stamp when its content differs, so that a flag change looks like a newer prerequisite\n"
+                             "void update_stamp(char* stamp, char* content)\n"
+                             "{\n"
+                             "    char* old = read_file(stamp);\n"
+                             "    if (old == NULL || strcmp(old, content) != 0) {\n"
+                             "        FILE* f = fopen(stamp, \"w\");\n"
+                             "        if (f != NULL) {\n"
+                             "            fputs(content, f);\n"
+                             "            fclose(f);\n"
+                             "        }\n"
+                             "    }\n"
+                             "    free(old);\n"
+                             "}\n"
+                             "\n"
+                             "bool needs_rebuild(job_t* job, int64_t stamp_time)\n"
+                             "{\n"
+                             "    int64_t obj_time = mtime_of(job->obj);\n"
+                             "    if (obj_time < 0 || stamp_time > obj_time) {\n"
+                             "        return 1;\n"
+                             "    }\n"
+                             "    int64_t src_time = mtime_of(job->src);\n"
+                             "    if (src_time < 0 || src_time > obj_time) {\n"
+                             "        return 1;\n"
+                             "    }\n"
+                             "    return deps_newer(job->dep, obj_time);\n"
+                             "}\n"
+                             "\n"
+                             "// object cache\n"
+                             "//--------------------------------------------------------------------------------------------------------------------------------\n"
+                             "\n"
+                             "// Objects are stored as dir/xx/<key>.o, keyed by a 128 bit hash of the preprocessed source, the compiler and the flags. Entries\n"
+                             "// are inserted through a temporary file and rename, so concurrent builds sharing dir never see a partial object, and a hit\n"
+                             "// touches its entry so that eviction drops the least recently used ones first.\n"
+                             "\n"
+                             "typedef struct cache_stats_t cache_stats_t;\n"
+                             "struct cache_stats_t {\n"
+                             "    uint64_t hits;\n"
+                             "    uint64_t misses;\n"
+                             "    uint64_t inserted;\n"
+                             "};\n"
+                             "\n"
+                             "typedef struct cache_t cache_t;\n"
+                             "struct cache_t {\n"
+                             "    char* dir;\n"
+                             "    uint64_t max_size;\n"
+                             "    cache_stats_t* stats; // shared with the processes that compile the jobs\n"
+                             "    unsigned char* hit; // per job, set by the process that restored its object from the cache, shared as well\n"
+                             "};\n"
+                             "\n"
+                             "typedef struct cache_key_t cache_key_t;\n"
+                             "struct cache_key_t {\n"
+                             "    uint64_t h[2];\n"
+                             "};\n"
+                             "\n"
+                             "// two differently seeded multiply-xorshift lanes over 8 byte words\n"
+                             "void key_update(cache_key_t* k, void* data, uint64_t len)\n"
+                             "{\n"
+                             "    static const uint64_t mul[2] = { 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full };\n"
+                             "    unsigned char* p = data;\n"
+                             "    int lane;\n"
+                             "    for (lane = 0; lane < 2; lane++) {\n"
+                             "        uint64_t h = k->h[lane] ^ (len + 1) * mul[lane];\n"
+                             "        uint64_t w;\n"
+                             "        uint64_t i;\n"
+                             "        for (i = 0; i + 8 <= len; i += 8) {\n"
+                             "            memcpy(&w, p + i, 8);\n"
+                             "            h = (h ^ w) * mul[lane];\n"
+                             "            h ^= h >> 32;\n"
+                             "        }\n"
+                             "        w = 0;\n"
+                             "        memcpy(&w, p + i, len - i);\n"
+                             "        h = (h ^ w) * mul[lane];\n"
+                             "        h ^= h >> 29;\n"
+                             "        k->h[lane] = h;\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "void key_string(cache_key_t* k, char* s)\n"
+                             "{\n"
+                             "    key_update(k, s, strlen(s));\n"
+                             "}\n"
+                             "\n"
+                             "// identifies the compiler by name and by size and mtime of the executable that PATH resolves it to\n"
+                             "void key_compiler(cache_key_t* k, char* compiler)\n"
+                             "{\n"
+                             "    key_string(k, compiler);\n"
+                             "    struct stat st;\n"
+                             "    bool found = strchr(compiler, '/') != NULL && stat(compiler, &st) == 0;\n"
+                             "    char* path = getenv(\"PATH\");\n"
+                             "    while (!found && path != NULL && *path != 0) {\n"
+                             "        uint64_t len = strcspn(path, \":\");\n"
+                             "        char* name = malloc(len + strlen(compiler) + 2);\n"
+                             "        sprintf(name, \"%.*s/%s\", (int)len, path, compiler);\n"
+                             "        found = access(name, X_OK) == 0 && stat(name, &st) == 0;\n"
+                             "        free(name);\n"
+                             "        path += path[len] == ':' ? len + 1 : len;\n"
+                             "    }\n"
+                             "    if (found) {\n"
+                             "        key_update(k, &st.st_size, sizeof(st.st_size));\n"
+                             "        key_update(k, &st.st_mtim, sizeof(st.st_mtim));\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "// runs args and collects their standard output into a malloced buffer, NULL if they fail\n"
+                             "char* capture_command(char** args, uint64_t* len)\n"
+                             "{\n"
+                             "    int fds[2];\n"
+                             "    if (pipe(fds) < 0) {\n"
+                             "        return NULL;\n"
+                             "    }\n"
+                             "    posix_spawn_file_actions_t actions;\n"
+                             "    posix_spawn_file_actions_init(&actions);\n"
+                             "    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);\n"
+                             "    posix_spawn_file_actions_addclose(&actions, fds[0]);\n"
+                             "    posix_spawn_file_actions_addclose(&actions, fds[1]);\n"
+                             "    pid_t pid;\n"
+                             "    int err = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);\n"
+                             "    posix_spawn_file_actions_destroy(&actions);\n"
+                             "    close(fds[1]);\n"
+                             "    if (err != 0) {\n"
+                             "        fprintf(stderr, \"could not run %s: %s\\n\", args[0], strerror(err));\n"
+                             "        close(fds[0]);\n"
+                             "        return NULL;\n"
+                             "    }\n"
+                             "    uint64_t allocated = 1 << 16;\n"
+                             "    char* buf = malloc(allocated);\n"
+                             "    *len = 0;\n"
+                             "    ssize_t n;\n"
+                             "    while ((n = read(fds[0], buf + *len, allocated - *len)) != 0) {\n"
+                             "        if (n < 0) {\n"
+                             "            if (errno == EINTR) {\n"
+                             "                continue;\n"
+                             "            }\n"
+                             "            break;\n"
+                             "        }\n"
+                             "        *len += n;\n"
+                             "        if (*len == allocated) {\n"
+                             "            allocated <<= 1;\n"
+                             "            buf = realloc(buf, allocated);\n"
+                             "        }\n"
+                             "    }\n"
+                             "    close(fds[0]);\n"
+                             "    if (!wait_command(NULL) || n < 0) {\n"
+                             "        free(buf);\n"
+                             "        return NULL;\n"
+                             "    }\n"
+                             "    return buf;\n"
+                             "}\n"
+                             "\n"
+                             "bool copy_path(char* from, char* to)\n"
+                             "{\n"
+                             "    int in = open(from, O_RDONLY);\n"
+                             "    if (in < 0) {\n"
+                             "        return 0;\n"
+                             "    }\n"
+                             "    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);\n"
+                             "    if (out < 0) {\n"
+                             "        close(in);\n"
+                             "        return 0;\n"
+                             "    }\n"
+                             "    char buf[1 << 16];\n"
+                             "    ssize_t n;\n"
+                             "    bool ok = 1;\n"
+                             "    while (ok && (n = read(in, buf, sizeof(buf))) != 0) {\n"
+                             "        ok = n > 0 && write(out, buf, n) == n;\n"
+                             "    }\n"
+                             "    close(in);\n"
+                             "    return close(out) == 0 && ok;\n"
+                             "}\n"
+                             "\n"
+                             "// the entry of key, creating its directory\n"
+                             "char* cache_entry(cache_t* c, cache_key_t* k)\n"
+                             "{\n"
+                             "    char* name = malloc(strlen(c->dir) + 64);\n"
+                             "    sprintf(name, \"%s/%02x\", c->dir, (unsigned)(k->h[0] >> 56));\n"
+                             "    mkdir(name, 0755);\n"
+                             "    sprintf(name + strlen(name), \"/%016llx%016llx.o\", (unsigned long long)k->h[0], (unsigned long long)k->h[1]);\n"
+                             "    return name;\n"
+                             "}\n"
+                             "\n"
+                             "// restores obj from the cache, false on a miss\n"
+                             "bool cache_get(char* entry, char* obj)\n"
+                             "{\n"
+                             "    if (access(entry, R_OK) != 0 || !copy_path(entry, obj)) {\n"
+                             "        return 0;\n"
+                             "    }\n"
+                             "    utimensat(AT_FDCWD, entry, NULL, 0);\n"
+                             "    return 1;\n"
+                             "}\n"
+                             "\n"
+                             "void cache_put(cache_t* c, char* entry, char* obj)\n"
+                             "{\n"
+                             "    char* tmp = malloc(strlen(entry) + 32);\n"
+                             "    sprintf(tmp, \"%s.%d.tmp\", entry, (int)getpid());\n"
+                             "    if (copy_path(obj, tmp) && rename(tmp, entry) == 0) {\n"
+                             "        __atomic_fetch_add(&c->stats->inserted, 1, __ATOMIC_RELAXED);\n"
+                             "    } else {\n"
+                             "        unlink(tmp);\n"
+                             "    }\n"
+                             "    free(tmp);\n"
+                             "}\n"
+                             "\n"
+                             "typedef struct cache_file_t cache_file_t;\n"
+                             "struct cache_file_t {\n"
+                             "    char* name;\n"
+                             "    int64_t mtime;\n"
+                             "    uint64_t size;\n"
+                             "};\n"
+                             "\n"
+                             "int cache_file_cmp(const void* a, const void* b)\n"
+                             "{\n"
+                             "    const cache_file_t* x = a;\n"
+                             "    const cache_file_t* y = b;\n"
+                             "    return (x->mtime > y->mtime) - (x->mtime < y->mtime);\n"
+                             "}\n"
+                             "\n"
+                             "// removes the least recently used entries until the cache holds at most 90% of max_size\n"
+                             "void cache_evict(cache_t* c)\n"
+                             "{\n"
+                             "    cache_file_t* files = NULL;\n"
+                             "    uint64_t n_files = 0;\n"
+                             "    uint64_t allocated = 0;\n"
+                             "    uint64_t total = 0;\n"
+                             "    DIR* top = opendir(c->dir);\n"
+                             "    if (top == NULL) {\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    struct dirent* d;\n"
+                             "    while ((d = readdir(top)) != NULL) {\n"
+                             "        if (d->d_name[0] == '.') {\n"
+                             "            continue;\n"
+                             "        }\n"
+                             "        char* sub_name = malloc(strlen(c->dir) + strlen(d->d_name) + 2);\n"
+                             "        sprintf(sub_name, \"%s/%s\", c->dir, d->d_name);\n"
+                             "        DIR* sub = opendir(sub_name);\n"
+                             "        struct dirent* e;\n"
+                             "        while (sub != NULL && (e = readdir(sub)) != NULL) {\n"
+                             "            struct stat st;\n"
+                             "            if (e->d_name[0] == '.' || fstatat(dirfd(sub), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {\n"
+                             "                continue;\n"
+                             "            }\n"
+                             "            if (n_files == allocated) {\n"
+                             "                allocated = allocated ? allocated << 1 : 256;\n"
+                             "                files = realloc(files, allocated * sizeof(*files));\n"
+                             "            }\n"
+                             "            files[n_files].name = malloc(strlen(sub_name) + strlen(e->d_name) + 2);\n"
+                             "            sprintf(files[n_files].name, \"%s/%s\", sub_name, e->d_name);\n"
+                             "            files[n_files].mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;\n"
+                             "            files[n_files].size = st.st_size;\n"
+                             "            total += st.st_size;\n"
+                             "            n_files++;\n"
+                             "        }\n"
+                             "        if (sub != NULL) {\n"
+                             "            closedir(sub);\n"
+                             "        }\n"
+                             "        free(sub_name);\n"
+                             "    }\n"
+                             "    closedir(top);\n"
+                             "    if (total > c->max_size) {\n"
+                             "        qsort(files, n_files, sizeof(*files), cache_file_cmp);\n"
+                             "        uint64_t i;\n"
+                             "        for (i = 0; i < n_files && total > c->max_size / 10 * 9; i++) {\n"
+                             "            if (unlink(files[i].name) == 0) {\n"
+                             "                total -= files[i].size;\n"
+                             "            }\n"
+                             "        }\n"
+                             "    }\n"
+                             "    uint64_t i;\n"
+                             "    for (i = 0; i < n_files; i++) {\n"
+                             "        free(files[i].name);\n"
+                             "    }\n"
+                             "    free(files);\n"
+                             "}\n"
+                             "\n"
+                             "// compile workers\n"
+                             "//--------------------------------------------------------------------------------------------------------------------------------\n"
+                             "\n"
+                             "// -w ADDRESS hands units to a worker started with pp --serve=ADDRESS, on unix:PATH or tcp:HOST:PORT. The unit is preprocessed\n"
+                             "// here, which also writes the depfile, the worker compiles it and sends back the object. Every request is one connection\n"
+                             "// carrying a frame, a worker_frame_t header and size bytes of payload: HELLO is answered with the number of compile slots\n"
+                             "// in status. JOB holds the length of the NUL separated compiler and flags as 8 bytes, them and the preprocessed source, and\n"
+                             "// is answered with a RESULT (the exit status, a worker_result_t, the object and the compiler output), BUSY when the queue\n"
+                             "// of the worker is full or REFUSED with the reason. A unit that was not compiled remotely is compiled here.\n"
+                             "\n"
+                             "#define WORKER_MAGIC \"PPWORK1\"\n"
+                             "#define WORKER_HELLO 1\n"
+                             "#define WORKER_JOB 2\n"
+                             "#define WORKER_RESULT 3\n"
+                             "#define WORKER_BUSY 4\n"
+                             "#define WORKER_REFUSED 5\n"
+                             "#define WORKER_TIMEOUT 5 // seconds to connect and to answer a HELLO\n"
+                             "\n"
+                             "#define REMOTE_FALLBACK 75 // exit status of a job whose worker did not compile it\n"
+                             "\n"
+                             "typedef struct worker_frame_t worker_frame_t;\n"
+                             "struct worker_frame_t {\n"
+                             "    char magic[8];\n"
+                             "    uint32_t type;\n"
+                             "    uint32_t status;\n"
+                             "    uint64_t size;\n"
+                             "};\n"
+                             "\n"
+                             "typedef struct worker_result_t worker_result_t;\n"
+                             "struct worker_result_t {\n"
+                             "    uint64_t queue_nanoseconds; // from accepting the job to starting its compile\n"
+                             "    uint64_t compile_nanoseconds;\n"
+                             "    uint64_t obj_size;\n"
+                             "    uint64_t log_size;\n"
+                             "};\n"
+                             "\n"
+                             "typedef struct worker_t worker_t;\n"
+                             "struct worker_t {\n"
+                             "    char* address;\n"
+                             "    long slots; // offered by the worker, one less every time it was busy\n"
+                             "    long running;\n"
+                             "    bool down;\n"
+                             "    uint64_t compiled;\n"
+                             "    uint64_t busy;\n"
+                             "    uint64_t sent;\n"
+                             "    uint64_t received;\n"
+                             "    double queue_seconds;\n"
+                             "    double max_queue_seconds;\n"
+                             "    double compile_seconds;\n"
+                             "    double round_trip_seconds;\n"
+                             "};\n"
+                             "\n"
+                             "// what the job of a unit sent to a worker found out, in memory shared with the driver\n"
+                             "typedef struct remote_t remote_t;\n"
+                             "struct remote_t {\n"
+                             "    int outcome;\n"
+                             "    uint64_t sent;\n"
+                             "    uint64_t received;\n"
+                             "    double queue_seconds;\n"
+                             "    double compile_seconds;\n"
+                             "    double round_trip_seconds;\n"
+                             "};\n"
+                             "\n"
+                             "#define REMOTE_COMPILED 0 // with or without errors\n"
+                             "#define REMOTE_BUSY 1\n"
+                             "#define REMOTE_UNREACHABLE 2\n"
+                             "#define REMOTE_REFUSED 3\n"
+                             "\n"
+                             "bool send_all(int fd, void* buf, uint64_t len)\n"
+                             "{\n"
+                             "    char* p = buf;\n"
+                             "    while (len > 0) {\n"
+                             "        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);\n"
+                             "        if (n < 0 && errno == EINTR) {\n"
+                             "            continue;\n"
+                             "        }\n"
+                             "        if (n <= 0) {\n"
+                             "            return 0;\n"
+                             "        }\n"
+                             "        p += n;\n"
+                             "        len -= n;\n"
+                             "    }\n"
+                             "    return 1;\n"
+                             "}\n"
+                             "\n"
+                             "bool recv_all(int fd, void* buf, uint64_t len)\n"
+                             "{\n"
+                             "    char* p = buf;\n"
+                             "    while (len > 0) {\n"
+                             "        ssize_t n = recv(fd, p, len, 0);\n"
+                             "        if (n < 0 && errno == EINTR) {\n"
+                             "            continue;\n"
+                             "        }\n"
+                             "        if (n <= 0) {\n"
+                             "            return 0;\n"
+                             "        }\n"
+                             "        p += n;\n"
+                             "        len -= n;\n"
+                             "    }\n"
+                             "    return 1;\n"
+                             "}\n"
+                             "\n"
+                             "// connects to unix:PATH or tcp:HOST:PORT within WORKER_TIMEOUT, -1 if that fails\n"
+                             "int worker_connect(char* address)\n"
+                             "{\n"
+                             "    struct timeval timeout = { WORKER_TIMEOUT, 0 };\n"
+                             "    int fd = -1;\n"
+                             "    if (strncmp(address, \"unix:\", 5) == 0) {\n"
+                             "        struct sockaddr_un sa = { .sun_family = AF_UNIX };\n"
+                             "        if (strlen(address + 5) >= sizeof(sa.sun_path)) {\n"
+                             "            return -1;\n"
+                             "        }\n"
+                             "        strcpy(sa.sun_path, address + 5);\n"
+                             "        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);\n"
+                             "        if (fd >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {\n"
+                             "            close(fd);\n"
+                             "            fd = -1;\n"
+                             "        }\n"
+                             "        return fd;\n"
+                             "    }\n"
+                             "    if (strncmp(address, \"tcp:\", 4) != 0 || strrchr(address, ':') == address + 3) {\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    char* host = strdup(address + 4);\n"
+                             "    char* port = strrchr(host, ':');\n"
+                             "    *port++ = 0;\n"
+                             "    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };\n"
+                             "    struct addrinfo* ai;\n"
+                             "    struct addrinfo* a;\n"
+                             "    // no host is the loopback address, where pp --serve=tcp::PORT listens\n"
+                             "    if (getaddrinfo(*host ? host : NULL, port, &hints, &ai) != 0) {\n"
+                             "        free(host);\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    for (a = ai; a != NULL && fd < 0; a = a->ai_next) {\n"
+                             "        fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);\n"
+                             "        // a send timeout also bounds connect\n"
+                             "        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));\n"
+                             "        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {\n"
+                             "            close(fd);\n"
+                             "            fd = -1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    freeaddrinfo(ai);\n"
+                             "    free(host);\n"
+                             "    if (fd >= 0) {\n"
+                             "        int one = 1;\n"
+                             "        struct timeval none = { 0, 0 };\n"
+                             "        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));\n"
+                             "        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));\n"
+                             "    }\n"
+                             "    return fd;\n"
+                             "}\n"
+                             "\n"
+                             "// the number of compile slots the worker at address offers, -1 if it does not answer\n"
+                             "long worker_hello(char* address)\n"
+                             "{\n"
+                             "    int fd = worker_connect(address);\n"
+                             "    if (fd < 0) {\n"
+                             "        return -1;\n"
+                             "    }\n"
+                             "    struct timeval timeout = { WORKER_TIMEOUT, 0 };\n"
+                             "    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));\n"
+                             "    worker_frame_t f = { WORKER_MAGIC, WORKER_HELLO, 0, 0 };\n"
+                             "    bool ok = send_all(fd, &f, sizeof(f)) && recv_all(fd, &f, sizeof(f)) && memcmp(f.magic, WORKER_MAGIC, sizeof(f.magic)) == 0\n"
+                             "        && f.type == WORKER_HELLO;\n"
+                             "    close(fd);\n"
+                             "    return ok ? (long)f.status : -1;\n"
+                             "}\n"
+                             "\n"
+                             "// asks every worker for its slots, forgetting what earlier builds counted\n"
+                             "void workers_probe(worker_t* workers, uint64_t n)\n"
+                             "{\n"
+                             "    worker_t* w;\n"
+                             "    for (w = workers; w != workers + n; w++) {\n"
+                             "        *w = (worker_t) { .address = w->address, .slots = worker_hello(w->address) };\n"
+                             "        if (w->slots < 1) {\n"
+                             "            fprintf(stderr, \"worker %s is unreachable, compiling its units here\\n\", w->address);\n"
+                             "            w->slots = 0;\n"
+                             "            w->down = 1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "// Compiles the preprocessed source on the worker at address with the compiler and flags in args, without the -include of\n"
+                             "// the precompiled header, whose content the source already has. Writes obj and the compiler output to stderr, and returns\n"
+                             "// the exit status of the compiler or REMOTE_FALLBACK.\n"
+                             "int remote_compile(char* address, char** args, char* source, uint64_t len, char* obj, remote_t* r)\n"
+                             "{\n"
+                             "    double start = now();\n"
+                             "    uint64_t args_size = 0;\n"
+                             "    char** arg;\n"
+                             "    for (arg = args; *arg != NULL; arg++) {\n"
+                             "        if (strcmp(*arg, \"-include\") == 0 && arg[1] != NULL) {\n"
+                             "            arg++;\n"
+                             "        } else {\n"
+                             "            args_size += strlen(*arg) + 1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    char* request = malloc(sizeof(worker_frame_t) + sizeof(args_size) + args_size);\n"
+                             "    char* p = request + sizeof(worker_frame_t) + sizeof(args_size);\n"
+                             "    for (arg = args; *arg != NULL; arg++) {\n"
+                             "        if (strcmp(*arg, \"-include\") == 0 && arg[1] != NULL) {\n"
+                             "            arg++;\n"
+                             "        } else {\n"
+                             "            p = stpcpy(p, *arg) + 1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    worker_frame_t f = { WORKER_MAGIC, WORKER_JOB, 0, sizeof(args_size) + args_size + len };\n"
+                             "    memcpy(request, &f, sizeof(f));\n"
+                             "    memcpy(request + sizeof(f), &args_size, sizeof(args_size));\n"
+                             "\n"
+                             "    int fd = worker_connect(address);\n"
+                             "    if (fd < 0) {\n"
+                             "        free(request);\n"
+                             "        r->outcome = REMOTE_UNREACHABLE;\n"
+                             "        return REMOTE_FALLBACK;\n"
+                             "    }\n"
+                             "    // a busy worker answers before reading the request, so its answer is looked for even if sending failed\n"
+                             "    bool sent = send_all(fd, request, p - request) && send_all(fd, source, len);\n"
+                             "    free(request);\n"
+                             "    r->sent = sent ? sizeof(f) + f.size : 0;\n"
+                             "    worker_result_t result;\n"
+                             "    if (!recv_all(fd, &f, sizeof(f)) || memcmp(f.magic, WORKER_MAGIC, sizeof(f.magic)) != 0 || f.type == WORKER_BUSY\n"
+                             "        || (f.type == WORKER_RESULT && (!sent || f.size < sizeof(result)))) {\n"
+                             "        close(fd);\n"
+                             "        r->outcome = REMOTE_BUSY;\n"
+                             "        return REMOTE_FALLBACK;\n"
+                             "    }\n"
+                             "    char* payload = malloc(f.size + 1);\n"
+                             "    if (payload == NULL || !recv_all(fd, payload, f.size)) {\n"
+                             "        close(fd);\n"
+                             "        free(payload);\n"
+                             "        r->outcome = REMOTE_BUSY;\n"
+                             "        return REMOTE_FALLBACK;\n"
+                             "    }\n"
+                             "    close(fd);\n"
+                             "    r->received = sizeof(f) + f.size;\n"
+                             "    if (f.type != WORKER_RESULT) {\n"
+                             "        fprintf(stderr, \"worker %s refused %s: %.*s\\n\", address, obj, (int)f.size, payload);\n"
+                             "        free(payload);\n"
+                             "        r->outcome = REMOTE_REFUSED;\n"
+                             "        return REMOTE_FALLBACK;\n"
+                             "    }\n"
+                             "    memcpy(&result, payload, sizeof(result));\n"
+                             "    int status = f.status;\n"
+                             "    if (sizeof(result) + result.obj_size + result.log_size != f.size) {\n"
+                             "        fprintf(stderr, \"worker %s sent a malformed result for %s\\n\", address, obj);\n"
+                             "        status = 1;\n"
+                             "    } else {\n"
+                             "        fwrite(payload + sizeof(result) + result.obj_size, 1, result.log_size, stderr);\n"
+                             "        int out = open(obj, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);\n"
+                             "        bool written = out >= 0 && write(out, payload + sizeof(result), result.obj_size) == (ssize_t)result.obj_size;\n"
+                             "        if ((out >= 0 && close(out) != 0) || (!written && status == 0)) {\n"
+                             "            fprintf(stderr, \"could not write %s: %s\\n\", obj, strerror(errno));\n"
+                             "            status = 1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    free(payload);\n"
+                             "    r->outcome = REMOTE_COMPILED;\n"
+                             "    r->queue_seconds = result.queue_nanoseconds / 1e9;\n"
+                             "    r->compile_seconds = result.compile_nanoseconds / 1e9;\n"
+                             "    r->round_trip_seconds = now() - start;\n"
+                             "    return status;\n"
+                             "}\n"
+                             "\n"
+                             "// counts the job that compiled a unit on w, or gives w up after it was unreachable or refused one\n"
+                             "void worker_account(worker_t* w, remote_t* r)\n"
+                             "{\n"
+                             "    w->running--;\n"
+                             "    if (r->outcome == REMOTE_BUSY) {\n"
+                             "        w->busy++;\n"
+                             "        w->slots -= w->slots > 0;\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    if (r->outcome != REMOTE_COMPILED) {\n"
+                             "        if (!w->down) {\n"
+                             "            fprintf(stderr, \"worker %s %s, compiling its units here\\n\", w->address,\n"
+                             "                    r->outcome == REMOTE_REFUSED ? \"refused a unit\" : \"is unreachable\");\n"
+                             "        }\n"
+                             "        w->down = 1;\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    w->compiled++;\n"
+                             "    w->sent += r->sent;\n"
+                             "    w->received += r->received;\n"
+                             "    w->queue_seconds += r->queue_seconds;\n"
+                             "    w->max_queue_seconds = r->queue_seconds > w->max_queue_seconds ? r->queue_seconds : w->max_queue_seconds;\n"
+                             "    w->compile_seconds += r->compile_seconds;\n"
+                             "    w->round_trip_seconds += r->round_trip_seconds;\n"
+                             "}\n"
+                             "\n"
+                             "// the reachable worker with the most free slots relative to its size, NULL if all are full\n"
+                             "worker_t* worker_pick(worker_t* workers, uint64_t n)\n"
+                             "{\n"
+                             "    worker_t* best = NULL;\n"
+                             "    worker_t* w;\n"
+                             "    for (w = workers; w != workers + n; w++) {\n"
+                             "        if (!w->down && w->running < w->slots\n"
+                             "            && (best == NULL || (double)w->running / w->slots < (double)best->running / best->slots)) {\n"
+                             "            best = w;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    return best;\n"
+                             "}\n"
+                             "\n"
+                             "// throughput over the makespan of the compiles, and the time units spent waiting in the queue of every worker\n"
+                             "void worker_report(FILE* f, worker_t* workers, uint64_t n, double makespan, int format)\n"
+                             "{\n"
+                             "    worker_t* w;\n"
+                             "    for (w = workers; w != workers + n; w++) {\n"
+                             "        double per_unit = w->compiled > 0 ? 1.0 / w->compiled : 0;\n"
+                             "        double rate = makespan > 0 ? w->compiled / makespan : 0;\n"
+                             "        double transfer = (w->round_trip_seconds - w->compile_seconds - w->queue_seconds) * per_unit;\n"
+                             "        if (format == TIMING_JSON) {\n"
+                             "            fprintf(f, \"%s\\n    { \\\"address\\\": \", w == workers ? \"\" : \",\");\n"
+                             "            fprint_json_string(f, w->address);\n"
+                             "            fprintf(f,\n"
+                             "                    \", \\\"down\\\": %s, \\\"compiled\\\": %llu, \\\"busy\\\": %llu, \\\"units_per_second\\\": %.6f, \\\"bytes_sent\\\": %llu, \"\n"
+                             "                    \"\\\"bytes_received\\\": %llu, \\\"compile_seconds\\\": %.6f, \\\"mean_queue_seconds\\\": %.6f, \\\"max_queue_seconds\\\": %.6f, \"\n"
+                             "                    \"\\\"mean_transfer_seconds\\\": %.6f }\",\n"
+                             "                    w->down ? \"true\" : \"false\", (unsigned long long)w->compiled, (unsigned long long)w->busy, rate,\n"
+                             "                    (unsigned long long)w->sent, (unsigned long long)w->received, w->compile_seconds,\n"
+                             "                    w->queue_seconds * per_unit, w->max_queue_seconds, transfer);\n"
+                             "            continue;\n"
+                             "        }\n"
+                             "        fprintf(f, \"worker %s%s: %llu units, %.2f units/s, %.1f MB sent, %.1f MB received, %.3fs compiling, %.3fs queued \"\n"
+                             "                   \"(%.3fs at most) and %.3fs transferring per unit, busy %llu times\\n\",\n"
+                             "                w->address, w->down ? \" (down)\" : \"\", (unsigned long long)w->compiled, rate, w->sent / 1e6, w->received / 1e6,\n"
+                             "                w->compile_seconds * per_unit, w->queue_seconds * per_unit, w->max_queue_seconds, transfer,\n"
+                             "                (unsigned long long)w->busy);\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "// compile times\n"
+                             "//--------------------------------------------------------------------------------------------------------------------------------\n"
+                             "\n"
+                             "typedef struct timing_t timing_t;\n"
+                             "struct timing_t {\n"
+                             "    job_t* job;\n"
+                             "    pid_t pid; // 0 once the job finished\n"
+                             "    double start;\n"
+                             "    double seconds;\n"
+                             "};\n"
+                             "\n"
+                             "// the job that runs as pid, jobs still running are at the end of timings\n"
+                             "timing_t* timing_find(timing_t* timings, uint64_t n, pid_t pid)\n"
+                             "{\n"
+                             "    timing_t* t;\n"
+                             "    for (t = timings + n; t != timings; t--) {\n"
+                             "        if (t[-1].pid == pid) {\n"
+                             "            return t - 1;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    return NULL;\n"
+                             "}\n"
+                             "\n"
+                             "void timing_finish(timing_t* t, int format)\n"
+                             "{\n"
+                             "    t->pid = 0;\n"
+                             "    t->seconds = now() - t->start;\n"
+                             "    if (format == TIMING_TEXT) {\n"
+                             "        printf(\"compiled: %s (%.3fs)\\n\", t->job->src, t->seconds);\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "int timing_cmp(const void* a, const void* b)\n"
+                             "{\n"
+                             "    const timing_t* x = a;\n"
+                             "    const timing_t* y = b;\n"
+                             "    return (x->seconds < y->seconds) - (x->seconds > y->seconds);\n"
+                             "}\n"
+                             "\n"
+                             "// the slowest units as text, or every unit and every worker as JSON, slowest first. status is \"ok\" or why the build failed.\n"
+                             "void timing_report(FILE* f, timing_t* timings, uint64_t n, int format, double makespan, double predicted, double link_seconds,\n"
+                             "                   double total_seconds, char* status, worker_t* workers, uint64_t n_workers)\n"
+                             "{\n"
+                             "    qsort(timings, n, sizeof(*timings), timing_cmp);\n"
+                             "    uint64_t i;\n"
+                             "    if (format == TIMING_TEXT) {\n"
+                             "        if (n > 0) {\n"
+                             "            fprintf(f, \"slowest translation units:\\n\");\n"
+                             "        }\n"
+                             "        for (i = 0; i < n && i < 10; i++) {\n"
+                             "            fprintf(f, \"  %8.3fs %s\\n\", timings[i].seconds, timings[i].job->src);\n"
+                             "        }\n"
+                             "        if (strcmp(status, \"ok\") != 0) {\n"
+                             "            fprintf(f, \"compiled %llu translation units, %s after %.3fs\\n\", (unsigned long long)n, status, total_seconds);\n"
+                             "            return;\n"
+                             "        }\n"
+                             "        fprintf(f, \"compiled %llu translation units, linked in %.3fs, %.3fs in total\\n\", (unsigned long long)n, link_seconds,\n"
+                             "                total_seconds);\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    fprintf(f, \"{\\n  \\\"status\\\": \\\"%s\\\",\\n  \\\"compiled\\\": %llu,\\n  \\\"makespan_seconds\\\": %.6f,\\n  \\\"predicted_makespan_seconds\\\": \",\n"
+                             "            status, (unsigned long long)n, makespan);\n"
+                             "    if (predicted < 0) {\n"
+                             "        fprintf(f, \"null\");\n"
+                             "    } else {\n"
+                             "        fprintf(f, \"%.6f\", predicted);\n"
+                             "    }\n"
+                             "    fprintf(f, \",\\n  \\\"link_seconds\\\": %.6f,\\n  \\\"total_seconds\\\": %.6f,\\n  \\\"units\\\": [\", link_seconds, total_seconds);\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        fprintf(f, \"%s\\n    { \\\"src\\\": \", i ? \",\" : \"\");\n"
+                             "        fprint_json_string(f, timings[i].job->src);\n"
+                             "        fprintf(f, \", \\\"seconds\\\": %.6f }\", timings[i].seconds);\n"
+                             "    }\n"
+                             "    fprintf(f, \"%s]\", n ? \"\\n  \" : \"\");\n"
+                             "    if (n_workers > 0) {\n"
+                             "        fprintf(f, \",\\n  \\\"workers\\\": [\");\n"
+                             "        worker_report(f, workers, n_workers, makespan, TIMING_JSON);\n"
+                             "        fprintf(f, \"\\n  ]\");\n"
+                             "    }\n"
+                             "    fprintf(f, \"\\n}\\n\");\n"
+                             "}\n"
+                             "\n"
+                             "// scheduling\n"
+                             "//--------------------------------------------------------------------------------------------------------------------------------\n"
+                             "\n"
+                             "// .pp_timings keeps how long the last compile of every unit took, one \"seconds path\" line each. Units are started longest\n"
+                             "// first: they only depend on each other through the link, so the longest one is the critical path and has to start right\n"
+                             "// away. Units without a recorded time are estimated from their size at the average rate of the known ones.\n"
+                             "\n"
+                             "#define TIMINGS_NAME \".pp_timings\"\n"
+                             "\n"
+                             "typedef struct sched_t sched_t;\n"
+                             "struct sched_t {\n"
+                             "    job_t* job;\n"
+                             "    uint64_t index; // in jobs, breaks ties so that equal costs keep the generated order\n"
+                             "    double cost; // predicted seconds\n"
+                             "};\n"
+                             "\n"
+                             "int job_src_cmp(const void* a, const void* b)\n"
+                             "{\n"
+                             "    return strcmp((*(job_t* const*)a)->src, (*(job_t* const*)b)->src);\n"
+                             "}\n"
+                             "\n"
+                             "// fills seconds[i] with the recorded time of jobs[i], or -1\n"
+                             "void timings_load(job_t* jobs, uint64_t n, double* seconds)\n"
+                             "{\n"
+                             "    uint64_t i;\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        seconds[i] = -1;\n"
+                             "    }\n"
+                             "    FILE* f = fopen(TIMINGS_NAME, \"r\");\n"
+                             "    if (f == NULL) {\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    job_t** by_src = malloc((n + 1) * sizeof(*by_src));\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        by_src[i] = &jobs[i];\n"
+                             "    }\n"
+                             "    qsort(by_src, n, sizeof(*by_src), job_src_cmp);\n"
+                             "    char* line = NULL;\n"
+                             "    size_t line_len = 0;\n"
+                             "    ssize_t len;\n"
+                             "    while ((len = getline(&line, &line_len, f)) > 0) {\n"
+                             "        if (line[len - 1] == '\\n') {\n"
+                             "            line[len - 1] = 0;\n"
+                             "        }\n"
+                             "        double s;\n"
+                             "        int path_start;\n"
+                             "        if (sscanf(line, \"%lf %n\", &s, &path_start) != 1) {\n"
+                             "            continue;\n"
+                             "        }\n"
+                             "        job_t key = { .src = line + path_start };\n"
+                             "        job_t* k = &key;\n"
+                             "        job_t** found = bsearch(&k, by_src, n, sizeof(*by_src), job_src_cmp);\n"
+                             "        if (found != NULL) {\n"
+                             "            seconds[*found - jobs] = s;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    free(line);\n"
+                             "    free(by_src);\n"
+                             "    fclose(f);\n"
+                             "}\n"
+                             "\n"
+                             "void timings_save(job_t* jobs, uint64_t n, double* seconds)\n"
+                             "{\n"
+                             "    FILE* f = fopen(TIMINGS_NAME \".tmp\", \"w\");\n"
+                             "    if (f == NULL) {\n"
+                             "        return;\n"
+                             "    }\n"
+                             "    uint64_t i;\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        if (seconds[i] >= 0) {\n"
+                             "            fprintf(f, \"%.6f %s\\n\", seconds[i], jobs[i].src);\n"
+                             "        }\n"
+                             "    }\n"
+                             "    if (fclose(f) != 0 || rename(TIMINGS_NAME \".tmp\", TIMINGS_NAME) != 0) {\n"
+                             "        unlink(TIMINGS_NAME \".tmp\");\n"
+                             "    }\n"
+                             "}\n"
+                             "\n"
+                             "// predicted seconds of every scheduled job, from its recorded time or its size, false if no time was recorded at all\n"
+                             "bool estimate_costs(sched_t* sched, uint64_t n, double* seconds)\n"
+                             "{\n"
+                             "    double known_seconds = 0;\n"
+                             "    double known_bytes = 0;\n"
+                             "    uint64_t i;\n"
+                             "    struct stat st;\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        if (seconds[sched[i].index] >= 0 && stat(sched[i].job->src, &st) == 0) {\n"
+                             "            known_seconds += seconds[sched[i].index];\n"
+                             "            known_bytes += st.st_size;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    // without any history only the order matters\n"
+                             "    double rate = known_bytes > 0 ? known_seconds / known_bytes : 1e-6;\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        if (seconds[sched[i].index] >= 0) {\n"
+                             "            sched[i].cost = seconds[sched[i].index];\n"
+                             "        } else {\n"
+                             "            sched[i].cost = stat(sched[i].job->src, &st) == 0 ? st.st_size * rate : 0;\n"
+                             "        }\n"
+                             "    }\n"
+                             "    return known_bytes > 0;\n"
+                             "}\n"
+                             "\n"
+                             "int sched_cmp(const void* a, const void* b)\n"
+                             "{\n"
+                             "    const sched_t* x = a;\n"
+                             "    const sched_t* y = b;\n"
+                             "    if (x->cost != y->cost) {\n"
+                             "        return (x->cost < y->cost) - (x->cost > y->cost);\n"
+                             "    }\n"
+                             "    return (x->index > y->index) - (x->index < y->index);\n"
+                             "}\n"
+                             "\n"
+                             "// makespan of running sched in order on slots parallel jobs, each starting on the slot that frees up first\n"
+                             "double predict_makespan(sched_t* sched, uint64_t n, long slots)\n"
+                             "{\n"
+                             "    double* busy = calloc(slots, sizeof(*busy));\n"
+                             "    double makespan = 0;\n"
+                             "    uint64_t i;\n"
+                             "    for (i = 0; i < n; i++) {\n"
+                             "        long s;\n"
+                             "        long first = 0;\n"
+                             "        for (s = 1; s < slots; s++) {\n"
+                             "            if (busy[s] < busy[first]) {\n"
+                             "                first = s;\n"
+                             "            }\n"
+                             "        }\n"
+                             "        busy[first] += sched[i].cost;\n"
+                             "        if (busy[first] > makespan) {\n"
+                             "            makespan = busy[first];\n"
+                             "        }\n"
+                             "    }\n"
+                             "    free(busy);\n"
+                             "    return makespan;\n"
+                             "}\n";
+
+char static_main[] = "\n"
+                     "// Builds the precompiled header header.gch next to header, the pch of the package. A compiler that cannot do it leaves\n"
+                     "// header.failed behind, which keeps later runs from retrying until the flags or header change, and every translation unit is\n"
+                     "// compiled without it.\n"
+                     "bool build_pch(char* header, char* compiler, char** extra, int64_t stamp_time)\n"
+                     "{\n"
+                     "    char* gch = malloc(strlen(header) + 8);\n"
+                     "    char* dep = malloc(strlen(header) + 8);\n"
+                     "    char* failed = malloc(strlen(header) + 8);\n"
+                     "    sprintf(gch, \"%s.gch\", header);\n"
+                     "    sprintf(dep, \"%s.d\", header);\n"
+                     "    sprintf(failed, \"%s.failed\", header);\n"
+                     "    job_t job = { .src = header, .obj = gch, .dep = dep };\n"
+                     "    bool ok = 1;\n"
+                     "    int64_t failed_time = mtime_of(failed);\n"
+                     "    if (failed_time >= 0 && failed_time >= stamp_time && failed_time >= mtime_of(header)) {\n"
+                     "        ok = 0;\n"
+                     "    } else if (needs_rebuild(&job, stamp_time)) {\n"
+                     "        printf(\"precompiling: %s\\n\", header);\n"
+                     "        fflush(stdout);\n"
+                     "        args_t args = { 0 };\n"
+                     "        args_push(&args, compiler);\n"
+                     "        args_push(&args, \"-x\");\n"
+                     "        args_push(&args, \"c-header\");\n"
+                     "        args_push_all(&args, flags);\n"
+                     "        args_push_all(&args, extra);\n"
+                     "        args_push(&args, \"-MMD\");\n"
+                     "        args_push(&args, \"-MF\");\n"
+                     "        args_push(&args, dep);\n"
+                     "        args_push(&args, header);\n"
+                     "        args_push(&args, \"-o\");\n"
+                     "        args_push(&args, gch);\n"
+                     "        ok = run_command(args.buf);\n"
+                     "        free(args.buf);\n"
+                     "        if (!ok) {\n"
+                     "            fprintf(stderr, \"could not precompile %s, compiling without it\\n\", header);\n"
+                     "            unlink(gch);\n"
+                     "            FILE* f = fopen(failed, \"w\");\n"
+                     "            if (f != NULL) {\n"
+                     "                fclose(f);\n"
+                     "            }\n"
+                     "        }\n"
+                     "    }\n"
+                     "    if (ok) {\n"
+                     "        unlink(failed);\n"
+                     "    }\n"
+                     "    free(gch);\n"
+                     "    free(dep);\n"
+                     "    free(failed);\n"
+                     "    return ok;\n"
+                     "}\n"
+                     "\n"
+                     "// base holds the compiler, the flags and the precompiled header\n"
+                     "args_t compile_args(job_t* job, args_t* base)\n"
+                     "{\n"
+                     "    args_t args = { 0 };\n"
+                     "    args_push_all(&args, base->buf);\n"
+                     "    args_push(&args, \"-c\");\n"
+                     "    args_push(&args, \"-MMD\");\n"
+                     "    args_push(&args, \"-MF\");\n"
+                     "    args_push(&args, job->dep);\n"
+                     "    args_push(&args, job->src);\n"
+                     "    args_push(&args, \"-o\");\n"
+                     "    args_push(&args, job->obj);\n"
+                     "    return args;\n"
+                     "}\n"
+                     "\n"
+                     "// Compiles job in the background. With a cache or a worker, a child process preprocesses the source, which also writes the\n"
+                     "// depfile, and restores the object from the cache, or compiles it on the worker or here and inserts it. A job whose worker\n"
+                     "// did not compile it exits with REMOTE_FALLBACK after recording why in remote, to be started again without a worker.\n"
+                     "pid_t start_job(job_t* job, args_t* base, cache_t* cache, cache_key_t* key, worker_t* worker, remote_t* remote)\n"
+                     "{\n"
+                     "    args_t args = compile_args(job, base);\n"
+                     "    if (cache == NULL && worker == NULL) {\n"
+                     "        printf(\"compiling: %s\\n\", job->src);\n"
+                     "        fflush(stdout);\n"
+                     "        pid_t pid = start_command(args.buf);\n"
+                     "        free(args.buf);\n"
+                     "        return pid;\n"
+                     "    }\n"
+                     "    fflush(stdout);\n"
+                     "    pid_t pid = fork();\n"
+                     "    if (pid != 0) {\n"
+                     "        free(args.buf);\n"
+                     "        return pid;\n"
+                     "    }\n"
+                     "\n"
+                     "    args_t pre = { 0 };\n"
+                     "    args_push_all(&pre, base->buf);\n"
+                     "    args_push(&pre, \"-E\");\n"
+                     "    args_push(&pre, \"-MMD\");\n"
+                     "    args_push(&pre, \"-MF\");\n"
+                     "    args_push(&pre, job->dep);\n"
+                     "    args_push(&pre, job->src);\n"
+                     "    uint64_t len;\n"
+                     "    char* preprocessed = capture_command(pre.buf, &len);\n"
+                     "    char* entry = NULL;\n"
+                     "    if (preprocessed != NULL && cache != NULL) {\n"
+                     "        cache_key_t k = *key;\n"
+                     "        key_update(&k, preprocessed, len);\n"
+                     "        entry = cache_entry(cache, &k);\n"
+                     "        if (cache_get(entry, job->obj)) {\n"
+                     "            __atomic_fetch_add(&cache->stats->hits, 1, __ATOMIC_RELAXED);\n"
+                     "            cache->hit[job - jobs] = 1;\n"
+                     "            printf(\"cached: %s\\n\", job->src);\n"
+                     "            fflush(stdout);\n"
+                     "            _exit(0);\n"
+                     "        }\n"
+                     "    }\n"
+                     "    if (cache != NULL) {\n"
+                     "        __atomic_fetch_add(&cache->stats->misses, 1, __ATOMIC_RELAXED);\n"
+                     "    }\n"
+                     "    bool ok;\n"
+                     "    if (worker != NULL && preprocessed != NULL) {\n"
+                     "        printf(\"compiling on %s: %s\\n\", worker->address, job->src);\n"
+                     "        fflush(stdout);\n"
+                     "        int status = remote_compile(worker->address, base->buf, preprocessed, len, job->obj, remote);\n"
+                     "        if (status == REMOTE_FALLBACK) {\n"
+                     "            if (cache != NULL) {\n"
+                     "                __atomic_fetch_sub(&cache->stats->misses, 1, __ATOMIC_RELAXED); // counted by the retry\n"
+                     "            }\n"
+                     "            _exit(REMOTE_FALLBACK);\n"
+                     "        }\n"
+                     "        ok = status == 0;\n"
+                     "    } else {\n"
+                     "        printf(\"compiling: %s\\n\", job->src);\n"
+                     "        fflush(stdout);\n"
+                     "        ok = run_command(args.buf);\n"
+                     "    }\n"
+                     "    if (ok && entry != NULL) {\n"
+                     "        cache_put(cache, entry, job->obj);\n"
+                     "    }\n"
+                     "    _exit(ok ? 0 : 1);\n"
+                     "}\n"
+                     "\n"
+                     "// Waits for a job. A unit its worker handed back is added to retry, to be compiled here. Returns false if a unit failed.\n"
+                     "bool wait_job(timing_t* timings, uint64_t n, worker_t** on, remote_t* remote, timing_t** retry, uint64_t* n_retry, long* local,\n"
+                     "              int format)\n"
+                     "{\n"
+                     "    pid_t pid;\n"
+                     "    int status = wait_status(&pid);\n"
+                     "    timing_t* t = pid > 0 ? timing_find(timings, n, pid) : NULL;\n"
+                     "    if (t == NULL) {\n"
+                     "        return status == 0;\n"
+                     "    }\n"
+                     "    worker_t* w = on[t->job - jobs];\n"
+                     "    if (w == NULL) {\n"
+                     "        (*local)--;\n"
+                     "    } else {\n"
+                     "        on[t->job - jobs] = NULL;\n"
+                     "        worker_account(w, &remote[t->job - jobs]);\n"
+                     "        if (status == REMOTE_FALLBACK) {\n"
+                     "            t->pid = -1; // neither running nor finished\n"
+                     "            retry[(*n_retry)++] = t;\n"
+                     "            return 1;\n"
+                     "        }\n"
+                     "    }\n"
+                     "    timing_finish(t, format);\n"
+                     "    return status == 0;\n"
+                     "}\n"
+                     "\n"
+                     "// Unless LTO needs every object in the final link, the objects of a directory with several units are linked into parts[i]\n"
+                     "// with -r, and the program from the parts and the objects of single unit directories. A change then relinks its directory\n"
+                     "// and the program from a few large objects. A part is relinked when one of its objects or compile.c, which may have moved\n"
+                     "// units, is newer. Returns false if a link failed, the inputs of the final link are pushed onto inputs.\n"
+                     "bool link_parts(char* compiler, long max_jobs, args_t* inputs, uint64_t* relinked)\n"
+                     "{\n"
+                     "    uint64_t n_parts = 0;\n"
+                     "    while (parts[n_parts] != NULL) {\n"
+                     "        n_parts++;\n"
+                     "    }\n"
+                     "    uint64_t* members = calloc(n_parts + 1, sizeof(*members));\n"
+                     "    int64_t* newest = calloc(n_parts + 1, sizeof(*newest));\n"
+                     "    job_t** first = calloc(n_parts + 1, sizeof(*first));\n"
+                     "    job_t* job;\n"
+                     "    for (job = jobs; job->src != NULL; job++) {\n"
+                     "        if (members[job->part]++ == 0) {\n"
+                     "            first[job->part] = job;\n"
+                     "        }\n"
+                     "        int64_t t = mtime_of(job->obj);\n"
+                     "        newest[job->part] = t > newest[job->part] ? t : newest[job->part];\n"
+                     "    }\n"
+                     "    int64_t compile_time = mtime_of(\"compile.c\");\n"
+                     "    bool ok = 1;\n"
+                     "    long running = 0;\n"
+                     "    uint64_t p;\n"
+                     "    for (p = 0; p < n_parts && ok; p++) {\n"
+                     "        if (members[p] < 2) {\n"
+                     "            if (members[p] == 1) {\n"
+                     "                args_push(inputs, first[p]->obj);\n"
+                     "            }\n"
+                     "            continue;\n"
+                     "        }\n"
+                     "        args_push(inputs, parts[p]);\n"
+                     "        int64_t part_time = mtime_of(parts[p]);\n"
+                     "        if (part_time >= 0 && part_time >= newest[p] && part_time >= compile_time) {\n"
+                     "            continue;\n"
+                     "        }\n"
+                     "        if (running >= max_jobs) {\n"
+                     "            ok = wait_command(NULL) && ok;\n"
+                     "            running--;\n"
+                     "        }\n"
+                     "        args_t args = { 0 };\n"
+                     "        args_push(&args, compiler);\n"
+                     "        args_push(&args, \"-r\");\n"
+                     "        args_push(&args, \"-nostdlib\");\n"
+                     "        char** flag;\n"
+                     "        // -m32 and the like select what the linker produces\n"
+                     "        for (flag = flags; *flag != NULL; flag++) {\n"
+                     "            if (strncmp(*flag, \"-m\", 2) == 0) {\n"
+                     "                args_push(&args, *flag);\n"
+                     "            }\n"
+                     "        }\n"
+                     "        args_push(&args, \"-o\");\n"
+                     "        args_push(&args, parts[p]);\n"
+                     "        for (job = first[p]; job->src != NULL; job++) {\n"
+                     "            if (job->part == p) {\n"
+                     "                args_push(&args, job->obj);\n"
+                     "            }\n"
+                     "        }\n"
+                     "        ok = ok && start_command(args.buf) > 0;\n"
+                     "        free(args.buf);\n"
+                     "        if (!ok) {\n"
+                     "            break;\n"
+                     "        }\n"
+                     "        running++;\n"
+                     "        (*relinked)++;\n"
+                     "    }\n"
+                     "    while (running > 0) {\n"
+                     "        ok = wait_command(NULL) && ok;\n"
+                     "        running--;\n"
+                     "    }\n"
+                     "    free(members);\n"
+                     "    free(newest);\n"
+                     "    free(first);\n"
+                     "    return ok;\n"
+                     "}\n"
+                     "\n"
+                     "// a build of program, build_run compiles what is out of date and links\n"
+                     "typedef struct build_t build_t;\n"
+                     "struct build_t {\n"
+                     "    char* compiler;\n"
+                     "    long max_jobs;\n"
+                     "    cache_t cache;\n"
+                     "    int timing;\n"
+                     "    FILE* report;\n"
+                     "    args_t extra; // passed to every compile and the link, recorded in .pp_flags\n"
+                     "    args_t link_extra; // passed to the link only\n"
+                     "    bool lto;\n"
+                     "    worker_t* workers;\n"
+                     "    uint64_t n_workers;\n"
+                     "    bool pgo; // the JSON report of every build is a member of the one of build_pgo\n"
+                     "};\n"
+                     "\n"
+                     "// exits after a failed build, closing the JSON report of -p so that it stays one object\n"
+                     "void build_failed(build_t* b, char* status)\n"
+                     "{\n"
+                     "    fprintf(stderr, \"%s\\n\", status);\n"
+                     "    if (b->pgo && b->timing == TIMING_JSON) {\n"
+                     "        fprintf(b->report, \",\\n\\\"status\\\": \\\"%s\\\"\\n}\\n\", status);\n"
+                     "    }\n"
+                     "    exit(1);\n"
+                     "}\n"
+                     "\n"
+                     "void build_run(build_t* b)\n"
+                     "{\n"
+                     "    double build_start = now();\n"
+                     "    uint64_t n_jobs = 0;\n"
+                     "    while (jobs[n_jobs].src != NULL) {\n"
+                     "        n_jobs++;\n"
+                     "    }\n"
+                     "\n"
+                     "    char* flags_stamp = join_args(flags);\n"
+                     "    if (b->extra.buf != NULL) {\n"
+                     "        char* extra = join_args(b->extra.buf);\n"
+                     "        flags_stamp = realloc(flags_stamp, strlen(flags_stamp) + strlen(extra) + 1);\n"
+                     "        strcat(flags_stamp, extra);\n"
+                     "        free(extra);\n"
+                     "    }\n"
+                     "    update_stamp(\".pp_flags\", flags_stamp);\n"
+                     "    free(flags_stamp);\n"
+                     "    int64_t stamp_time = mtime_of(\".pp_flags\");\n"
+                     "\n"
+                     "    bool use_pch = pch != NULL && build_pch(pch, b->compiler, b->extra.buf, stamp_time);\n"
+                     "    update_stamp(\".pp_pch\", use_pch ? \"on\\n\" : \"off\\n\");\n"
+                     "    // units do not list the headers they take from the precompiled header in their depfiles, so a rebuilt one rebuilds them all\n"
+                     "    int64_t pch_time = mtime_of(\".pp_pch\");\n"
+                     "    if (use_pch) {\n"
+                     "        char* gch = malloc(strlen(pch) + 8);\n"
+                     "        sprintf(gch, \"%s.gch\", pch);\n"
+                     "        int64_t gch_time = mtime_of(gch);\n"
+                     "        pch_time = gch_time > pch_time ? gch_time : pch_time;\n"
+                     "        free(gch);\n"
+                     "    }\n"
+                     "    if (pch_time > stamp_time) {\n"
+                     "        stamp_time = pch_time;\n"
+                     "    }\n"
+                     "\n"
+                     "    args_t base = { 0 };\n"
+                     "    args_push(&base, b->compiler);\n"
+                     "    args_push_all(&base, flags);\n"
+                     "    args_push_all(&base, b->extra.buf);\n"
+                     "    if (use_pch) {\n"
+                     "        args_push(&base, \"-include\");\n"
+                     "        args_push(&base, pch);\n"
+                     "    }\n"
+                     "    cache_t cache = b->cache;\n"
+                     "    cache_key_t key = { { 0 } };\n"
+                     "    if (cache.dir != NULL && *cache.dir != 0) {\n"
+                     "        mkdir(cache.dir, 0755);\n"
+                     "        cache.stats = mmap(NULL, sizeof(*cache.stats) + n_jobs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);\n"
+                     "        if (cache.stats == MAP_FAILED) {\n"
+                     "            cache.stats = NULL;\n"
+                     "        } else {\n"
+                     "            cache.hit = (unsigned char*)(cache.stats + 1);\n"
+                     "        }\n"
+                     "        key_compiler(&key, b->compiler);\n"
+                     "        char** arg;\n"
+                     "        for (arg = base.buf + 1; *arg != NULL; arg++) {\n"
+                     "            key_string(&key, *arg);\n"
+                     "            // debug information records the build directory\n"
+                     "            if (strncmp(*arg, \"-g\", 2) == 0) {\n"
+                     "                char cwd[4096];\n"
+                     "                key_string(&key, getcwd(cwd, sizeof(cwd)) ? cwd : \"\");\n"
+                     "            }\n"
+                     "        }\n"
+                     "    }\n"
+                     "    cache_t* job_cache = cache.stats != NULL ? &cache : NULL;\n"
+                     "\n"
+                     "    double* seconds = malloc((n_jobs + 1) * sizeof(*seconds));\n"
+                     "    timings_load(jobs, n_jobs, seconds);\n"
+                     "    sched_t* sched = malloc((n_jobs + 1) * sizeof(*sched));\n"
+                     "    uint64_t n_sched = 0;\n"
+                     "    uint64_t i;\n"
+                     "    for (i = 0; i < n_jobs; i++) {\n"
+                     "        if (needs_rebuild(&jobs[i], stamp_time)) {\n"
+                     "            sched[n_sched].job = &jobs[i];\n"
+                     "            sched[n_sched++].index = i;\n"
+                     "        }\n"
+                     "    }\n"
+                     "    bool known = estimate_costs(sched, n_sched, seconds);\n"
+                     "    qsort(sched, n_sched, sizeof(*sched), sched_cmp);\n"
+                     "    double predicted = known ? predict_makespan(sched, n_sched, b->max_jobs) : -1;\n"
+                     "    if (n_sched > 0 && known) {\n"
+                     "        printf(\"scheduling %llu translation units longest first, predicted makespan %.3fs\\n\", (unsigned long long)n_sched,\n"
+                     "               predicted);\n"
+                     "    }\n"
+                     "\n"
+                     "    timing_t* timings = calloc(n_jobs + 1, sizeof(*timings));\n"
+                     "    worker_t** on = calloc(n_jobs + 1, sizeof(*on)); // the worker compiling every job, NULL for jobs running here\n"
+                     "    timing_t** retry = malloc((n_sched + 1) * sizeof(*retry));\n"
+                     "    remote_t* remote = NULL;\n"
+                     "    if (n_sched > 0 && b->n_workers > 0) {\n"
+                     "        workers_probe(b->workers, b->n_workers);\n"
+                     "        remote = mmap(NULL, (n_jobs + 1) * sizeof(*remote), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);\n"
+                     "        if (remote == MAP_FAILED) {\n"
+                     "            remote = NULL;\n"
+                     "        }\n"
+                     "    }\n"
+                     "    double compile_start = now();\n"
+                     "    long local = 0;\n"
+                     "    long running = 0;\n"
+                     "    uint64_t next = 0;\n"
+                     "    uint64_t n_retry = 0;\n"
+                     "    uint64_t handed_back = 0;\n"
+                     "    uint64_t compiled = 0;\n"
+                     "    bool failed = 0;\n"
+                     "    pid_t pid;\n"
+                     "    job_t* job;\n"
+                     "    // workers take units first, units they hand back are compiled here before the ones not started yet\n"
+                     "    while (!failed && (next < n_sched || n_retry > 0 || running > 0)) {\n"
+                     "        worker_t* w = remote != NULL && next < n_sched ? worker_pick(b->workers, b->n_workers) : NULL;\n"
+                     "        if (w == NULL && (local >= b->max_jobs || (next == n_sched && n_retry == 0))) {\n"
+                     "            uint64_t before = n_retry;\n"
+                     "            failed = !wait_job(timings, compiled, on, remote, retry, &n_retry, &local, b->timing);\n"
+                     "            handed_back += n_retry - before;\n"
+                     "            running--;\n"
+                     "            continue;\n"
+                     "        }\n"
+                     "        timing_t* t;\n"
+                     "        if (w == NULL && n_retry > 0) {\n"
+                     "            t = retry[--n_retry];\n"
+                     "        } else {\n"
+                     "            t = &timings[compiled++];\n"
+                     "            t->job = sched[next++].job;\n"
+                     "        }\n"
+                     "        job = t->job;\n"
+                     "        if (w != NULL) {\n"
+                     "            remote[job - jobs] = (remote_t) { 0 };\n"
+                     "        }\n"
+                     "        pid = start_job(job, &base, job_cache, &key, w, w != NULL ? &remote[job - jobs] : NULL);\n"
+                     "        if (pid < 0) {\n"
+                     "            failed = 1;\n"
+                     "            break;\n"
+                     "        }\n"
+                     "        t->pid = pid;\n"
+                     "        t->start = now();\n"
+                     "        on[job - jobs] = w;\n"
+                     "        if (w != NULL) {\n"
+                     "            w->running++;\n"
+                     "        } else {\n"
+                     "            local++;\n"
+                     "        }\n"
+                     "        running++;\n"
+                     "    }\n"
+                     "    while (running > 0) {\n"
+                     "        if (!wait_job(timings, compiled, on, remote, retry, &n_retry, &local, b->timing)) {\n"
+                     "            failed = 1;\n"
+                     "        }\n"
+                     "        running--;\n"
+                     "    }\n"
+                     "    double makespan = now() - compile_start;\n"
+                     "    // a unit restored from the cache says nothing about how long it takes to compile\n"
+                     "    for (i = 0; i < compiled; i++) {\n"
+                     "        if (timings[i].pid == 0 && (job_cache == NULL || !cache.hit[timings[i].job - jobs])) {\n"
+                     "            seconds[timings[i].job - jobs] = timings[i].seconds;\n"
+                     "        }\n"
+                     "    }\n"
+                     "    timings_save(jobs, n_jobs, seconds);\n"
+                     "    free(seconds);\n"
+                     "    free(sched);\n"
+                     "    if (compiled > 0 && known) {\n"
+                     "        printf(\"compiled %llu translation units in %.3fs, predicted %.3fs\\n\", (unsigned long long)compiled, makespan, predicted);\n"
+                     "    } else if (compiled > 0) {\n"
+                     "        printf(\"compiled %llu translation units in %.3fs\\n\", (unsigned long long)compiled, makespan);\n"
+                     "    }\n"
+                     "    uint64_t n_workers = remote != NULL ? b->n_workers : 0;\n"
+                     "    if (remote != NULL) {\n"
+                     "        worker_report(stdout, b->workers, b->n_workers, makespan, TIMING_TEXT);\n"
+                     "        if (handed_back > 0) {\n"
+                     "            printf(\"compiled %llu translation units here that busy or unreachable workers handed back\\n\",\n"
+                     "                   (unsigned long long)handed_back);\n"
+                     "        }\n"
+                     "        munmap(remote, (n_jobs + 1) * sizeof(*remote));\n"
+                     "    }\n"
+                     "    free(on);\n"
+                     "    free(retry);\n"
+                     "    if (failed) {\n"
+                     "        if (b->timing != TIMING_OFF) {\n"
+                     "            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, 0, now() - build_start,\n"
+                     "                          \"compilation failed\", b->workers, n_workers);\n"
+                     "        }\n"
+                     "        build_failed(b, \"compilation failed\");\n"
+                     "    }\n"
+                     "\n"
+                     "    free(base.buf);\n"
+                     "    if (job_cache != NULL) {\n"
+                     "        uint64_t looked_up = cache.stats->hits + cache.stats->misses;\n"
+                     "        if (looked_up > 0) {\n"
+                     "            printf(\"cache: %llu hits, %llu misses (%.0f%% hit rate)\\n\", (unsigned long long)cache.stats->hits,\n"
+                     "                   (unsigned long long)cache.stats->misses, 100.0 * cache.stats->hits / looked_up);\n"
+                     "        }\n"
+                     "        if (cache.stats->inserted > 0) {\n"
+                     "            cache_evict(&cache);\n"
+                     "        }\n"
+                     "        munmap(cache.stats, sizeof(*cache.stats) + n_jobs);\n"
+                     "    }\n"
+                     "\n"
+                     "    int64_t program_time = mtime_of(program);\n"
+                     "    bool relink = compiled > 0 || program_time < 0 || stamp_time > program_time || mtime_of(\"compile.c\") > program_time;\n"
+                     "    for (job = jobs; job != jobs + n_jobs && !relink; job++) {\n"
+                     "        relink = mtime_of(job->obj) > program_time;\n"
+                     "    }\n"
+                     "    if (!relink) {\n"
+                     "        printf(\"%s is up to date\\n\", program);\n"
+                     "        if (b->timing != TIMING_OFF) {\n"
+                     "            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, 0, now() - build_start, \"ok\",\n"
+                     "                          b->workers, n_workers);\n"
+                     "        }\n"
+                     "        free(timings);\n"
+                     "        return;\n"
+                     "    }\n"
+                     "    double link_start = now();\n"
+                     "\n"
+                     "    args_t link = { 0 };\n"
+                     "    args_push(&link, b->compiler);\n"
+                     "    args_push(&link, \"-o\");\n"
+                     "    args_push(&link, program);\n"
+                     "    args_push_all(&link, flags);\n"
+                     "    args_push_all(&link, b->extra.buf);\n"
+                     "    args_push_all(&link, b->link_extra.buf);\n"
+                     "    uint64_t relinked = 0;\n"
+                     "    char* status = \"ok\";\n"
+                     "    if (b->lto) {\n"
+                     "        for (job = jobs; job != jobs + n_jobs; job++) {\n"
+                     "            args_push(&link, job->obj);\n"
+                     "        }\n"
+                     "    } else if (!link_parts(b->compiler, b->max_jobs, &link, &relinked)) {\n"
+                     "        status = \"partial linking failed\";\n"
+                     "    }\n"
+                     "    double parts_seconds = now() - link_start;\n"
+                     "    if (strcmp(status, \"ok\") == 0 && !run_command(link.buf)) {\n"
+                     "        status = \"linking failed\";\n"
+                     "    }\n"
+                     "    if (strcmp(status, \"ok\") != 0) {\n"
+                     "        if (b->timing != TIMING_OFF) {\n"
+                     "            timing_report(b->report, timings, compiled, b->timing, makespan, predicted, now() - link_start,\n"
+                     "                          now() - build_start, status, b->workers, n_workers);\n"
+                     "        }\n"
+                     "        build_failed(b, status);\n"
+                     "    }\n"
+                     "    free(link.buf);\n"
+                     "    if (relinked > 0) {\n"
+                     "        printf(\"linked the objects of %llu director%s in %.3fs, %s in %.3fs\\n\", (unsigned long long)relinked,\n"
+                     "               relinked == 1 ? \"y\" : \"ies\", parts_seconds, program, now() - link_start - parts_seconds);\n"
+                     "    }\n"
+                     "    if (b->lto) {\n"
+                     "        // with LTO the link is where the code is optimised and generated\n"
+                     "        printf(\"linked with LTO on %ld jobs in %.3fs\\n\", b->max_jobs, now() - link_start);\n"
+                     "    }\n"
+                     "    if (b->timing != TIMING_OFF) {\n"
+                     "        timing_report(b->report, timings, compiled, b->timing, makespan, predicted, now() - link_start, now() - build_start,\n"
+                     "                      \"ok\", b->workers, n_workers);\n"
+                     "    }\n"
+                     "    free(timings);\n"
+                     "}\n"
+                     "\n"
+                     "// \"-name=value\" in a malloced buffer\n"
+                     "char* flag_value(char* name, char* value)\n"
+                     "{\n"
+                     "    char* flag = malloc(strlen(name) + strlen(value) + 2);\n"
+                     "    sprintf(flag, \"%s=%s\", name, value);\n"
+                     "    return flag;\n"
+                     "}\n"
+                     "\n"
+                     "bool is_clang(char* compiler)\n"
+                     "{\n"
+                     "    char* name = strrchr(compiler, '/');\n"
+                     "    return strstr(name != NULL ? name + 1 : compiler, \"clang\") != NULL;\n"
+                     "}\n"
+                     "\n"
+                     "// Whole program optimisation: GCC links with -flto=N, N parallel LTRANS processes on as many partitions, Clang uses ThinLTO\n"
+                     "// with N backend jobs.\n"
+                     "void build_lto(build_t* b)\n"
+                     "{\n"
+                     "    char n[32];\n"
+                     "    snprintf(n, sizeof(n), \"%ld\", b->max_jobs);\n"
+                     "    b->lto = 1;\n"
+                     "    if (is_clang(b->compiler)) {\n"
+                     "        args_push(&b->extra, \"-flto=thin\");\n"
+                     "        args_push(&b->link_extra, flag_value(\"-flto-jobs\", n));\n"
+                     "    } else {\n"
+                     "        args_push(&b->extra, \"-flto\");\n"
+                     "        args_push(&b->link_extra, flag_value(\"-flto\", n));\n"
+                     "        args_push(&b->link_extra, flag_value(\"--param=lto-partitions\", n));\n"
+                     "    }\n"
+                     "}\n"
+                     "\n"
+                     "// profile guided optimisation\n"
+                     "//--------------------------------------------------------------------------------------------------------------------------------\n"
+                     "\n"
+                     "// -p CMD builds with -fprofile-generate into PROFILE_DIR, runs the training command CMD, merges the profiles (Clang writes\n"
+                     "// raw ones for llvm-profdata, GCC's .gcda files are used as they are) and builds again with -fprofile-use. Every phase\n"
+                     "// changes the flags recorded in .pp_flags, so each one rebuilds all units.\n"
+                     "\n"
+                     "#define PROFILE_DIR \".pp_profile\"\n"
+                     "\n"
+                     "// runs command through sh and returns how long it took, -1 if it failed\n"
+                     "double run_timed(char* command)\n"
+                     "{\n"
+                     "    char* args[] = { \"sh\", \"-c\", command, NULL };\n"
+                     "    double start = now();\n"
+                     "    if (!run_command(args)) {\n"
+                     "        return -1;\n"
+                     "    }\n"
+                     "    return now() - start;\n"
+                     "}\n"
+                     "\n"
+                     "// removes the profiles of earlier runs from dir, or creates it\n"
+                     "void clear_profiles(char* dir)\n"
+                     "{\n"
+                     "    mkdir(dir, 0755);\n"
+                     "    DIR* d = opendir(dir);\n"
+                     "    if (d == NULL) {\n"
+                     "        return;\n"
+                     "    }\n"
+                     "    char path[4096];\n"
+                     "    struct dirent* e;\n"
+                     "    while ((e = readdir(d)) != NULL) {\n"
+                     "        if (e->d_name[0] != '.') {\n"
+                     "            snprintf(path, sizeof(path), \"%s/%s\", dir, e->d_name);\n"
+                     "            unlink(path);\n"
+                     "        }\n"
+                     "    }\n"
+                     "    closedir(d);\n"
+                     "}\n"
+                     "\n"
+                     "// merges the raw profiles in dir into dir/default.profdata, PP_PROFDATA names llvm-profdata\n"
+                     "bool merge_profiles(char* dir, char* profdata)\n"
+                     "{\n"
+                     "    args_t args = { 0 };\n"
+                     "    args_push(&args, getenv(\"PP_PROFDATA\") != NULL ? getenv(\"PP_PROFDATA\") : \"llvm-profdata\");\n"
+                     "    args_push(&args, \"merge\");\n"
+                     "    args_push(&args, flag_value(\"-output\", profdata));\n"
+                     "    DIR* d = opendir(dir);\n"
+                     "    struct dirent* e;\n"
+                     "    while (d != NULL && (e = readdir(d)) != NULL) {\n"
+                     "        uint64_t len = strlen(e->d_name);\n"
+                     "        if (len > 8 && strcmp(e->d_name + len - 8, \".profraw\") == 0) {\n"
+                     "            char* path = malloc(strlen(dir) + len + 2);\n"
+                     "            sprintf(path, \"%s/%s\", dir, e->d_name);\n"
+                     "            args_push(&args, path);\n"
+                     "        }\n"
+                     "    }\n"
+                     "    if (d != NULL) {\n"
+                     "        closedir(d);\n"
+                     "    }\n"
+                     "    bool ok = run_command(args.buf);\n"
+                     "    uint64_t i;\n"
+                     "    for (i = 2; i < args.used; i++) {\n"
+                     "        free(args.buf[i]);\n"
+                     "    }\n"
+                     "    free(args.buf);\n"
+                     "    return ok;\n"
+                     "}\n"
+                     "\n"
+                     "void build_pgo(build_t* b, char* training)\n"
+                     "{\n"
+                     "    char cwd[4096];\n"
+                     "    if (getcwd(cwd, sizeof(cwd)) == NULL) {\n"
+                     "        fprintf(stderr, \"could not get the build directory: %s\\n\", strerror(errno));\n"
+                     "        exit(1);\n"
+                     "    }\n"
+                     "    // absolute, the training command may run the program from anywhere\n"
+                     "    char* dir = malloc(strlen(cwd) + sizeof(PROFILE_DIR) + 1);\n"
+                     "    sprintf(dir, \"%s/%s\", cwd, PROFILE_DIR);\n"
+                     "    char* profdata = malloc(strlen(dir) + 20);\n"
+                     "    sprintf(profdata, \"%s/default.profdata\", dir);\n"
+                     "    bool clang = is_clang(b->compiler);\n"
+                     "    FILE* json = b->timing == TIMING_JSON ? b->report : NULL;\n"
+                     "    b->pgo = 1;\n"
+                     "    uint64_t n_extra = b->extra.used;\n"
+                     "\n"
+                     "    double before = -1;\n"
+                     "    if (mtime_of(program) >= 0) {\n"
+                     "        printf(\"pgo: timing the training command with the previous build\\n\");\n"
+                     "        fflush(stdout);\n"
+                     "        before = run_timed(training);\n"
+                     "    }\n"
+                     "\n"
+                     "    double start = now();\n"
+                     "    clear_profiles(dir);\n"
+                     "    args_push(&b->extra, flag_value(\"-fprofile-generate\", dir));\n"
+                     "    printf(\"pgo: instrumented build\\n\");\n"
+                     "    if (json != NULL) {\n"
+                     "        fprintf(json, \"{\\n\\\"instrumented\\\": \");\n"
+                     "    }\n"
+                     "    build_run(b);\n"
+                     "    double instrumented = now() - start;\n"
+                     "\n"
+                     "    printf(\"pgo: training: %s\\n\", training);\n"
+                     "    fflush(stdout);\n"
+                     "    double training_seconds = run_timed(training);\n"
+                     "    if (training_seconds < 0) {\n"
+                     "        build_failed(b, \"training command failed\");\n"
+                     "    }\n"
+                     "\n"
+                     "    start = now();\n"
+                     "    if (clang && !merge_profiles(dir, profdata)) {\n"
+                     "        fprintf(stderr, \"could not merge the profiles in %s\\n\", dir);\n"
+                     "        build_failed(b, \"merging the profiles failed\");\n"
+                     "    }\n"
+                     "    double merge = now() - start;\n"
+                     "\n"
+                     "    start = now();\n"
+                     "    free(b->extra.buf[n_extra]);\n"
+                     "    b->extra.used = n_extra;\n"
+                     "    b->extra.buf[n_extra] = NULL;\n"
+                     "    if (clang) {\n"
+                     "        args_push(&b->extra, flag_value(\"-fprofile-use\", profdata));\n"
+                     "    } else {\n"
+                     "        args_push(&b->extra, flag_value(\"-fprofile-use\", dir));\n"
+                     "        // code the training did not reach keeps the usual optimisation instead of being treated as cold\n"
+                     "        args_push(&b->extra, \"-fprofile-partial-training\");\n"
+                     "        args_push(&b->extra, \"-Wno-missing-profile\");\n"
+                     "    }\n"
+                     "    printf(\"pgo: optimised build\\n\");\n"
+                     "    if (json != NULL) {\n"
+                     "        fprintf(json, \",\\n\\\"optimized\\\": \");\n"
+                     "    }\n"
+                     "    build_run(b);\n"
+                     "    double optimised = now() - start;\n"
+                     "\n"
+                     "    printf(\"pgo: timing the training command with the optimised build\\n\");\n"
+                     "    fflush(stdout);\n"
+                     "    double after = run_timed(training);\n"
+                     "    printf(\"pgo: instrumented build %.3fs, training %.3fs, merge %.3fs, optimised build %.3fs\\n\", instrumented, training_seconds,\n"
+                     "           merge, optimised);\n"
+                     "    if (before > 0 && after > 0) {\n"
+                     "        printf(\"pgo: training command took %.3fs with the previous build, %.3fs optimised (%.2fx)\\n\", before, after,\n"
+                     "               before / after);\n"
+                     "    } else if (after > 0) {\n"
+                     "        printf(\"pgo: training command took %.3fs optimised\\n\", after);\n"
+                     "    }\n"
+                     "    if (json != NULL) {\n"
+                     "        fprintf(json,\n"
+                     "                \",\\n\\\"instrumented_build_seconds\\\": %.6f,\\n\\\"training_seconds\\\": %.6f,\\n\\\"merge_seconds\\\": %.6f,\\n\"\n"
+                     "                \"\\\"optimized_build_seconds\\\": %.6f,\\n\\\"previous_run_seconds\\\": \",\n"
+                     "                instrumented, training_seconds, merge, optimised);\n"
+                     "        if (before > 0) {\n"
+                     "            fprintf(json, \"%.6f\", before);\n"
+                     "        } else {\n"
+                     "            fprintf(json, \"null\");\n"
+                     "        }\n"
+                     "        fprintf(json, \",\\n\\\"optimized_run_seconds\\\": \");\n"
+                     "        if (after > 0) {\n"
+                     "            fprintf(json, \"%.6f\", after);\n"
+                     "        } else {\n"
+                     "            fprintf(json, \"null\");\n"
+                     "        }\n"
+                     "        fprintf(json, \",\\n\\\"status\\\": \\\"ok\\\"\\n}\\n\");\n"
+                     "    }\n"
+                     "    free(dir);\n"
+                     "    free(profdata);\n"
+                     "}\n"
+                     "\n"
+                     "void add_worker(build_t* b, char* address)\n"
+                     "{\n"
+                     "    b->workers = realloc(b->workers, (b->n_workers + 1) * sizeof(*b->workers));\n"
+                     "    b->workers[b->n_workers++] = (worker_t) { .address = address };\n"
+                     "}\n"
+                     "\n"
+                     "int main(int argc, char** argv)\n"
+                     "{\n"
+                     "    build_t b = { 0 };\n"
+                     "    b.max_jobs = sysconf(_SC_NPROCESSORS_ONLN);\n"
+                     "    b.cache = (cache_t) { getenv(\"PP_CACHE_DIR\"), 1ull << 30, NULL, NULL };\n"
+                     "    if (getenv(\"PP_CACHE_SIZE\") != NULL) {\n"
+                     "        b.cache.max_size = strtoull(getenv(\"PP_CACHE_SIZE\"), NULL, 10) << 20;\n"
+                     "    }\n"
+                     "    int opt;\n"
+                     "    bool lto = 0;\n"
+                     "    char* training = NULL;\n"
+                     "    while ((opt = getopt(argc, argv, \"j:c:s:T:lp:w:\")) != -1) {\n"
+                     "        switch (opt) {\n"
+                     "        case 'j':\n"
+                     "            b.max_jobs = strtol(optarg, NULL, 10);\n"
+                     "            break;\n"
+                     "        case 'c':\n"
+                     "            b.cache.dir = optarg;\n"
+                     "            break;\n"
+                     "        case 's':\n"
+                     "            b.cache.max_size = strtoull(optarg, NULL, 10) << 20;\n"
+                     "            break;\n"
+                     "        case 'T':\n"
+                     "            b.timing = strcmp(optarg, \"json\") == 0 ? TIMING_JSON : TIMING_TEXT;\n"
+                     "            break;\n"
+                     "        case 'l':\n"
+                     "            lto = 1;\n"
+                     "            break;\n"
+                     "        case 'p':\n"
+                     "            training = optarg;\n"
+                     "            break;\n"
+                     "        case 'w':\n"
+                     "            add_worker(&b, optarg);\n"
+                     "            break;\n"
+                     "        default:\n"
+                     "            fprintf(stderr,\n"
+                     "                    \"usage: %s [-j jobs] [-c cache_dir] [-s cache_megabytes] [-T text|json] [-l] [-p training_command] \"\n"
+                     "                    \"[-w unix:PATH|tcp:HOST:PORT]... compiler\\n\",\n"
+                     "                    argv[0]);\n"
+                     "            exit(1);\n"
+                     "        }\n"
+                     "    }\n"
+                     "    if (argc - optind != 1) {\n"
+                     "        fprintf(stderr, \"wrong number of argmuents\\n\");\n"
+                     "        exit(1);\n"
+                     "    }\n"
+                     "    if (b.max_jobs < 1) {\n"
+                     "        b.max_jobs = 1;\n"
+                     "    }\n"
+                     "    // PP_WORKERS lists the workers separated by commas when there is no -w\n"
+                     "    if (b.n_workers == 0 && getenv(\"PP_WORKERS\") != NULL) {\n"
+                     "        char* address;\n"
+                     "        for (address = strtok(strdup(getenv(\"PP_WORKERS\")), \", \"); address != NULL; address = strtok(NULL, \", \")) {\n"
+                     "            add_worker(&b, address);\n"
+                     "        }\n"
+                     "    }\n"
+                     "    b.compiler = argv[optind];\n"
+                     "    // the JSON report owns stdout, progress goes to stderr\n"
+                     "    b.report = stdout;\n"
+                     "    if (b.timing == TIMING_JSON) {\n"
+                     "        fflush(stdout);\n"
+                     "        b.report = fdopen(dup(STDOUT_FILENO), \"w\");\n"
+                     "        dup2(STDERR_FILENO, STDOUT_FILENO);\n"
+                     "    }\n"
+                     "\n"
+                     "    if (lto) {\n"
+                     "        build_lto(&b);\n"
+                     "    }\n"
+                     "    if (training == NULL) {\n"
+                     "        build_run(&b);\n"
+                     "        return 0;\n"
+                     "    }\n"
+                     "    // the objects depend on the profile, which the cache key does not cover, and a worker compiles from a temporary path of\n"
+                     "    // its own, under which the profile of the instrumented build would not be found\n"
+                     "    b.cache.dir = NULL;\n"
+                     "    b.n_workers = 0;\n"
+                     "    build_pgo(&b, training);\n"
+                     "    return 0;\n"
+                     "}\n";
+
+void fprint_c_string(FILE* f, char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// writes the words of s (see split_args) as a NULL terminated C array initializer
+void fprint_c_args(FILE* f, char* s)
+{
+    char** args = split_args(s);
+    char** arg;
+    fprintf(f, "{ ");
+    for (arg = args; *arg != NULL; arg++) {
+        fprint_c_string(f, *arg);
+        fprintf(f, ", ");
+    }
+    fprintf(f, "NULL }");
+    free_args(args);
+}
+
+// leaves name untouched when it already holds exactly len bytes of buf, so its mtime only moves on real changes
+void write_if_changed(char* name, char* buf, uint64_t len)
+{
+    struct stat st;
+    if (stat(name, &st) == 0 && (uint64_t)st.st_size == len) {
+        FILE* f = fopen(name, "r");
+        panic_if(f == NULL, "could not open %s: %s", name, strerror(errno));
+        char* old = malloc(len + 1);
+        bool same = fread(old, 1, len, f) == len && memcmp(old, buf, len) == 0;
+        free(old);
+        fclose(f);
+        if (same) {
+            return;
+        }
+    }
+    FILE* f = fopen(name, "w");
+    panic_if(f == NULL, "could not open %s: %s", name, strerror(errno));
+    panic_if(fwrite(buf, 1, len, f) != len || fclose(f) != 0, "could not write %s: %s", name, strerror(errno));
+}
+
+char* strip_dot_slash(char* path)
+{
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+    }
+    return path;
+}
+
+// reads a list of paths, one per line, into a set
+path_map_t* load_path_set(char* name)
+{
+    FILE* f = fopen(name, "r");
+    panic_if(f == NULL, "could not open %s: %s", name, strerror(errno));
+    path_map_t* set = pm_create(16);
+    char* line = NULL;
+    size_t line_len = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_len, f)) > 0) {
+        if (line[n - 1] == '\n') {
+            line[n - 1] = 0;
+        }
+        if (line[0] != 0 && line[0] != '#') {
+            pm_put(set, strip_dot_slash(line));
+        }
+    }
+    free(line);
+    fclose(f);
+    return set;
+}
+
+typedef struct compile_options_t compile_options_t;
+struct compile_options_t {
+    char* program_name;
+    char* flags;
+    uint64_t unity_files; // translation units per unity batch, 0 disables unity builds
+    uint64_t unity_bytes; // source bytes per unity batch, 0 for no limit
+    path_map_t* unity_exclude; // paths that are always compiled on their own
+    uint64_t pch_percent; // share of translation units that must reach a header for it to be precompiled, 0 disables
+};
+
+// unity builds
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Consecutive translation units are grouped into batches, each compiled through a generated pp_unity_N.c that includes its
+// members. Files on the exclusion list (e.g. because of clashing static symbols) and batches of one are compiled on their own.
+
+#define UNITY_NONE UINT64_MAX
+#define UNITY_NAME "pp_unity_%llu.c"
+
+typedef struct unity_plan_t unity_plan_t;
+struct unity_plan_t {
+    uint64_t* batch; // batch of file i, UNITY_NONE for headers and separately compiled files
+    uint64_t n_batches;
+};
+
+bool is_c_source(char* path)
+{
+    return path[strlen(path) - 1] == 'c';
+}
+
+void unity_close_batch(unity_plan_t* plan, uint64_t* members, uint64_t n_members)
+{
+    uint64_t i;
+    if (n_members == 1) {
+        plan->batch[members[0]] = UNITY_NONE;
+        return;
+    }
+    for (i = 0; i < n_members; i++) {
+        plan->batch[members[i]] = plan->n_batches;
+    }
+    if (n_members > 0) {
+        plan->n_batches++;
+    }
+}
+
+void unity_plan(compile_options_t* opts, name_buf_t* file_buf, unity_plan_t* plan)
+{
+    plan->n_batches = 0;
+    plan->batch = malloc(file_buf->used * sizeof(*plan->batch) + 1);
+    uint64_t* members = malloc(file_buf->used * sizeof(*members) + 1);
+    panic_if(plan->batch == NULL || members == NULL, "could not allocate unity plan: %s", strerror(errno));
+    uint64_t n_members = 0;
+    uint64_t bytes = 0;
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        plan->batch[i] = UNITY_NONE;
+        char* path = nb_path(file_buf, NULL, i, &fn);
+        if (opts->unity_files == 0 || !is_c_source(path)
+            || (opts->unity_exclude != NULL && pm_get(opts->unity_exclude, strip_dot_slash(path)) != NULL)) {
+            continue;
+        }
+        struct stat st;
+        panic_if(stat(path, &st) < 0, "could not stat %s: %s", path, strerror(errno));
+        if (n_members > 0 && (n_members == opts->unity_files || (opts->unity_bytes > 0 && bytes + st.st_size > opts->unity_bytes))) {
+            unity_close_batch(plan, members, n_members);
+            n_members = 0;
+            bytes = 0;
+        }
+        members[n_members++] = i;
+        bytes += st.st_size;
+    }
+    unity_close_batch(plan, members, n_members);
+    file_name_uninit(&fn);
+    free(members);
+}
+
+// renders pp_unity_<batch>.c into a malloced buffer
+void unity_render(unity_plan_t* plan, name_buf_t* file_buf, uint64_t batch, char** out_buf, size_t* out_len)
+{
+    FILE* f = open_memstream(out_buf, out_len);
+    panic_if(f == NULL, "could not open unity source");
+    fprintf(f, "// generated by pp, compiles the following translation units as one\n");
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        if (plan->batch[i] == batch) {
+            fprintf(f, "#include ");
+            fprint_c_string(f, nb_path(file_buf, NULL, i, &fn));
+            fprintf(f, "\n");
+        }
+    }
+    file_name_uninit(&fn);
+    fclose(f);
+}
+
+// writes the batch sources into out_dir and removes the ones left over from a run with more batches
+void out_unity(char* out_dir, unity_plan_t* plan, name_buf_t* file_buf)
+{
+    file_name_t fn;
+    file_name_init(&fn);
+    char name[64];
+    uint64_t batch;
+    for (batch = 0;; batch++) {
+        snprintf(name, sizeof(name), UNITY_NAME, (unsigned long long)batch);
+        char* path = file_name_cat(&fn, out_dir, name);
+        if (batch >= plan->n_batches) {
+            if (unlink(path) < 0) {
+                break;
+            }
+            continue;
+        }
+        char* buf = NULL;
+        size_t len = 0;
+        unity_render(plan, file_buf, batch, &buf, &len);
+        write_if_changed(path, buf, len);
+        free(buf);
+    }
+    file_name_uninit(&fn);
+}
+
+// precompiled header
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// Headers reached through #include from at least pch_percent percent of the translation units are collected into a generated
+// pp_pch.h, which compile.c precompiles and passes to every unit with -include. Units still include those headers themselves,
+// so only headers with an include guard or #pragma once qualify.
+
+#define PCH_NAME "pp_pch.h"
+
+// true if the first directive of the file, after comments, is #pragma once, #ifndef or #if !defined
+bool has_include_guard(char* path)
+{
+    FILE* f = fopen(path, "r");
+    panic_if(f == NULL, "could not open %s: %s", path, strerror(errno));
+    char buf[4096];
+    uint64_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+    char* p = buf;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+        }
+        if (p[0] == '/' && p[1] == '/') {
+            p += strcspn(p, "\n");
+        } else if (p[0] == '/' && p[1] == '*') {
+            char* end = strstr(p + 2, "*/");
+            if (end == NULL) {
+                return 0;
+            }
+            p = end + 2;
+        } else {
+            break;
+        }
+    }
+    if (*p++ != '#') {
+        return 0;
+    }
+    p += strspn(p, " \t");
+    if (strncmp(p, "ifndef", 6) == 0 || strncmp(p, "pragma once", 11) == 0) {
+        return 1;
+    }
+    if (strncmp(p, "if", 2) != 0) {
+        return 0;
+    }
+    p += 2;
+    p += strspn(p, " \t");
+    if (*p++ != '!') {
+        return 0;
+    }
+    p += strspn(p, " \t");
+    return strncmp(p, "defined", 7) == 0;
+}
+
+// renders pp_pch.h into a malloced buffer, false if no header qualifies
+bool pch_render(compile_options_t* opts, name_buf_t* file_buf, char** out_buf, size_t* out_len)
+{
+    if (opts->pch_percent == 0) {
+        return 0;
+    }
+    include_graph_t g;
+    include_graph_build(&g, file_buf, opts->flags);
+
+    // reached[h] == u + 1 once unit u has counted header h
+    uint64_t* reached = calloc(file_buf->used + 1, sizeof(*reached));
+    uint64_t* count = calloc(file_buf->used + 1, sizeof(*count));
+    uint64_t* stack = malloc((file_buf->used + 1) * sizeof(*stack));
+    panic_if(reached == NULL || count == NULL || stack == NULL, "could not allocate include counts: %s", strerror(errno));
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t n_units = 0;
+    uint64_t unit;
+    for (unit = 0; unit < file_buf->used; unit++) {
+        if (!is_c_source(nb_path(file_buf, NULL, unit, &fn))) {
+            continue;
+        }
+        n_units++;
+        uint64_t n_stack = 0;
+        stack[n_stack++] = unit;
+        reached[unit] = unit + 1;
+        while (n_stack > 0) {
+            uint64_t file = stack[--n_stack];
+            uint64_t* edge;
+            for (edge = g.edges + g.start[file]; edge != g.edges + g.start[file + 1]; edge++) {
+                if (reached[*edge] != unit + 1) {
+                    reached[*edge] = unit + 1;
+                    count[*edge]++;
+                    stack[n_stack++] = *edge;
+                }
+            }
+        }
+    }
+
+    bool any = 0;
+    FILE* f = open_memstream(out_buf, out_len);
+    panic_if(f == NULL, "could not open " PCH_NAME);
+    fprintf(f, "// generated by pp, the headers most translation units include, precompiled by compile.c\n");
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        if (count[i] < 2 || count[i] * 100 < opts->pch_percent * n_units) {
+            continue;
+        }
+        char* path = nb_path(file_buf, NULL, i, &fn);
+        if (is_c_source(path) || !has_include_guard(path)) {
+            continue;
+        }
+        fprintf(f, "#include ");
+        fprint_c_string(f, path);
+        fprintf(f, "\n");
+        any = 1;
+    }
+    fclose(f);
+    if (!any) {
+        free(*out_buf);
+        *out_buf = NULL;
+        *out_len = 0;
+    }
+
+    file_name_uninit(&fn);
+    free(reached);
+    free(count);
+    free(stack);
+    include_graph_free(&g);
+    return any;
+}
+
+// the index of the directory of src in parts, which maps directories to their index
+uint64_t job_part(path_map_t* parts, char* src)
+{
+    char* slash = strrchr(src, '/');
+    if (slash != NULL) {
+        *slash = 0;
+    }
+    path_map_entry_t* e = pm_get(parts, slash != NULL ? src : ".");
+    if (e == NULL) {
+        e = pm_put(parts, slash != NULL ? src : ".");
+        e->value = parts->used - 1;
+    }
+    if (slash != NULL) {
+        *slash = '/';
+    }
+    return e->value;
+}
+
+void fprint_job(FILE* f, char* src, path_map_t* parts)
+{
+    uint64_t part = job_part(parts, src);
+    uint64_t len = strlen(src);
+    fprintf(f, "    { ");
+    fprint_c_string(f, src);
+    fprintf(f, ", ");
+    src[len - 1] = 'o';
+    fprint_c_string(f, src);
+    fprintf(f, ", ");
+    src[len - 1] = 'd';
+    fprint_c_string(f, src);
+    src[len - 1] = 'c';
+    fprintf(f, ", %llu },\n", (unsigned long long)part);
+}
+
+// renders compile.c into a malloced buffer
+void render_compile_instructions(compile_options_t* opts, unity_plan_t* plan, bool pch, name_buf_t* file_buf, char** out_buf,
+                                 size_t* out_len)
+{
+    FILE* compile_file = open_memstream(out_buf, out_len);
+    panic_if(compile_file == NULL, "could not open compile.c");
+
+    fprintf(compile_file, "%s", static_instructions);
+
+    fprintf(compile_file, "\nstatic char* program = ");
+    fprint_c_string(compile_file, opts->program_name);
+    fprintf(compile_file, ";\nstatic char* flags[] = ");
+    fprint_c_args(compile_file, opts->flags);
+    fprintf(compile_file, ";\nstatic char* pch = %s;\n\nstatic job_t jobs[] = {\n", pch ? "\"" PCH_NAME "\"" : "NULL");
+
+    file_name_t fn;
+    file_name_init(&fn);
+    path_map_t* parts = pm_create(16);
+    char unity_name[64];
+    uint64_t next_batch = 0;
+    uint64_t i;
+    for (i = 0; i < file_buf->used; i++) {
+        if (plan->batch[i] == UNITY_NONE) {
+            char* file = nb_path(file_buf, NULL, i, &fn);
+            if (is_c_source(file)) {
+                fprint_job(compile_file, file, parts);
+            }
+        } else if (plan->batch[i] == next_batch) {
+            snprintf(unity_name, sizeof(unity_name), UNITY_NAME, (unsigned long long)next_batch++);
+            fprint_job(compile_file, unity_name, parts);
+        }
+    }
+    fprintf(compile_file, "    { NULL, NULL, NULL, 0 },\n};\n\nstatic char* parts[] = {\n");
+    char** dirs = calloc(parts->used + 1, sizeof(*dirs));
+    panic_if(dirs == NULL, "could not allocate directory list: %s", strerror(errno));
+    path_map_entry_t* e;
+    for (e = parts->buf; e != parts->buf + parts->allocated; e++) {
+        if (e->path != 0) {
+            dirs[e->value] = pm_path(parts, e);
+        }
+    }
+    for (i = 0; i < parts->used; i++) {
+        fprintf(compile_file, "    ");
+        fprint_c_string(compile_file, file_name_cat(&fn, dirs[i], PART_NAME));
+        fprintf(compile_file, ",\n");
+    }
+    fprintf(compile_file, "    NULL,\n};\n");
+    free(dirs);
+    pm_free(parts);
+
+    fprintf(compile_file, "%s", static_main);
+    fclose(compile_file);
+    file_name_uninit(&fn);
+}
+
+void out_compile_instructions(char* out_dir, compile_options_t* opts, name_buf_t* file_buf)
+{
+    unity_plan_t plan;
+    unity_plan(opts, file_buf, &plan);
+    out_unity(out_dir, &plan, file_buf);
+
+    file_name_t fn;
+    file_name_init(&fn);
+    char* out_buf = NULL;
+    size_t out_len = 0;
+    bool pch = pch_render(opts, file_buf, &out_buf, &out_len);
+    if (pch) {
+        write_if_changed(file_name_cat(&fn, out_dir, PCH_NAME), out_buf, out_len);
+        free(out_buf);
+    } else {
+        unlink(file_name_cat(&fn, out_dir, PCH_NAME));
+    }
+
+    render_compile_instructions(opts, &plan, pch, file_buf, &out_buf, &out_len);
+    write_if_changed(file_name_cat(&fn, out_dir, "compile.c"), out_buf, out_len);
+    file_name_uninit(&fn);
+    free(out_buf);
+    free(plan.batch);
+}
+
+// archive
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// A single file package: header, the contents of every file (and compile.c) each starting on an ARCHIVE_ALIGN boundary, an
+// index of (offset, size, hash, path) records and a fixed size trailer that locates the index. Integers are little endian.
+// With --compress an entry that shrinks is stored as its size followed by an lib/lz.h block and flagged ARCHIVE_LZ, its hash
+// stays the one of the original contents. Such archives start with unpack.c, stored as is, which extracts them without pp.
+
+#define ARCHIVE_MAGIC "PPARCH1"
+#define ARCHIVE_INDEX_MAGIC "PPINDX1"
+#define ARCHIVE_ALIGN 64
+#define ARCHIVE_LZ 1
+#define ARCHIVE_BATCH 1024 // files read and compressed in parallel before they are written
+
+typedef struct archive_header_t archive_header_t;
+struct archive_header_t {
+    char magic[8];
+    uint64_t align;
+};
+
+typedef struct archive_entry_t archive_entry_t;
+struct archive_entry_t {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+    uint32_t path_len; // the path follows, padded to 8 bytes
+    uint32_t flags;
+};
+
+typedef struct archive_trailer_t archive_trailer_t;
+struct archive_trailer_t {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t n_entries;
+    char magic[8];
+};
+
+// An entry path is relative and has no ".." part, so that extracting it cannot write outside the directory extracted into.
+// Archives of earlier versions stored "./" prefixes, "." parts are accepted. The function is compiled here and pasted into
+// unpack.c as text, so pp -x and unpack.c accept the same paths.
+#define ENTRY_PATH_OK                                                                                                         \
+    static int entry_path_ok(const char* path, uint64_t len)                                                                  \
+    {                                                                                                                         \
+        if (len == 0 || path[0] == '/' || memchr(path, 0, len)) {                                                             \
+            return 0;                                                                                                         \
+        }                                                                                                                     \
+        uint64_t start;                                                                                                       \
+        uint64_t end;                                                                                                         \
+        for (start = 0; start < len; start = end + 1) {                                                                       \
+            for (end = start; end < len && path[end] != '/'; end++) {                                                         \
+            }                                                                                                                 \
+            if (end - start == 2 && path[start] == '.' && path[start + 1] == '.') {                                           \
+                return 0;                                                                                                     \
+            }                                                                                                                 \
+        }                                                                                                                     \
+        return 1;                                                                                                             \
+    }
+
+ENTRY_PATH_OK
+
+#define STRINGIFY_(...) #__VA_ARGS__
+#define STRINGIFY(...) STRINGIFY_(__VA_ARGS__)
+
+char static_unpack[] = "// unpack.c: extracts a pp archive without pp\n"
+                       "//     tail -c +65 prog.ppa | sed '/^\\/\\/ end of unpack.c$/q' > unpack.c\n"
+                       "//     cc unpack.c -o unpack && ./unpack prog.ppa [directory]\n"
+                       "// The archive is a 16 byte header, the entries, an index of (offset, size, xxh64 hash, path length, flags, path) records and a\n"
+                       "// 32 byte trailer locating the index, all little endian. Entries flagged 1 hold their size followed by an LZ4 block.\n"
+                       "#include <errno.h>\n"
+                       "#include <fcntl.h>\n"
+                       "#include <stdint.h>\n"
+                       "#include <stdio.h>\n"
+                       "#include <stdlib.h>\n"
+                       "#include <string.h>\n"
+                       "#include <sys/mman.h>\n"
+                       "#include <sys/stat.h>\n"
+                       "#include <unistd.h>\n"
+                       "\n"
+                       "static void fail(const char* what, const char* name)\n"
+                       "{\n"
+                       "    fprintf(stderr, \"unpack: %s %s\\n\", what, name);\n"
+                       "    exit(1);\n"
+                       "}\n"
+                       "\n"
+                       "static uint64_t get(const uint8_t* p, int n)\n"
+                       "{\n"
+                       "    uint64_t v = 0;\n"
+                       "    while (n-- > 0) {\n"
+                       "        v = v << 8 | p[n];\n"
+                       "    }\n"
+                       "    return v;\n"
+                       "}\n"
+                       "\n"
+                       "static uint64_t rotl(uint64_t x, int r)\n"
+                       "{\n"
+                       "    return (x << r) | (x >> (64 - r));\n"
+                       "}\n"
+                       "\n"
+                       "static const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,\n"
+                       "                      P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;\n"
+                       "\n"
+                       "static uint64_t round64(uint64_t acc, uint64_t in)\n"
+                       "{\n"
+                       "    return rotl(acc + in * P2, 31) * P1;\n"
+                       "}\n"
+                       "\n"
+                       "static uint64_t xxh64(const uint8_t* p, uint64_t len)\n"
+                       "{\n"
+                       "    const uint8_t* end = p + len;\n"
+                       "    uint64_t h = P5;\n"
+                       "    if (len >= 32) {\n"
+                       "        uint64_t v[4] = { P1 + P2, P2, 0, -P1 };\n"
+                       "        int i;\n"
+                       "        for (; p + 32 <= end; p += 32) {\n"
+                       "            for (i = 0; i < 4; i++) {\n"
+                       "                v[i] = round64(v[i], get(p + 8 * i, 8));\n"
+                       "            }\n"
+                       "        }\n"
+                       "        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);\n"
+                       "        for (i = 0; i < 4; i++) {\n"
+                       "            h = (h ^ round64(0, v[i])) * P1 + P4;\n"
+                       "        }\n"
+                       "    }\n"
+                       "    h += len;\n"
+                       "    for (; p + 8 <= end; p += 8) {\n"
+                       "        h = rotl(h ^ round64(0, get(p, 8)), 27) * P1 + P4;\n"
+                       "    }\n"
+                       "    if (p + 4 <= end) {\n"
+                       "        h = rotl(h ^ get(p, 4) * P1, 23) * P2 + P3;\n"
+                       "        p += 4;\n"
+                       "    }\n"
+                       "    for (; p < end; p++) {\n"
+                       "        h = rotl(h ^ *p * P5, 11) * P1;\n"
+                       "    }\n"
+                       "    h = (h ^ h >> 33) * P2;\n"
+                       "    h = (h ^ h >> 29) * P3;\n"
+                       "    return h ^ h >> 32;\n"
+                       "}\n"
+                       "\n"
+                       "static int length(const uint8_t** ip, const uint8_t* end, uint64_t* n)\n"
+                       "{\n"
+                       "    uint8_t b;\n"
+                       "    do {\n"
+                       "        if (*ip >= end) {\n"
+                       "            return 0;\n"
+                       "        }\n"
+                       "        b = *(*ip)++;\n"
+                       "        *n += b;\n"
+                       "    } while (b == 255);\n"
+                       "    return 1;\n"
+                       "}\n"
+                       "\n"
+                       "// sequences of a token (literal count << 4 | match length - 4, 15 meaning more length bytes follow), the literals, a 16 bit\n"
+                       "// offset and the extra match length bytes; the last sequence has no match\n"
+                       "static int decode(const uint8_t* ip, const uint8_t* end, uint8_t* out, uint64_t out_n)\n"
+                       "{\n"
+                       "    uint8_t* op = out;\n"
+                       "    while (ip < end) {\n"
+                       "        uint8_t token = *ip++;\n"
+                       "        uint64_t n = token >> 4;\n"
+                       "        if ((n == 15 && !length(&ip, end, &n)) || n > (uint64_t)(end - ip) || n > out_n - (op - out)) {\n"
+                       "            return 0;\n"
+                       "        }\n"
+                       "        memcpy(op, ip, n);\n"
+                       "        ip += n;\n"
+                       "        op += n;\n"
+                       "        if (ip == end) {\n"
+                       "            break;\n"
+                       "        }\n"
+                       "        if (end - ip < 2) {\n"
+                       "            return 0;\n"
+                       "        }\n"
+                       "        uint64_t offset = get(ip, 2);\n"
+                       "        ip += 2;\n"
+                       "        n = token & 15;\n"
+                       "        if ((n == 15 && !length(&ip, end, &n)) || offset == 0 || offset > (uint64_t)(op - out) || n + 4 > out_n - (op - out)) {\n"
+                       "            return 0;\n"
+                       "        }\n"
+                       "        for (n += 4; n > 0; n--, op++) {\n"
+                       "            *op = op[-offset];\n"
+                       "        }\n"
+                       "    }\n"
+                       "    return (uint64_t)(op - out) == out_n;\n"
+                       "}\n"
+                       "\n"
+                       "// the check of pp -x, rejects absolute paths and \"..\" parts\n"
+                       STRINGIFY(ENTRY_PATH_OK) "\n"
+                       "\n"
+                       "static void make_parents(char* path)\n"
+                       "{\n"
+                       "    char* p;\n"
+                       "    for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {\n"
+                       "        *p = 0;\n"
+                       "        if (mkdir(path, 0755) < 0 && errno != EEXIST) {\n"
+                       "            fail(strerror(errno), path);\n"
+                       "        }\n"
+                       "        *p = '/';\n"
+                       "    }\n"
+                       "}\n"
+                       "\n"
+                       "int main(int argc, char** argv)\n"
+                       "{\n"
+                       "    if (argc < 2 || argc > 3) {\n"
+                       "        fprintf(stderr, \"usage: %s ARCHIVE [directory]\\n\", argv[0]);\n"
+                       "        return 1;\n"
+                       "    }\n"
+                       "    const char* dir = argc == 3 ? argv[2] : \"package\";\n"
+                       "    int fd = open(argv[1], O_RDONLY);\n"
+                       "    struct stat st;\n"
+                       "    if (fd < 0 || fstat(fd, &st) < 0) {\n"
+                       "        fail(strerror(errno), argv[1]);\n"
+                       "    }\n"
+                       "    uint64_t size = st.st_size;\n"
+                       "    const uint8_t* data = size >= 48 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;\n"
+                       "    if (data == MAP_FAILED) {\n"
+                       "        fail(\"not an archive:\", argv[1]);\n"
+                       "    }\n"
+                       "    const uint8_t* trailer = data + size - 32;\n"
+                       "    if (memcmp(data, \"PPARCH1\", 8) != 0 || memcmp(trailer + 24, \"PPINDX1\", 8) != 0 || get(trailer, 8) > size\n"
+                       "        || get(trailer + 8, 8) > size - get(trailer, 8)) {\n"
+                       "        fail(\"not an archive:\", argv[1]);\n"
+                       "    }\n"
+                       "    const uint8_t* p = data + get(trailer, 8);\n"
+                       "    const uint8_t* index_end = p + get(trailer + 8, 8);\n"
+                       "    uint64_t n_entries = get(trailer + 16, 8);\n"
+                       "    uint64_t i;\n"
+                       "    // every path is checked before anything is written\n"
+                       "    const uint8_t* q = p;\n"
+                       "    for (i = 0; i < n_entries; i++) {\n"
+                       "        if (q + 32 > index_end || q + 32 + get(q + 24, 4) > index_end) {\n"
+                       "            fail(\"corrupt index in\", argv[1]);\n"
+                       "        }\n"
+                       "        if (!entry_path_ok((const char*)q + 32, get(q + 24, 4))) {\n"
+                       "            fail(\"entry outside the directory in\", argv[1]);\n"
+                       "        }\n"
+                       "        q += 32 + ((get(q + 24, 4) + 7) & ~7ull);\n"
+                       "    }\n"
+                       "    for (i = 0; i < n_entries; i++) {\n"
+                       "        if (p + 32 > index_end || p + 32 + get(p + 24, 4) > index_end) {\n"
+                       "            fail(\"corrupt index in\", argv[1]);\n"
+                       "        }\n"
+                       "        uint64_t offset = get(p, 8);\n"
+                       "        uint64_t n = get(p + 8, 8);\n"
+                       "        uint64_t len = get(p + 24, 4);\n"
+                       "        uint64_t flags = get(p + 28, 4);\n"
+                       "        char* path = malloc(strlen(dir) + len + 2);\n"
+                       "        sprintf(path, \"%s/%.*s\", dir, (int)len, (const char*)p + 32);\n"
+                       "        if (offset > size || n > size - offset || flags > 1 || (flags == 1 && n < 8)) {\n"
+                       "            fail(\"corrupt entry\", path);\n"
+                       "        }\n"
+                       "        const uint8_t* contents = data + offset;\n"
+                       "        uint8_t* decoded = NULL;\n"
+                       "        if (flags == 1) {\n"
+                       "            uint64_t raw = get(contents, 8);\n"
+                       "            decoded = malloc(raw + 1);\n"
+                       "            if (decoded == NULL || !decode(contents + 8, contents + n, decoded, raw)) {\n"
+                       "                fail(\"corrupt entry\", path);\n"
+                       "            }\n"
+                       "            contents = decoded;\n"
+                       "            n = raw;\n"
+                       "        }\n"
+                       "        if (xxh64(contents, n) != get(p + 16, 8)) {\n"
+                       "            fail(\"checksum mismatch for\", path);\n"
+                       "        }\n"
+                       "        make_parents(path);\n"
+                       "        int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);\n"
+                       "        if (out < 0) {\n"
+                       "            fail(strerror(errno), path);\n"
+                       "        }\n"
+                       "        while (n > 0) {\n"
+                       "            ssize_t w = write(out, contents, n);\n"
+                       "            if (w < 0 && errno != EINTR) {\n"
+                       "                fail(strerror(errno), path);\n"
+                       "            }\n"
+                       "            contents += w > 0 ? w : 0;\n"
+                       "            n -= w > 0 ? w : 0;\n"
+                       "        }\n"
+                       "        close(out);\n"
+                       "        free(decoded);\n"
+                       "        free(path);\n"
+                       "        p += 32 + ((len + 7) & ~7ull);\n"
+                       "    }\n"
+                       "    return 0;\n"
+                       "}\n"
+                       "// end of unpack.c\n";
+
+uint64_t align_up(uint64_t n, uint64_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+void write_all_at(int fd, void* buf, uint64_t len, uint64_t offset, char* name)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        panic_if(n < 0, "could not write %s: %s", name, strerror(errno));
+        p += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+typedef struct archive_writer_t archive_writer_t;
+struct archive_writer_t {
+    int fd;
+    char* name;
+    uint64_t offset;
+    FILE* index; // memstream collecting the index records
+    char* index_buf;
+    size_t index_len;
+    uint64_t n_entries;
+    bool compress;
+    uint64_t n_packed; // entries stored compressed
+    uint64_t raw_bytes; // of the entries offered for compression, before and after
+    uint64_t packed_bytes;
+    double pack_seconds;
+    bool dedup;
+    blob_set_t blobs;
+    archive_entry_t* written; // every entry so far, for dedup
+    dedup_stats_t dedup_stats;
+};
+
+// the contents of one entry as they are stored
+typedef struct archive_blob_t archive_blob_t;
+struct archive_blob_t {
+    uint8_t* data;
+    uint64_t size;
+    uint64_t raw_size;
+    uint64_t hash; // of the original contents
+    uint32_t flags;
+    uint8_t* packed; // owns data when compressed
+};
+
+// hashes size bytes at data and, with compress, stores them compressed if that makes them smaller
+void archive_pack(archive_blob_t* b, void* data, uint64_t size, bool compress)
+{
+    *b = (archive_blob_t) { data, size, size, hash64(data, size, 0), 0, NULL };
+    if (!compress || size == 0) {
+        return;
+    }
+    uint8_t* packed = malloc(sizeof(size) + lz_bound(size));
+    panic_if(packed == NULL, "could not allocate compression buffer: %s", strerror(errno));
+    uint64_t packed_size = sizeof(size) + lz_compress(data, size, packed + sizeof(size));
+    if (packed_size >= size) {
+        free(packed);
+        return;
+    }
+    memcpy(packed, &size, sizeof(size));
+    uint8_t* shrunk = realloc(packed, packed_size);
+    b->packed = b->data = shrunk != NULL ? shrunk : packed;
+    b->size = packed_size;
+    b->flags = ARCHIVE_LZ;
+}
+
+// the path path is stored under, without "." and empty parts
+char* archive_entry_name(char* path, file_name_t* fn)
+{
+    panic_if(!entry_path_ok(path, strlen(path)),
+        "could not add %s to the archive: only paths below the current directory can be extracted, run pp from above the tree",
+        path);
+    file_name_reserve(fn, strlen(path) + 1);
+    char* out = fn->buf;
+    char* p = path;
+    while (*p != 0) {
+        char* end = strchrnul(p, '/');
+        if (end - p > 1 || (end - p == 1 && *p != '.')) {
+            if (out != fn->buf) {
+                *out++ = '/';
+            }
+            memcpy(out, p, end - p);
+            out += end - p;
+        }
+        p = *end == 0 ? end : end + 1;
+    }
+    *out = 0;
+    panic_if(out == fn->buf, "could not add %s to the archive: it names no file", path);
+    return fn->buf;
+}
+
+// true if the data stored for e is that of b, compression is deterministic so equal contents are stored the same
+bool archive_stored_equal(archive_writer_t* a, archive_entry_t* e, archive_blob_t* b)
+{
+    if (e->size != b->size || e->flags != b->flags) {
+        return 0;
+    }
+    uint8_t buf[1 << 16];
+    uint64_t done = 0;
+    while (done < b->size) {
+        uint64_t len = b->size - done < sizeof(buf) ? b->size - done : sizeof(buf);
+        ssize_t n = pread(a->fd, buf, len, e->offset + done);
+        panic_if(n <= 0, "could not read back %s: %s", a->name, n < 0 ? strerror(errno) : "unexpected end of file");
+        if (memcmp(buf, b->data + done, n) != 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+void archive_put(archive_writer_t* a, char* path, archive_blob_t* b)
+{
+    file_name_t fn;
+    file_name_init(&fn);
+    path = archive_entry_name(path, &fn);
+    archive_entry_t e = { 0 };
+    e.offset = align_up(a->offset, ARCHIVE_ALIGN);
+    e.size = b->size;
+    e.hash = b->hash;
+    e.path_len = strlen(path);
+    e.flags = b->flags;
+    uint64_t first = a->n_entries;
+    if (a->dedup) {
+        if (b->raw_size > 0) {
+            first = blob_set_first(&a->blobs, b->hash, b->raw_size, a->n_entries);
+        }
+        if (first != a->n_entries && !archive_stored_equal(a, &a->written[first], b)) {
+            first = a->n_entries;
+        }
+        a->dedup_stats.files++;
+        a->dedup_stats.bytes += b->raw_size;
+        if ((a->n_entries & (a->n_entries - 1)) == 0) {
+            a->written = realloc(a->written, (a->n_entries ? a->n_entries << 1 : 1) * sizeof(*a->written));
+            panic_if(a->written == NULL, "could not allocate dedup table: %s", strerror(errno));
+        }
+    }
+    if (first != a->n_entries) {
+        // the data stays where the first entry with this content put it
+        e.offset = a->written[first].offset;
+        e.size = a->written[first].size;
+        e.flags = a->written[first].flags;
+        a->dedup_stats.duplicates++;
+        a->dedup_stats.duplicate_bytes += b->raw_size;
+        a->dedup_stats.shared++;
+    } else {
+        write_all_at(a->fd, b->data, b->size, e.offset, a->name);
+        a->offset = e.offset + b->size;
+        if (a->compress) {
+            a->n_packed += b->flags == ARCHIVE_LZ;
+            a->raw_bytes += b->raw_size;
+            a->packed_bytes += b->size;
+        }
+    }
+    if (a->dedup) {
+        a->written[a->n_entries] = e;
+    }
+
+    static char zero[8];
+    fwrite(&e, sizeof(e), 1, a->index);
+    fwrite(path, 1, e.path_len, a->index);
+    fwrite(zero, 1, align_up(e.path_len, 8) - e.path_len, a->index);
+    a->n_entries++;
+    file_name_uninit(&fn);
+}
+
+void archive_add(archive_writer_t* a, char* path, void* data, uint64_t size)
+{
+    double start = wall_seconds();
+    archive_blob_t b;
+    archive_pack(&b, data, size, a->compress);
+    a->pack_seconds += wall_seconds() - start;
+    archive_put(a, path, &b);
+    free(b.packed);
+}
+
+// a file of the package, mapped and packed by an archive_packer_t thread
+typedef struct archive_file_t archive_file_t;
+struct archive_file_t {
+    char* path;
+    void* map;
+    uint64_t map_size;
+    archive_blob_t blob;
+};
+
+void archive_read_file(archive_file_t* f, bool compress)
+{
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    panic_if(fd < 0, "could not open %s: %s", f->path, strerror(errno));
+    struct stat st;
+    panic_if(fstat(fd, &st) < 0, "could not stat %s: %s", f->path, strerror(errno));
+    stat_add(STAT_OPEN, 1);
+    stat_add(STAT_STAT, 1);
+    stat_add(STAT_FILES_COPIED, 1);
+    stat_add(STAT_BYTES_COPIED, st.st_size);
+    f->map = NULL;
+    f->map_size = st.st_size;
+    if (st.st_size > 0) {
+        f->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        panic_if(f->map == MAP_FAILED, "could not map %s: %s", f->path, strerror(errno));
+    }
+    close(fd);
+    archive_pack(&f->blob, f->map, f->map_size, compress);
+}
+
+// maps and packs the files first .. first + n of file_buf into files
+typedef struct archive_packer_t archive_packer_t;
+struct archive_packer_t {
+    name_buf_t* file_buf;
+    archive_file_t* files;
+    uint64_t first;
+    uint64_t n;
+    bool compress;
+    atomic_uint_fast64_t next;
+};
+
+void* archive_pack_worker(void* arg)
+{
+    archive_packer_t* p = arg;
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    while ((i = atomic_fetch_add(&p->next, 1)) < p->n) {
+        p->files[i].path = strdup(nb_path(p->file_buf, NULL, p->first + i, &fn));
+        panic_if(p->files[i].path == NULL, "could not allocate path: %s", strerror(errno));
+        archive_read_file(&p->files[i], p->compress);
+    }
+    file_name_uninit(&fn);
+    return NULL;
+}
+
+// Adds every file of file_buf. Each batch of ARCHIVE_BATCH files is mapped, hashed and compressed by n_threads threads and
+// then written in order, so the layout does not depend on the thread count.
+void archive_add_files(archive_writer_t* a, name_buf_t* file_buf, uint64_t n_threads)
+{
+    archive_packer_t p = { 0 };
+    p.file_buf = file_buf;
+    p.compress = a->compress;
+    p.files = malloc(ARCHIVE_BATCH * sizeof(*p.files));
+    pthread_t* threads = malloc(n_threads * sizeof(*threads));
+    panic_if(p.files == NULL || threads == NULL, "could not allocate archive batch: %s", strerror(errno));
+    uint64_t i;
+    for (p.first = 0; p.first < file_buf->used; p.first += p.n) {
+        p.n = file_buf->used - p.first < ARCHIVE_BATCH ? file_buf->used - p.first : ARCHIVE_BATCH;
+        atomic_init(&p.next, 0);
+        uint64_t n_workers = n_threads < p.n ? n_threads : p.n;
+        double start = wall_seconds();
+        if (n_workers <= 1) {
+            archive_pack_worker(&p);
+        } else {
+            for (i = 0; i < n_workers; i++) {
+                panic_if(pthread_create(&threads[i], NULL, archive_pack_worker, &p) != 0, "could not start archive thread");
+            }
+            for (i = 0; i < n_workers; i++) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+        a->pack_seconds += wall_seconds() - start;
+        for (i = 0; i < p.n; i++) {
+            archive_file_t* f = &p.files[i];
+            archive_put(a, f->path, &f->blob);
+            free(f->blob.packed);
+            if (f->map != NULL) {
+                munmap(f->map, f->map_size);
+            }
+            free(f->path);
+        }
+    }
+    free(p.files);
+    free(threads);
+}
+
+// writes every file of file_buf and compile.c into the archive archive_name, compressed with compress, storing identical
+// contents once with dedup
+void out_archive(char* archive_name, compile_options_t* opts, name_buf_t* file_buf, bool compress, bool dedup, uint64_t n_threads)
+{
+    archive_writer_t a = { 0 };
+    a.dedup = dedup;
+    panic_if(asprintf(&a.name, "%s.tmp", archive_name) < 0, "could not allocate archive name");
+    a.fd = open(a.name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    panic_if(a.fd < 0, "could not open %s: %s", a.name, strerror(errno));
+    a.index = open_memstream(&a.index_buf, &a.index_len);
+    panic_if(a.index == NULL, "could not allocate archive index");
+
+    archive_header_t header = { ARCHIVE_MAGIC, ARCHIVE_ALIGN };
+    write_all_at(a.fd, &header, sizeof(header), 0, a.name);
+    a.offset = sizeof(header);
+
+    if (compress) {
+        // first and as is, at ARCHIVE_ALIGN: tail -c +65 | sed '/^\/\/ end of unpack.c$/q' gets it out without pp
+        archive_add(&a, "unpack.c", static_unpack, strlen(static_unpack));
+        a.compress = 1;
+    }
+    archive_add_files(&a, file_buf, n_threads);
+    uint64_t i;
+
+    unity_plan_t plan;
+    unity_plan(opts, file_buf, &plan);
+    char name[64];
+    char* buf = NULL;
+    size_t len = 0;
+    for (i = 0; i < plan.n_batches; i++) {
+        snprintf(name, sizeof(name), UNITY_NAME, (unsigned long long)i);
+        unity_render(&plan, file_buf, i, &buf, &len);
+        archive_add(&a, name, buf, len);
+        free(buf);
+    }
+
+    bool pch = pch_render(opts, file_buf, &buf, &len);
+    if (pch) {
+        archive_add(&a, PCH_NAME, buf, len);
+        free(buf);
+    }
+
+    render_compile_instructions(opts, &plan, pch, file_buf, &buf, &len);
+    archive_add(&a, "compile.c", buf, len);
+    free(buf);
+    free(plan.batch);
+
+    fclose(a.index);
+    archive_trailer_t trailer = { 0 };
+    trailer.index_offset = align_up(a.offset, 8);
+    trailer.index_size = a.index_len;
+    trailer.n_entries = a.n_entries;
+    memcpy(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic));
+    write_all_at(a.fd, a.index_buf, a.index_len, trailer.index_offset, a.name);
+    write_all_at(a.fd, &trailer, sizeof(trailer), trailer.index_offset + a.index_len, a.name);
+    panic_if(close(a.fd) < 0, "could not write %s: %s", a.name, strerror(errno));
+    panic_if(rename(a.name, archive_name) < 0, "could not rename %s: %s", a.name, strerror(errno));
+    if (compress) {
+        fprintf(report_out(), "compressed %llu of %llu entries: %.1f MB -> %.1f MB (%.2fx) in %.3fs, %.2f GB/s on %llu thread%s\n",
+               (unsigned long long)a.n_packed, (unsigned long long)a.n_entries - 1, a.raw_bytes / 1e6, a.packed_bytes / 1e6,
+               a.packed_bytes > 0 ? (double)a.raw_bytes / a.packed_bytes : 1.0, a.pack_seconds,
+               a.pack_seconds > 0 ? a.raw_bytes / a.pack_seconds / 1e9 : 0.0, (unsigned long long)n_threads, n_threads == 1 ? "" : "s");
+    }
+    if (dedup) {
+        dedup_report(&a.dedup_stats);
+        free(a.blobs.buf);
+        free(a.written);
+    }
+
+    free(a.index_buf);
+    free(a.name);
+}
+
+// extraction
+//--------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct archive_t archive_t;
+struct archive_t {
+    char* name;
+    uint8_t* data;
+    uint64_t size;
+    archive_entry_t** entries;
+    uint64_t n_entries;
+    atomic_uint_fast64_t n_unpacked; // ARCHIVE_LZ entries extracted, their size before and after, and the time it took
+    atomic_uint_fast64_t packed_bytes;
+    atomic_uint_fast64_t unpacked_bytes;
+    atomic_uint_fast64_t unpack_nanoseconds;
+};
+
+void archive_open(archive_t* a, char* name)
+{
+    a->name = name;
+    atomic_init(&a->n_unpacked, 0);
+    atomic_init(&a->packed_bytes, 0);
+    atomic_init(&a->unpacked_bytes, 0);
+    atomic_init(&a->unpack_nanoseconds, 0);
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    panic_if(fd < 0, "could not open %s: %s", name, strerror(errno));
+    struct stat st;
+    panic_if(fstat(fd, &st) < 0, "could not stat %s: %s", name, strerror(errno));
+    a->size = st.st_size;
+    panic_if(a->size < sizeof(archive_header_t) + sizeof(archive_trailer_t), "%s is not an archive", name);
+    a->data = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+    panic_if(a->data == MAP_FAILED, "could not map %s: %s", name, strerror(errno));
+    close(fd);
+
+    archive_header_t* header = (archive_header_t*)a->data;
+    archive_trailer_t* trailer = (archive_trailer_t*)(a->data + a->size - sizeof(archive_trailer_t));
+    panic_if(memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0
+            || memcmp(trailer->magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer->magic)) != 0
+            || trailer->index_offset + trailer->index_size + sizeof(*trailer) != a->size,
+        "%s is not an archive", name);
+
+    a->n_entries = trailer->n_entries;
+    a->entries = malloc(a->n_entries * sizeof(*a->entries) + 1);
+    panic_if(a->entries == NULL, "could not allocate archive index: %s", strerror(errno));
+    uint8_t* p = a->data + trailer->index_offset;
+    uint8_t* end = p + trailer->index_size;
+    uint64_t i;
+    for (i = 0; i < a->n_entries; i++) {
+        archive_entry_t* e = (archive_entry_t*)p;
+        panic_if(p + sizeof(*e) > end || p + sizeof(*e) + e->path_len > end || e->offset + e->size > trailer->index_offset,
+            "corrupt index in %s", name);
+        a->entries[i] = e;
+        p += sizeof(*e) + align_up(e->path_len, 8);
+    }
+}
+
+void archive_close(archive_t* a)
+{
+    munmap(a->data, a->size);
+    free(a->entries);
+}
+
+// the index stores the path without a terminator
+char* archive_entry_path(archive_entry_t* e, file_name_t* fn)
+{
+    file_name_reserve(fn, e->path_len + 1);
+    memcpy(fn->buf, (char*)(e + 1), e->path_len);
+    fn->buf[e->path_len] = 0;
+    return fn->buf;
+}
+
+void archive_extract_entry(archive_t* a, archive_entry_t* e, char* out_dir)
+{
+    file_name_t path;
+    file_name_t fn;
+    file_name_init(&path);
+    file_name_init(&fn);
+    char* dest_name = file_name_cat(&fn, out_dir, archive_entry_path(e, &path));
+    uint8_t* data = a->data + e->offset;
+    uint64_t size = e->size;
+    uint8_t* unpacked = NULL;
+    panic_if((e->flags & ~ARCHIVE_LZ) != 0, "%s: unknown format of %s", a->name, path.buf);
+    if (e->flags == ARCHIVE_LZ) {
+        panic_if(size < sizeof(size), "%s: corrupt entry %s", a->name, path.buf);
+        memcpy(&size, data, sizeof(size));
+        unpacked = malloc(size + 1);
+        panic_if(unpacked == NULL, "could not allocate %s: %s", path.buf, strerror(errno));
+        double start = wall_seconds();
+        panic_if(!lz_decompress(data + sizeof(size), e->size - sizeof(size), unpacked, size), "%s: corrupt entry %s", a->name,
+            path.buf);
+        atomic_fetch_add(&a->unpack_nanoseconds, (uint64_t)((wall_seconds() - start) * 1e9));
+        atomic_fetch_add(&a->n_unpacked, 1);
+        atomic_fetch_add(&a->packed_bytes, e->size);
+        atomic_fetch_add(&a->unpacked_bytes, size);
+        data = unpacked;
+    }
+    panic_if(hash64(data, size, 0) != e->hash, "%s: checksum mismatch for %s", a->name, path.buf);
+
+    char* slash = strrchr(dest_name, '/');
+    *slash = 0;
+    make_dir(dest_name);
+    *slash = '/';
+    int fd = open(dest_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    panic_if(fd < 0, "could not open %s: %s", dest_name, strerror(errno));
+    stat_add(STAT_OPEN, 1);
+    stat_add(STAT_FILES_COPIED, 1);
+    stat_add(STAT_BYTES_COPIED, size);
+    write_all_at(fd, data, size, 0, dest_name);
+    close(fd);
+    free(unpacked);
+    file_name_uninit(&path);
+    file_name_uninit(&fn);
+}
+
+typedef struct extractor_t extractor_t;
+struct extractor_t {
+    archive_t* archive;
+    char* out_dir;
+    archive_entry_t** todo;
+    uint64_t n_todo;
+    atomic_uint_fast64_t next;
+};
+
+void* extract_worker(void* arg)
+{
+    extractor_t* x = arg;
+    uint64_t i;
+    while ((i = atomic_fetch_add(&x->next, 1)) < x->n_todo) {
+        archive_extract_entry(x->archive, x->todo[i], x->out_dir);
+    }
+    return NULL;
+}
+
+// extracts the entries named in wanted (all of them if n_wanted is 0) into out_dir with n_threads threads
+void extract_archive(char* archive_name, char* out_dir, char** wanted, uint64_t n_wanted, uint64_t n_threads)
+{
+    archive_t a;
+    archive_open(&a, archive_name);
+
+    extractor_t x = { 0 };
+    x.archive = &a;
+    x.out_dir = out_dir;
+    x.todo = malloc(a.n_entries * sizeof(*x.todo) + 1);
+    panic_if(x.todo == NULL, "could not allocate archive index: %s", strerror(errno));
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t i;
+    uint64_t j;
+    for (i = 0; i < a.n_entries; i++) {
+        panic_if(!entry_path_ok((char*)(a.entries[i] + 1), a.entries[i]->path_len), "%s: entry %s would be extracted outside %s",
+            archive_name, archive_entry_path(a.entries[i], &fn), out_dir);
+        bool want = n_wanted == 0;
+        char* path = strip_dot_slash(archive_entry_path(a.entries[i], &fn));
+        for (j = 0; j < n_wanted && !want; j++) {
+            want = strcmp(strip_dot_slash(wanted[j]), path) == 0;
+        }
+        if (want) {
+            x.todo[x.n_todo++] = a.entries[i];
+        }
+    }
+    file_name_uninit(&fn);
+    panic_if(n_wanted > 0 && x.n_todo == 0, "no matching entries in %s", archive_name);
+    atomic_init(&x.next, 0);
+
+    make_dir(out_dir);
+    if (n_threads > x.n_todo) {
+        n_threads = x.n_todo;
+    }
+    if (n_threads <= 1) {
+        extract_worker(&x);
+    } else {
+        pthread_t* threads = malloc(n_threads * sizeof(*threads));
+        panic_if(threads == NULL, "could not allocate extract threads: %s", strerror(errno));
+        for (i = 0; i < n_threads; i++) {
+            panic_if(pthread_create(&threads[i], NULL, extract_worker, &x) != 0, "could not start extract thread");
+        }
+        for (i = 0; i < n_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+    uint64_t n_unpacked = atomic_load(&a.n_unpacked);
+    if (n_unpacked > 0) {
+        double seconds = atomic_load(&a.unpack_nanoseconds) / 1e9;
+        uint64_t unpacked_bytes = atomic_load(&a.unpacked_bytes);
+        fprintf(report_out(), "decompressed %llu entries: %.1f MB -> %.1f MB in %.3fs, %.2f GB/s per thread\n",
+               (unsigned long long)n_unpacked, atomic_load(&a.packed_bytes) / 1e6, unpacked_bytes / 1e6, seconds, seconds > 0 ? unpacked_bytes / seconds / 1e9 : 0.0);
+    }
+
+    free(x.todo);
+    archive_close(&a);
+}
+
+// watch mode
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// After the first pass --watch follows the source tree with one inotify watch per directory and applies every change to the
+// package on its own: written or moved in files are packaged again, deleted or moved out ones are removed with their object.
+// Events are collected until the tree has been quiet for WATCH_QUIET_MS, so the write, rename and chmod of one save end up in
+// a single update. compile.c is only regenerated when a translation unit appeared or vanished.
+
+#define WATCH_QUIET_MS 20
+#define WATCH_MAX_WAIT 0.5 // seconds, an update is applied after this even if events keep coming
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+typedef struct watch_t watch_t;
+struct watch_t {
+    int fd;
+    char** dirs; // source directory of every watch descriptor, NULL once the watch is gone
+    ignore_t** ignores; // the rules for the entries of every watched directory, a reference
+    uint64_t n_dirs;
+    path_map_t* changed; // source paths touched since the last update
+    manifest_t* packaged; // what the package holds, entries that are not seen were removed
+    bool overflow; // events were lost, the next update is a full pass
+    char* src_dir;
+    char* out_dir;
+    compile_options_t* opts;
+    copy_engine_t* engine;
+};
+
+void watch_drop(watch_t* w, uint64_t wd)
+{
+    free(w->dirs[wd]);
+    w->dirs[wd] = NULL;
+    ignore_unref(w->ignores[wd]);
+    w->ignores[wd] = NULL;
+}
+
+// watches dir and every directory below it that the rules of parent_ignore and the .ppignore files below keep, with add_files
+// the files already in there count as changed
+void watch_tree(watch_t* w, char* dir, ignore_t* parent_ignore, bool add_files)
+{
+    int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS);
+    if (wd < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+        return;
+    }
+    panic_if(wd < 0, "could not watch %s: %s%s", dir, strerror(errno),
+        errno == ENOSPC ? " (raise /proc/sys/fs/inotify/max_user_watches)" : "");
+    if ((uint64_t)wd >= w->n_dirs) {
+        uint64_t n = w->n_dirs ? w->n_dirs : 64;
+        while (n <= (uint64_t)wd) {
+            n <<= 1;
+        }
+        w->dirs = realloc(w->dirs, n * sizeof(*w->dirs));
+        w->ignores = realloc(w->ignores, n * sizeof(*w->ignores));
+        panic_if(w->dirs == NULL || w->ignores == NULL, "could not allocate watches: %s", strerror(errno));
+        memset(w->dirs + w->n_dirs, 0, (n - w->n_dirs) * sizeof(*w->dirs));
+        memset(w->ignores + w->n_dirs, 0, (n - w->n_dirs) * sizeof(*w->ignores));
+        w->n_dirs = n;
+    }
+    watch_drop(w, wd);
+    w->dirs[wd] = strdup(dir);
+    panic_if(w->dirs[wd] == NULL, "could not allocate watches: %s", strerror(errno));
+
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        w->ignores[wd] = ignore_ref(parent_ignore);
+        return;
+    }
+    ignore_t* ig = ignore_enter(dirfd(d), parent_ignore, strlen(dir), dir);
+    w->ignores[wd] = ig;
+    file_name_t fn;
+    file_name_t sub;
+    file_name_init(&fn);
+    file_name_init(&sub);
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+            continue;
+        }
+        if (entry_is_dir(dirfd(d), entry)) {
+            if (!ignored(ig, dir, entry->d_name, 1, &fn)) {
+                watch_tree(w, file_name_cat(&sub, dir, entry->d_name), ig, add_files);
+            }
+        } else if (add_files && is_c_file(entry) && !ignored(ig, dir, entry->d_name, 0, &fn)) {
+            pm_put(w->changed, file_name_cat(&fn, dir, entry->d_name));
+        }
+    }
+    closedir(d);
+    file_name_uninit(&fn);
+    file_name_uninit(&sub);
+}
+
+bool watch_has_prefix(char* path, char* dir, uint64_t dir_len)
+{
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == 0 || path[dir_len] == '/');
+}
+
+// dir left the tree: its watches go and every file packaged from below it counts as changed
+void watch_forget(watch_t* w, char* dir)
+{
+    uint64_t dir_len = strlen(dir);
+    uint64_t i;
+    for (i = 0; i < w->n_dirs; i++) {
+        if (w->dirs[i] != NULL && watch_has_prefix(w->dirs[i], dir, dir_len)) {
+            inotify_rm_watch(w->fd, i);
+            watch_drop(w, i);
+        }
+    }
+    manifest_entry_t* e;
+    for (e = w->packaged->buf; e != w->packaged->buf + w->packaged->used; e++) {
+        char* path = w->packaged->index->names.buf + e->path;
+        if (e->seen && watch_has_prefix(path, dir, dir_len)) {
+            pm_put(w->changed, path);
+        }
+    }
+}
+
+void watch_event(watch_t* w, struct inotify_event* ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        w->overflow = 1;
+        return;
+    }
+    if (ev->wd < 0 || (uint64_t)ev->wd >= w->n_dirs || w->dirs[ev->wd] == NULL) {
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        watch_drop(w, ev->wd);
+        return;
+    }
+    if (ev->len == 0) {
+        return;
+    }
+    file_name_t fn;
+    file_name_init(&fn);
+    file_name_t match;
+    file_name_init(&match);
+    char* dir = w->dirs[ev->wd];
+    ignore_t* ig = w->ignores[ev->wd];
+    char* path = file_name_cat(&fn, dir, ev->name);
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            watch_forget(w, path);
+        }
+        if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && !ignored(ig, dir, ev->name, 1, &match)) {
+            watch_tree(w, path, ig, 1);
+        }
+    } else if (is_c_name(ev->name) && !ignored(ig, dir, ev->name, 0, &match)) {
+        pm_put(w->changed, path);
+    }
+    file_name_uninit(&match);
+    file_name_uninit(&fn);
+}
+
+// reads the pending events, waiting up to timeout_ms (-1 blocks) for the first one, returns 0 if none came
+bool watch_read(watch_t* w, int timeout_ms)
+{
+    struct pollfd pfd = { w->fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n < 0 && errno == EINTR) {
+        return 0;
+    }
+    panic_if(n < 0, "could not wait for file events: %s", strerror(errno));
+    if (n == 0) {
+        return 0;
+    }
+    char buf[64 << 10] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    panic_if(len < 0, "could not read file events: %s", strerror(errno));
+    char* p;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+        watch_event(w, (struct inotify_event*)p);
+    }
+    return 1;
+}
+
+// walks the whole tree again, to write compile.c and, with resync, to repackage everything after lost events
+void watch_walk(watch_t* w, bool resync)
+{
+    path_table_t* paths = pt_create(16);
+    name_buf_t* file_buf = nb_create(paths, 16);
+    name_buf_t* dir_buf = nb_create(paths, 16);
+    panic_if(paths == NULL || file_buf == NULL || dir_buf == NULL, "could not allocate name buffers: %s", strerror(errno));
+    push_all_files_in_directory(file_buf, dir_buf, pt_add(paths, PATH_NONE, w->src_dir), NULL);
+    if (resync) {
+        manifest_save_seen(w->out_dir, w->packaged);
+        out_structure(w->out_dir, dir_buf);
+        out_files(w->out_dir, file_buf, w->engine);
+        manifest_free(w->packaged);
+        w->packaged = manifest_load(w->out_dir);
+        manifest_entry_t* e;
+        for (e = w->packaged->buf; e != w->packaged->buf + w->packaged->used; e++) {
+            e->seen = 1;
+        }
+    }
+    out_compile_instructions(w->out_dir, w->opts, file_buf);
+    nb_free(file_buf);
+    nb_free(dir_buf);
+    pt_free(paths);
+}
+
+// brings the package up to date with the changed paths
+void watch_update(watch_t* w)
+{
+    double start = wall_seconds();
+    if (w->overflow) {
+        w->overflow = 0;
+        watch_tree(w, w->src_dir, NULL, 0);
+        watch_walk(w, 1);
+        pm_free(w->changed);
+        w->changed = pm_create(16);
+        printf("watch: events were lost, packaged the whole tree in %.1fms\n", (wall_seconds() - start) * 1000);
+        fflush(stdout);
+        return;
+    }
+
+    file_name_t fn;
+    file_name_init(&fn);
+    uint64_t examined = 0;
+    uint64_t packaged = 0;
+    uint64_t removed = 0;
+    bool sources_changed = 0;
+    path_map_entry_t* c;
+    for (c = w->changed->buf; c != w->changed->buf + w->changed->allocated; c++) {
+        if (c->path == 0) {
+            continue;
+        }
+        char* src = pm_path(w->changed, c);
+        char* dest = file_name_cat(&fn, w->out_dir, src);
+        bool is_source = src[strlen(src) - 1] == 'c';
+        manifest_entry_t* prev = manifest_get(w->packaged, src);
+        bool was_packaged = prev != NULL && prev->seen;
+        struct stat st;
+        if (stat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+            char* slash = strrchr(dest, '/');
+            *slash = 0;
+            make_dir(dest);
+            *slash = '/';
+            file_meta_t meta;
+            file_at_t dest_file = { AT_FDCWD, dest, dest };
+            file_at_t src_file = { AT_FDCWD, src, src };
+            package_file(w->engine, NULL, w->packaged, &meta, &dest_file, &src_file);
+            // a touch or a save without changes is only recorded
+            packaged += !was_packaged || prev->meta.hash != meta.hash || prev->meta.size != meta.size;
+            prev = manifest_put(w->packaged, src);
+            prev->meta = meta;
+            prev->seen = 1;
+            examined++;
+            sources_changed |= is_source && !was_packaged;
+        } else if (was_packaged) {
+            remove_packaged(dest);
+            prev->seen = 0;
+            removed++;
+            sources_changed |= is_source;
+        }
+    }
+    file_name_uninit(&fn);
+    pm_free(w->changed);
+    w->changed = pm_create(16);
+    if (examined == 0 && removed == 0) {
+        return;
+    }
+
+    manifest_save_seen(w->out_dir, w->packaged);
+    if (packaged == 0 && removed == 0) {
+        return;
+    }
+    if (sources_changed) {
+        watch_walk(w, 0);
+    }
+    printf("watch: %llu packaged, %llu removed%s in %.1fms\n", (unsigned long long)packaged, (unsigned long long)removed,
+        sources_changed ? ", compile.c regenerated" : "", (wall_seconds() - start) * 1000);
+    fflush(stdout);
+}
+
+// starts watching src_dir, before the first pass so that no change made during it is missed
+watch_t* watch_create(char* src_dir, char* out_dir, compile_options_t* opts, copy_engine_t* engine)
+{
+    watch_t* w = calloc(1, sizeof(*w));
+    panic_if(w == NULL, "could not allocate watches: %s", strerror(errno));
+    w->fd = inotify_init1(IN_CLOEXEC);
+    panic_if(w->fd < 0, "could not start watching: %s", strerror(errno));
+    w->changed = pm_create(16);
+    w->src_dir = src_dir;
+    w->out_dir = out_dir;
+    w->opts = opts;
+    w->engine = engine;
+    watch_tree(w, src_dir, NULL, 0);
+    return w;
+}
+
+// follows the tree until pp is killed, the first pass has to be done
+void watch_run(watch_t* w)
+{
+    w->packaged = manifest_load(w->out_dir);
+    manifest_entry_t* e;
+    for (e = w->packaged->buf; e != w->packaged->buf + w->packaged->used; e++) {
+        e->seen = 1;
+    }
+    printf("watching %s\n", w->src_dir);
+    fflush(stdout);
+    for (;;) {
+        if (!watch_read(w, -1)) {
+            continue;
+        }
+        double first = wall_seconds();
+        while (wall_seconds() - first < WATCH_MAX_WAIT && watch_read(w, WATCH_QUIET_MS)) {
+        }
+        watch_update(w);
+    }
+}
+
+// compile workers
+//--------------------------------------------------------------------------------------------------------------------------------
+
+// pp --serve=ADDRESS compiles preprocessed units for the -w option of compile.c, listening on unix:PATH or tcp:HOST:PORT.
+// Every request is one connection carrying a frame, a worker_frame_t header and size bytes of payload. A HELLO is answered
+// at once with the number of compile slots in status. A JOB holds the length of its NUL separated compiler and flags as 8
+// bytes, them and the preprocessed source. It waits for one of the compile threads and is answered with a RESULT: the exit
+// status of the compiler, a worker_result_t, the object and the compiler output. A JOB that finds as many jobs waiting as
+// there are slots gets BUSY, one asking for a compiler not served or a flag outside served_flags gets REFUSED with the reason,
+// and is compiled by the client itself. Workers do not authenticate their clients, so TCP ones listen on the loopback address
+// unless a host is named and belong on trusted networks.
+
+#define WORKER_MAGIC "PPWORK1"
+#define WORKER_HELLO 1
+#define WORKER_JOB 2
+#define WORKER_RESULT 3
+#define WORKER_BUSY 4
+#define WORKER_REFUSED 5
+#define WORKER_MAX_PAYLOAD (1ull << 31)
+#define WORKER_HEADER_TIMEOUT 10 // seconds a client may take to send its header, or a job its payload
+
+typedef struct worker_frame_t worker_frame_t;
+struct worker_frame_t {
+    char magic[8];
+    uint32_t type;
+    uint32_t status;
+    uint64_t size;
+};
+
+typedef struct worker_result_t worker_result_t;
+struct worker_result_t {
+    uint64_t queue_nanoseconds; // from accepting the job to starting its compile
+    uint64_t compile_nanoseconds;
+    uint64_t obj_size;
+    uint64_t log_size;
+};
+
+bool send_all(int fd, void* buf, uint64_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+bool recv_all(int fd, void* buf, uint64_t len)
+{
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+bool send_frame(int fd, uint32_t type, uint32_t status, uint64_t size)
+{
+    worker_frame_t f = { WORKER_MAGIC, type, status, size };
+    return send_all(fd, &f, sizeof(f));
+}
+
+// listens on unix:PATH, replacing a stale socket, or on tcp:HOST:PORT, an empty HOST meaning the loopback address since
+// workers do not authenticate their clients, every interface has to be named as 0.0.0.0
+int worker_listen(char* address)
+{
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        panic_if(strlen(address + 5) >= sizeof(sa.sun_path), "socket path too long: %s", address + 5);
+        strcpy(sa.sun_path, address + 5);
+        unlink(sa.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        panic_if(fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0, "could not bind %s: %s", address, strerror(errno));
+    } else {
+        panic_if(strncmp(address, "tcp:", 4) != 0 || strrchr(address, ':') == address + 3,
+            "expected unix:PATH or tcp:HOST:PORT, got %s", address);
+        char* host = strdup(address + 4);
+        char* port = strrchr(host, ':');
+        *port++ = 0;
+        // without AI_PASSIVE no host resolves to the loopback address
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        struct addrinfo* ai;
+        struct addrinfo* a;
+        int err = getaddrinfo(*host ? host : NULL, port, &hints, &ai);
+        panic_if(err != 0, "could not resolve %s: %s", address, gai_strerror(err));
+        fd = -1;
+        for (a = ai; a != NULL && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (fd >= 0 && bind(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                err = errno;
+                close(fd);
+                fd = -1;
+                errno = err;
+            }
+        }
+        panic_if(fd < 0, "could not bind %s: %s", address, strerror(errno));
+        freeaddrinfo(ai);
+        free(host);
+    }
+    panic_if(listen(fd, SOMAXCONN) < 0, "could not listen on %s: %s", address, strerror(errno));
+    return fd;
+}
+
+typedef struct server_t server_t;
+
+typedef struct served_job_t served_job_t;
+struct served_job_t {
+    server_t* server;
+    int fd;
+    uint64_t size;
+    double accepted;
+    served_job_t* next;
+};
+
+struct server_t {
+    char** compilers;
+    uint64_t n_compilers;
+    uint64_t slots;
+    char* tmp_dir;
+    bool verbose;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    served_job_t* head; // accepted jobs waiting for a compile thread
+    served_job_t* tail;
+    uint64_t waiting;
+    atomic_uint_fast64_t next_id;
+};
+
+// The flags a worker runs, everything else is refused, so that a client cannot have it load, run, read or write files by
+// name. Matched as prefixes: the flags below, "-W" ones but the -Wa, -Wl, and -Wp, pass-throughs, "-m" ones and "-f" ones
+// without a value or with one of served_f_values, and "-w" alone, as -wrapper runs a program. The source is preprocessed and nothing is linked, so include directories,
+// macros and libraries are allowed but have no effect.
+char* served_flags[] = { "-O", "-g", "-std=", "-pedantic", "-ansi", "-pthread", "-pg", "-D", "-U", "-I", "-isystem",
+    "-iquote", "-idirafter", "-l", "-L", NULL };
+// the value is the next argument when the flag is given alone
+char* served_separate_flags[] = { "-D", "-U", "-I", "-isystem", "-iquote", "-idirafter", "-l", "-L", NULL };
+// "-f" flags whose value names no file
+char* served_f_values[] = { "-fvisibility=", "-fsanitize=", "-fno-sanitize=", "-fsanitize-recover=", "-fno-sanitize-recover=",
+    "-fdiagnostics-color=", "-fdiagnostics-format=", "-fmax-errors=", "-fmessage-length=", "-ffp-contract=",
+    "-fexcess-precision=", "-fcf-protection=", "-ftls-model=", "-flto=", "-flto-partition=", "-fzero-call-used-regs=",
+    "-ftrivial-auto-var-init=", "-fstrict-flex-arrays=", "-fpatchable-function-entry=", "-falign-functions=", "-falign-loops=",
+    "-falign-jumps=", "-falign-labels=", "-finline-limit=", "-fpack-struct=", "-fabi-version=", "-fprofile-update=",
+    "-fdebug-prefix-map=", "-ffile-prefix-map=", "-fmacro-prefix-map=", NULL };
+
+bool has_prefix_in(char* arg, char** prefixes)
+{
+    for (; *prefixes != NULL; prefixes++) {
+        if (strncmp(arg, *prefixes, strlen(*prefixes)) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool served_flag_ok(char* arg)
+{
+    if (has_prefix_in(arg, served_flags) || strncmp(arg, "-m", 2) == 0 || strcmp(arg, "-w") == 0) {
+        return 1;
+    }
+    if (strncmp(arg, "-W", 2) == 0) {
+        return arg[2] == 0 || arg[3] != ',';
+    }
+    if (strncmp(arg, "-f", 2) == 0) {
+        return strchr(arg, '=') == NULL || has_prefix_in(arg, served_f_values);
+    }
+    return 0;
+}
+
+// the reason why args cannot be run, NULL if they can
+char* served_refusal(server_t* s, char** args)
+{
+    uint64_t i;
+    for (i = 0; i < s->n_compilers && strcmp(s->compilers[i], args[0]) != 0; i++) {
+    }
+    if (i == s->n_compilers) {
+        return "compiler not served";
+    }
+    char** arg;
+    char** flag;
+    for (arg = args + 1; *arg != NULL; arg++) {
+        if (!served_flag_ok(*arg)) {
+            return "flag not allowed";
+        }
+        for (flag = served_separate_flags; *flag != NULL; flag++) {
+            if (strcmp(*arg, *flag) == 0 && arg[1] != NULL) {
+                arg++;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// the whole file at path in a malloced buffer, NULL if it cannot be read
+char* read_whole_file(char* path, uint64_t* size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char* buf = malloc(st.st_size + 1);
+    uint64_t n = 0;
+    ssize_t r = 1;
+    while (buf != NULL && n < (uint64_t)st.st_size && r > 0) {
+        r = read(fd, buf + n, st.st_size - n);
+        n += r > 0 ? r : 0;
+    }
+    close(fd);
+    if (buf != NULL && n < (uint64_t)st.st_size) {
+        free(buf);
+        buf = NULL;
+    }
+    *size = n;
+    return buf;
+}
+
+// compiles src to obj with args, the compiler output going to log, and returns its exit status
+int served_compile(char** args, char* src, char* obj, char* log)
+{
+    uint64_t n_args;
+    for (n_args = 0; args[n_args] != NULL; n_args++) {
+    }
+    char* extra[] = { "-c", src, "-o", obj, NULL };
+    char** run = malloc((n_args + 5) * sizeof(*run));
+    memcpy(run, args, n_args * sizeof(*run));
+    memcpy(run + n_args, extra, sizeof(extra));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, log, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+    // the server blocks the signals it stops on, the compiler gets them again
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    pid_t pid;
+    int err = posix_spawnp(&pid, run[0], &actions, &attr, run, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    free(run);
+    if (err != 0) {
+        FILE* f = fopen(log, "w");
+        if (f != NULL) {
+            fprintf(f, "worker could not run %s: %s\n", args[0], strerror(err));
+            fclose(f);
+        }
+        return 1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// receives the payload of job, compiles it and answers
+void serve_job(server_t* s, served_job_t* job)
+{
+    double picked = wall_seconds();
+    char* payload = malloc(job->size + 1);
+    uint64_t args_size = 0;
+    if (payload == NULL || !recv_all(job->fd, payload, job->size) || job->size < sizeof(args_size)) {
+        free(payload);
+        return;
+    }
+    memcpy(&args_size, payload, sizeof(args_size));
+    char* args_buf = payload + sizeof(args_size);
+    if (args_size == 0 || args_size > job->size - sizeof(args_size) || args_buf[args_size - 1] != 0) {
+        send_frame(job->fd, WORKER_REFUSED, 0, 0);
+        free(payload);
+        return;
+    }
+    uint64_t n_args = 0;
+    char* arg;
+    for (arg = args_buf; arg != args_buf + args_size; arg += strlen(arg) + 1) {
+        n_args++;
+    }
+    char** args = malloc((n_args + 1) * sizeof(*args));
+    panic_if(args == NULL, "could not allocate arguments: %s", strerror(errno));
+    for (arg = args_buf, n_args = 0; arg != args_buf + args_size; arg += strlen(arg) + 1) {
+        args[n_args++] = arg;
+    }
+    args[n_args] = NULL;
+    char* refusal = served_refusal(s, args);
+    if (refusal != NULL) {
+        if (send_frame(job->fd, WORKER_REFUSED, 0, strlen(refusal))) {
+            send_all(job->fd, refusal, strlen(refusal));
+        }
+        free(args);
+        free(payload);
+        return;
+    }
+
+    unsigned long long id = atomic_fetch_add(&s->next_id, 1);
+    char* src;
+    char* obj;
+    char* log;
+    panic_if(asprintf(&src, "%s/%llu.i", s->tmp_dir, id) < 0 || asprintf(&obj, "%s/%llu.o", s->tmp_dir, id) < 0
+            || asprintf(&log, "%s/%llu.log", s->tmp_dir, id) < 0,
+        "could not allocate path");
+    int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    panic_if(fd < 0, "could not open %s: %s", src, strerror(errno));
+    uint64_t source_offset = sizeof(args_size) + args_size;
+    write_all_at(fd, payload + source_offset, job->size - source_offset, 0, src);
+    close(fd);
+
+    double start = wall_seconds();
+    int status = served_compile(args, src, obj, log);
+    double compiled = wall_seconds();
+    worker_result_t r = { (picked - job->accepted) * 1e9, (compiled - start) * 1e9, 0, 0 };
+    char* obj_data = status == 0 ? read_whole_file(obj, &r.obj_size) : NULL;
+    char* log_data = read_whole_file(log, &r.log_size);
+    if (obj_data == NULL) {
+        r.obj_size = 0;
+        status = status == 0 ? 1 : status;
+    }
+    if (log_data == NULL) {
+        r.log_size = 0;
+    }
+    if (send_frame(job->fd, WORKER_RESULT, status, sizeof(r) + r.obj_size + r.log_size) && send_all(job->fd, &r, sizeof(r))
+        && send_all(job->fd, obj_data, r.obj_size)) {
+        send_all(job->fd, log_data, r.log_size);
+    }
+    if (s->verbose) {
+        printf("compiled %s: exit %d, %llu bytes, queued %.3fs, compiled in %.3fs\n", args[0], status,
+               (unsigned long long)r.obj_size, r.queue_nanoseconds / 1e9, r.compile_nanoseconds / 1e9);
+        fflush(stdout);
+    }
+    unlink(src);
+    unlink(obj);
+    unlink(log);
+    free(obj_data);
+    free(log_data);
+    free(src);
+    free(obj);
+    free(log);
+    free(args);
+    free(payload);
+}
+
+void* serve_worker(void* arg)
+{
+    server_t* s = arg;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->head == NULL) {
+            pthread_cond_wait(&s->ready, &s->lock);
+        }
+        served_job_t* job = s->head;
+        s->head = job->next;
+        if (s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->waiting--;
+        pthread_mutex_unlock(&s->lock);
+        serve_job(s, job);
+        close(job->fd);
+        free(job);
+    }
+    return NULL;
+}
+
+// Reads the header of a connection on its own thread, so that a slow or idle client holds up no other one. A HELLO is
+// answered, a JOB is queued for the compile threads unless as many jobs wait as there are slots.
+void* serve_connection(void* arg)
+{
+    served_job_t* job = arg;
+    server_t* s = job->server;
+    int fd = job->fd;
+    worker_frame_t f;
+    if (!recv_all(fd, &f, sizeof(f)) || memcmp(f.magic, WORKER_MAGIC, sizeof(f.magic)) != 0) {
+        close(fd);
+        free(job);
+        return NULL;
+    }
+    if (f.type == WORKER_HELLO) {
+        send_frame(fd, WORKER_HELLO, s->slots, 0);
+        close(fd);
+        free(job);
+        return NULL;
+    }
+    pthread_mutex_lock(&s->lock);
+    bool busy = s->waiting >= s->slots;
+    bool queued = f.type == WORKER_JOB && f.size <= WORKER_MAX_PAYLOAD && !busy;
+    if (queued) {
+        job->size = f.size;
+        if (s->tail != NULL) {
+            s->tail->next = job;
+        } else {
+            s->head = job;
+        }
+        s->tail = job;
+        s->waiting++;
+        pthread_cond_signal(&s->ready);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!queued) {
+        send_frame(fd, busy ? WORKER_BUSY : WORKER_REFUSED, 0, 0);
+        close(fd);
+        free(job);
+    }
+    return NULL;
+}
+
+// removes dir and the files in it
+void remove_flat_dir(char* dir)
+{
+    DIR* d = opendir(dir);
+    if (d != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(d)) != NULL) {
+            if (strcmp(entry->d_name, "..") != 0 && strcmp(entry->d_name, ".") != 0) {
+                unlinkat(dirfd(d), entry->d_name, 0);
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+// Serves compiles of the given compilers on slots threads until pp gets SIGINT, SIGTERM or SIGHUP, then removes its
+// temporary directory and unix socket and exits.
+void serve_compiles(char* address, char** compilers, uint64_t n_compilers, uint64_t slots, bool verbose)
+{
+    static char* default_compilers[] = { "cc", "gcc", "clang" };
+    server_t s = { 0 };
+    s.compilers = n_compilers > 0 ? compilers : default_compilers;
+    s.n_compilers = n_compilers > 0 ? n_compilers : sizeof(default_compilers) / sizeof(*default_compilers);
+    s.slots = slots;
+    s.verbose = verbose;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.ready, NULL);
+    atomic_init(&s.next_id, 0);
+
+    // blocked before any thread starts, so that they all leave the stop signals to stop_fd
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    panic_if(pthread_sigmask(SIG_BLOCK, &stop, NULL) != 0, "could not block signals");
+    int stop_fd = signalfd(-1, &stop, SFD_CLOEXEC);
+    panic_if(stop_fd < 0, "could not wait for signals: %s", strerror(errno));
+
+    char* tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    s.tmp_dir = malloc(strlen(tmp) + 32);
+    sprintf(s.tmp_dir, "%s/pp_worker.XXXXXX", tmp);
+    panic_if(mkdtemp(s.tmp_dir) == NULL, "could not create %s: %s", s.tmp_dir, strerror(errno));
+
+    int listener = worker_listen(address);
+    uint64_t i;
+    for (i = 0; i < slots; i++) {
+        pthread_t thread;
+        panic_if(pthread_create(&thread, NULL, serve_worker, &s) != 0, "could not start compile thread");
+    }
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    printf("serving %s with %llu slots\n", address, (unsigned long long)slots);
+    fflush(stdout);
+
+    struct pollfd fds[2] = { { listener, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            panic_if(errno != EINTR, "could not wait on %s: %s", address, strerror(errno));
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            panic_if(errno != EINTR && errno != ECONNABORTED && errno != EMFILE && errno != ENFILE, "could not accept on %s: %s",
+                address, strerror(errno));
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct timeval timeout = { WORKER_HEADER_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        served_job_t* job = malloc(sizeof(*job));
+        panic_if(job == NULL, "could not allocate job: %s", strerror(errno));
+        *job = (served_job_t) { &s, fd, 0, wall_seconds(), NULL };
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, serve_connection, job) != 0) {
+            send_frame(fd, WORKER_BUSY, 0, 0);
+            close(fd);
+            free(job);
+        }
+    }
+
+    close(listener);
+    if (strncmp(address, "unix:", 5) == 0) {
+        unlink(address + 5);
+    }
+    remove_flat_dir(s.tmp_dir);
+    if (verbose) {
+        printf("stopped serving %s\n", address);
+    }
+    exit(0);
+}
+
+char usage[] = "usage: pp [options] [path_to_directory] [name_of_executebale] [flags]\n"
+               "  -t, --threads=N    walk the directory tree with N threads (default: number of online cpus)\n"
+               "  -l, --hardlink     hardlink files into the package instead of copying them, for read-only packaging\n"
+               "  -v, --verbose      print which copy method (hardlink, reflink, copy_file_range, sendfile, read/write) each file took\n"
+               "  -e, --entry=FILE   only package files reachable through #include from FILE (may be repeated)\n"
+               "  -a, --archive=FILE write the package as a single indexed archive instead of the package directory\n"
+               "  -d, --dedup        store files with identical content once: hardlinked in the package, shared in an archive\n"
+               "  -z, --compress     compress the files of the archive with N threads, unpack.c in it extracts them without pp\n"
+               "  -u, --unity=N      compile up to N translation units at once through generated pp_unity_*.c sources\n"
+               "      --unity-bytes=N  start a new unity batch before its sources exceed N bytes\n"
+               "      --unity-exclude=FILE  compile the files listed in FILE (one per line) on their own\n"
+               "      --uring[=DEPTH] copy small files through io_uring with DEPTH (default 64) files in flight\n"
+               "  -p, --pipeline     copy files with N threads while the tree is still being walked\n"
+               "  -w, --watch        keep the package in sync with the tree after the first pass, until killed\n"
+               "      --stats[=json] report time, counters and syscalls of every phase, as text or JSON\n"
+               "      --pch[=PERCENT] precompile the headers that at least PERCENT (default 50) percent of the translation units include\n"
+               "  a .ppignore in any directory excludes entries below it with .gitignore globs\n"
+               "\n"
+               "       pp -x ARCHIVE [-C directory] [-t threads] [entry...]\n"
+               "  -x, --extract=FILE extract the given entries (default: all) of an archive with N threads\n"
+               "  -C, --directory=DIR write the package to or extract into DIR (default: package)\n"
+               "\n"
+               "       pp --serve=ADDRESS [-t slots] [-v] [compiler...]\n"
+               "      --serve=ADDRESS compile units sent by compile.c -w on unix:PATH or tcp:HOST:PORT with N threads, until killed,\n"
+               "                      with the given compilers (default: cc gcc clang), an empty HOST listens on loopback only\n";
+
+int main(int argc, char** argv)
+{
+    static struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "hardlink", no_argument, NULL, 'l' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "archive", required_argument, NULL, 'a' },
+        { "extract", required_argument, NULL, 'x' },
+        { "directory", required_argument, NULL, 'C' },
+        { "entry", required_argument, NULL, 'e' },
+        { "unity", required_argument, NULL, 'u' },
+        { "unity-bytes", required_argument, NULL, 'U' },
+        { "unity-exclude", required_argument, NULL, 'E' },
+        { "pch", optional_argument, NULL, 'P' },
+        { "stats", optional_argument, NULL, 'S' },
+        { "uring", optional_argument, NULL, 'R' },
+        { "pipeline", no_argument, NULL, 'p' },
+        { "watch", no_argument, NULL, 'w' },
+        { "compress", no_argument, NULL, 'z' },
+        { "dedup", no_argument, NULL, 'd' },
+        { "serve", required_argument, NULL, 'W' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    copy_engine_t engine = { 0 };
+    char* archive = NULL;
+    char* extract = NULL;
+    char* serve = NULL;
+    char* out = "package";
+    compile_options_t compile_opts = { 0 };
+    char** entries = calloc(argc, sizeof(*entries));
+    uint64_t n_entries = 0;
+    bool pipeline = 0;
+    bool watch = 0;
+    bool compress = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+t:lva:x:C:u:e:pwzd", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            engine.hardlink = 1;
+            break;
+        case 'v':
+            engine.verbose = 1;
+            break;
+        case 'a':
+            archive = optarg;
+            break;
+        case 'x':
+            extract = optarg;
+            break;
+        case 'W':
+            serve = optarg;
+            break;
+        case 'C':
+            out = optarg;
+            break;
+        case 'e':
+            entries[n_entries++] = optarg;
+            break;
+        case 'u':
+            compile_opts.unity_files = strtoull(optarg, NULL, 10);
+            break;
+        case 'U':
+            compile_opts.unity_bytes = strtoull(optarg, NULL, 10);
+            if (compile_opts.unity_files == 0) {
+                compile_opts.unity_files = UINT64_MAX;
+            }
+            break;
+        case 'E':
+            compile_opts.unity_exclude = load_path_set(optarg);
+            break;
+        case 'P':
+            compile_opts.pch_percent = optarg ? strtoull(optarg, NULL, 10) : 50;
+            break;
+        case 'p':
+            pipeline = 1;
+            break;
+        case 'w':
+            watch = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'd':
+            engine.dedup = 1;
+            break;
+        case 'R':
+            engine.uring_depth = optarg ? strtoull(optarg, NULL, 10) : 64;
+            break;
+        case 'S':
+            stats.enabled = 1;
+            stats.json = optarg != NULL && strcmp(optarg, "json") == 0;
+            break;
+        default:
+            panic("%s", usage);
+        }
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    engine.n_threads = n_threads;
+    if (serve != NULL) {
+        serve_compiles(serve, argv + optind, argc - optind, n_threads, engine.verbose); // does not return
+    }
+    if (extract != NULL) {
+        phase_begin("extract");
+        extract_archive(extract, out, argv + optind, argc - optind, n_threads);
+        phase_end();
+        if (stats.enabled) {
+            stats_report(stdout);
+        }
+        return 0;
+    }
+    panic_if(argc - optind != 3, "wrong number of arguments\n%s", usage);
+    char* src_dir = argv[optind];
+    compile_opts.program_name = argv[optind + 1];
+    compile_opts.flags = argv[optind + 2];
+
+    path_table_t* paths = pt_create(16);
+    name_buf_t* file_buf = nb_create(paths, 16);
+    name_buf_t* dir_buf = nb_create(paths, 16);
+    panic_if(paths == NULL || file_buf == NULL || dir_buf == NULL, "could not allocate name buffers: %s", strerror(errno));
+    uint32_t root = pt_add(paths, PATH_NONE, src_dir);
+    panic_if(compress && archive == NULL, "--compress only applies to archives\n%s", usage);
+    panic_if(watch && (archive != NULL || n_entries > 0), "--watch keeps a package directory of the whole tree in sync\n%s", usage);
+    watch_t* w = watch ? watch_create(src_dir, out, &compile_opts, &engine) : NULL;
+
+    // pruning, archives and dedup need the whole file list before anything is written
+    pipeline = pipeline && archive == NULL && n_entries == 0 && !engine.dedup;
+    if (pipeline) {
+        phase_begin("walk_and_package");
+        walk_and_package(out, file_buf, dir_buf, root, &engine, n_threads);
+        phase_end();
+    } else {
+        phase_begin("walk");
+        if (n_threads > 1) {
+            push_all_files_in_directory_parallel(file_buf, dir_buf, root, n_threads);
+        } else {
+            push_all_files_in_directory(file_buf, dir_buf, root, NULL);
+        }
+        phase_end();
+    }
+    if (n_entries > 0) {
+        phase_begin("prune");
+        prune_unreachable(file_buf, dir_buf, entries, n_entries, compile_opts.flags);
+        phase_end();
+    }
+
+    if (archive != NULL) {
+        phase_begin("archive");
+        out_archive(archive, &compile_opts, file_buf, compress, engine.dedup, n_threads);
+        phase_end();
+    } else {
+        if (!pipeline) {
+            phase_begin("out_structure");
+            out_structure(out, dir_buf);
+            phase_end();
+            phase_begin("out_files");
+            out_files(out, file_buf, &engine);
+            phase_end();
+        }
+        if (engine.verbose) {
+            copy_engine_report(&engine);
+        }
+        phase_begin("out_compile_instructions");
+        out_compile_instructions(out, &compile_opts, file_buf);
+        phase_end();
+    }
+    if (stats.enabled) {
+        stats_report(stdout);
+    }
+    if (w != NULL) {
+        watch_run(w); // does not return
+    }
 
     nb_free(file_buf);
     nb_free(dir_buf);
+    pt_free(paths);
+    pm_free(compile_opts.unity_exclude);
+    free(entries);
 
     return 0;
 }